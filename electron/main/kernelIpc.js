@@ -0,0 +1,186 @@
+// framing of messages between main.js and the kernel over stdin/stdout
+// 'json' -- one JSON message per line, human readable, used for debugging
+// 'msgpack' -- 4 bytes little-endian length + MessagePack payload, no text scanning or escaping for large payloads
+// must be same as KernelServer::IpcFormat, the format is passed to the kernel by env POCKETRAG_IPC_FORMAT
+
+function encodeMsgpack (value) {
+  const chunks = []
+  const write = (buf) => chunks.push(buf)
+  const header = (size, ...bytes) => {
+    const buf = Buffer.alloc(size)
+    bytes.forEach(([method, v, offset]) => buf[method](v, offset))
+    return buf
+  }
+
+  const encodeValue = (v) => {
+    if (v === null || v === undefined) {
+      write(Buffer.from([0xc0]))
+    }
+    else if (typeof v === 'boolean') {
+      write(Buffer.from([v ? 0xc3 : 0xc2]))
+    }
+    else if (typeof v === 'number') {
+      if (Number.isSafeInteger(v)) {
+        if (v >= 0 && v < 0x80) write(Buffer.from([v]))
+        else if (v < 0 && v >= -32) write(header(1, ['writeInt8', v, 0]))
+        else if (v >= 0 && v <= 0xffffffff) write(header(5, ['writeUInt8', 0xce, 0], ['writeUInt32BE', v, 1]))
+        else if (v < 0 && v >= -0x80000000) write(header(5, ['writeUInt8', 0xd2, 0], ['writeInt32BE', v, 1]))
+        else write(header(9, ['writeUInt8', 0xd3, 0], ['writeBigInt64BE', BigInt(v), 1]))
+      }
+      else {
+        write(header(9, ['writeUInt8', 0xcb, 0], ['writeDoubleBE', v, 1]))
+      }
+    }
+    else if (typeof v === 'string') {
+      const str = Buffer.from(v, 'utf8')
+      if (str.length < 32) write(Buffer.from([0xa0 | str.length]))
+      else if (str.length <= 0xff) write(Buffer.from([0xd9, str.length]))
+      else if (str.length <= 0xffff) write(header(3, ['writeUInt8', 0xda, 0], ['writeUInt16BE', str.length, 1]))
+      else write(header(5, ['writeUInt8', 0xdb, 0], ['writeUInt32BE', str.length, 1]))
+      write(str)
+    }
+    else if (Array.isArray(v)) {
+      if (v.length < 16) write(Buffer.from([0x90 | v.length]))
+      else if (v.length <= 0xffff) write(header(3, ['writeUInt8', 0xdc, 0], ['writeUInt16BE', v.length, 1]))
+      else write(header(5, ['writeUInt8', 0xdd, 0], ['writeUInt32BE', v.length, 1]))
+      v.forEach(encodeValue)
+    }
+    else if (typeof v === 'object') {
+      const keys = Object.keys(v).filter((key) => v[key] !== undefined) // same as JSON.stringify
+      if (keys.length < 16) write(Buffer.from([0x80 | keys.length]))
+      else if (keys.length <= 0xffff) write(header(3, ['writeUInt8', 0xde, 0], ['writeUInt16BE', keys.length, 1]))
+      else write(header(5, ['writeUInt8', 0xdf, 0], ['writeUInt32BE', keys.length, 1]))
+      keys.forEach((key) => {
+        encodeValue(key)
+        encodeValue(v[key])
+      })
+    }
+    else {
+      throw new Error('unsupported type for msgpack: ' + typeof v)
+    }
+  }
+
+  encodeValue(value)
+  return Buffer.concat(chunks)
+}
+
+function decodeMsgpack (buf) {
+  let pos = 0
+  const str = (length) => {
+    const s = buf.toString('utf8', pos, pos + length)
+    pos += length
+    return s
+  }
+  const array = (length) => {
+    const arr = new Array(length)
+    for (let i = 0; i < length; i++) arr[i] = decodeValue()
+    return arr
+  }
+  const map = (length) => {
+    const obj = {}
+    for (let i = 0; i < length; i++) {
+      const key = decodeValue()
+      obj[key] = decodeValue()
+    }
+    return obj
+  }
+  const read = (method, size) => {
+    const v = buf[method](pos)
+    pos += size
+    return v
+  }
+
+  const decodeValue = () => {
+    const type = buf[pos++]
+    if (type < 0x80) return type
+    if (type >= 0xe0) return type - 0x100
+    if ((type & 0xf0) === 0x80) return map(type & 0x0f)
+    if ((type & 0xf0) === 0x90) return array(type & 0x0f)
+    if ((type & 0xe0) === 0xa0) return str(type & 0x1f)
+    switch (type) {
+      case 0xc0: return null
+      case 0xc2: return false
+      case 0xc3: return true
+      case 0xc4: { const n = read('readUInt8', 1); pos += n; return buf.subarray(pos - n, pos) }
+      case 0xc5: { const n = read('readUInt16BE', 2); pos += n; return buf.subarray(pos - n, pos) }
+      case 0xc6: { const n = read('readUInt32BE', 4); pos += n; return buf.subarray(pos - n, pos) }
+      case 0xca: return read('readFloatBE', 4)
+      case 0xcb: return read('readDoubleBE', 8)
+      case 0xcc: return read('readUInt8', 1)
+      case 0xcd: return read('readUInt16BE', 2)
+      case 0xce: return read('readUInt32BE', 4)
+      case 0xcf: return Number(read('readBigUInt64BE', 8))
+      case 0xd0: return read('readInt8', 1)
+      case 0xd1: return read('readInt16BE', 2)
+      case 0xd2: return read('readInt32BE', 4)
+      case 0xd3: return Number(read('readBigInt64BE', 8))
+      case 0xd9: return str(read('readUInt8', 1))
+      case 0xda: return str(read('readUInt16BE', 2))
+      case 0xdb: return str(read('readUInt32BE', 4))
+      case 0xdc: return array(read('readUInt16BE', 2))
+      case 0xdd: return array(read('readUInt32BE', 4))
+      case 0xde: return map(read('readUInt16BE', 2))
+      case 0xdf: return map(read('readUInt32BE', 4))
+      default: throw new Error('unsupported msgpack type: 0x' + type.toString(16))
+    }
+  }
+
+  return decodeValue()
+}
+
+function createKernelChannel (format) {
+  if (format === 'msgpack') {
+    let pending = Buffer.alloc(0)
+    return {
+      format,
+      encode (message) {
+        const payload = encodeMsgpack(message)
+        const frame = Buffer.alloc(4 + payload.length)
+        frame.writeUInt32LE(payload.length, 0)
+        payload.copy(frame, 4)
+        return frame
+      },
+      // return all complete messages in received data, keep the rest for next call
+      push (data) {
+        pending = pending.length ? Buffer.concat([pending, data]) : data
+        const messages = []
+        while (pending.length >= 4) {
+          const length = pending.readUInt32LE(0)
+          if (pending.length < 4 + length) break
+          try {
+            messages.push(decodeMsgpack(pending.subarray(4, 4 + length)))
+          } catch (err) {
+            console.error('failed to decode kernel message: ', err)
+          }
+          pending = pending.subarray(4 + length)
+        }
+        return messages
+      }
+    }
+  }
+
+  let buffer = ''
+  return {
+    format : 'json',
+    encode (message) {
+      return JSON.stringify(message) + '\n'
+    },
+    push (data) {
+      buffer += data.toString()
+      const lines = buffer.split('\n')
+      buffer = lines.pop()
+      const messages = []
+      for (const line of lines) {
+        if (!line.trim()) continue
+        try {
+          messages.push(JSON.parse(line))
+        } catch (err) {
+          console.error('failed to parse kernel message: ', line, err)
+        }
+      }
+      return messages
+    }
+  }
+}
+
+module.exports = { createKernelChannel, encodeMsgpack, decodeMsgpack }
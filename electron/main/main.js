@@ -4,6 +4,7 @@ const {spawn} = require('node:child_process')
 const EventEmitter = require('events')
 const fs = require('node:fs')
 const {generateInstallationId} = require('./getInstallationId.js')
+const {createKernelChannel} = require('./kernelIpc.js')
 //import electron and node modules and self-defined modules
 
 const isDev = process.env.NODE_ENV === 'development' || process.env.DEBUG_PROD === 'true' || !app.isPackaged
@@ -19,6 +20,8 @@ const repoNameAndPath = new Map() // to recorde repoName and repoPath
 const callbacks = new Map()
 const eventEmitter = new EventEmitter()
 const installationId = generateInstallationId()
+const ipcFormat = process.env.POCKETRAG_IPC_FORMAT || (isDev ? 'json' : 'msgpack') // json is readable for debugging, msgpack is faster for large messages
+const searchTracePath = process.env.POCKETRAG_SEARCH_TRACE || '' // record search messages for kernel_replay, disabled if empty
 // define global constants such as isDev -- is developer mode, dateNow -- to generate timestamp, callbacks -- to manage callbacks(may be redundant), windows -- to manage electron windows, installationId -- to avoid opening windows out-of-date and eventEmitter -- to communicate with main.js itself
 
 if(!isDev) {
@@ -43,6 +46,7 @@ let kernel
 let isKernelRunning
 let isKernelManualKill = false // avoid kernel.kill() method in restartKernel method quitting the whole app
 let hasShownErrorDialog = false // avoid showing error dialog more than once
+let kernelChannel = createKernelChannel(ipcFormat) // encode and decode messages, recreated with each kernel process
 let readyPromise = new Promise((resolve, reject) => {
   const kernelReadyListener = () => {
     eventEmitter.off('kernelReady', kernelReadyListener)
@@ -76,10 +80,13 @@ function restartKernel (isKernelError){
     isKernelManualKill = true
     kernel.kill()
   }
+  kernelChannel = createKernelChannel(ipcFormat)
   kernel = spawn(kernelPath, [], {
     cwd: path.dirname(kernelPath),
     env: {
-      POCKETRAG_USERDATA_PATH: userDataPath
+      POCKETRAG_USERDATA_PATH: userDataPath,
+      POCKETRAG_IPC_FORMAT: ipcFormat,
+      POCKETRAG_SEARCH_TRACE: searchTracePath
     }
   })
   isKernelRunning = true
@@ -147,259 +154,254 @@ const callbackRegister = (callback) => {
 }
 
 
-let buffer = ''
+function writeToKernel (message) {
+  kernel.stdin.write(kernelChannel.encode(message))
+}
+
+
 async function stdoutListener (data) {
-  buffer += data.toString()
-  let lines = buffer.split('\n')
-  buffer = lines.pop()
-  console.log('the buffer is: ', buffer)
-
-  for(const line of lines){
-    if(line.trim()){
-      try{
-        console.log(line)
-        const result = JSON.parse(line)
-        console.log(result)
-        if(result.toMain){
-          switch(result.message.type) {
-            case 'stopAll':
-              if(result.isReply){
-                if(result.status.code === 'SUCCESS'){
-                  callbacks.delete(result.callbackId)
-                }
-                else {
-                  console.error(result.status.message)
-                  callbacks.delete(result.callbackId)
-                }                
-              }
-              else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
-              }
-              break
-            case 'getRepos':
-              if(result.isReply){
-                const window = windows.get(result.message.sessionId)
-                if(!window){
-                  console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
-                }
-                else {
-                  window.webContents.send('kernelData', result)
-                }                
+  for(const result of kernelChannel.push(data)){
+    try{
+      console.log(result)
+      if(result.toMain){
+        switch(result.message.type) {
+          case 'stopAll':
+            if(result.isReply){
+              if(result.status.code === 'SUCCESS'){
+                callbacks.delete(result.callbackId)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
-              }
-              break
-            case 'openRepo':
-              if(result.isReply){
-                if(result.status.code === 'SUCCESS'){
-                  callbacks.delete(result.callbackId)
-                }
-                else {
-                  console.error(result.status.message)
-                  const window = windows.get(result.message.sessionId)
-                  if(!window) {
-                    console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
-                  }
-                  else {
-                    dialog.showMessageBoxSync(window, {
-                      type : 'error',
-                      title : result.status.code,
-                      message : result.status.message,
-                      modal : true
-                    })
-                    window.close()
-                    createWindow()
-                  }
-                  callbacks.delete(result.callbackId)
-                }
+                console.error(result.status.message)
+                callbacks.delete(result.callbackId)
+              }                
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'getRepos':
+            if(result.isReply){
+              const window = windows.get(result.message.sessionId)
+              if(!window){
+                console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
-              }
-              break
-            case 'closeRepo':
-              if(result.isReply){
-                if(result.status.code === 'SUCCESS'){
+                window.webContents.send('kernelData', result)
+              }                
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'openRepo':
+            if(result.isReply){
+              if(result.status.code === 'SUCCESS'){
                 callbacks.delete(result.callbackId)
-                }
-                else {
-                  console.error(result.status.message)
-                  callbacks.delete(result.callbackId)
-                }                
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
-              }
-              break
-            case 'createRepo':
-              if(result.isReply){
-                if(result.status.code === 'SUCCESS'){
-                  const window = windows.get(result.message.sessionId)
-                  if(!window){
-                    console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
-                  }
-                  else {
-                    window.webContents.send('kernelData', result)
-                  }
-                  callbacks.delete(result.callbackId)
+                console.error(result.status.message)
+                const window = windows.get(result.message.sessionId)
+                if(!window) {
+                  console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
                 }
                 else {
-                  console.error(result.status.message)
-                  callbacks.delete(result.callbackId)
-                }                
-              }
-              else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
-              }
-              break
-            case 'ready':
-              if(!result.isReply){
-                let reply = result
-                eventEmitter.emit('kernelReady')
-                reply.isReply = true
-                reply.status = {
-                  code : 'SUCCESS',
-                  message : ''
+                  dialog.showMessageBoxSync(window, {
+                    type : 'error',
+                    title : result.status.code,
+                    message : result.status.message,
+                    modal : true
+                  })
+                  window.close()
+                  createWindow()
                 }
-                kernel.stdin.write(JSON.stringify(reply) + '\n')
-                console.log(JSON.stringify(reply) + '\n')                
+                callbacks.delete(result.callbackId)
               }
-              else {
-                console.error('isReply may be wrong, expected: false, but the result is: ', result)
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'closeRepo':
+            if(result.isReply){
+              if(result.status.code === 'SUCCESS'){
+              callbacks.delete(result.callbackId)
               }
-              break
-            case 'deleteRepo':
-              if(result.isReply){
-                if(result.status.code === 'SUCCESS'){
-                  const window = windows.get(result.message.sessionId)
-                  if(!window){
-                    console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
-                  }
-                  else {
-                    window.webContents.send('kernelData', result)
-                  }
-                  callbacks.delete(result.callbackId)
+              else {
+                console.error(result.status.message)
+                callbacks.delete(result.callbackId)
+              }                
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'createRepo':
+            if(result.isReply){
+              if(result.status.code === 'SUCCESS'){
+                const window = windows.get(result.message.sessionId)
+                if(!window){
+                  console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
                 }
-                else{
-                  console.error(result.status.message)
-                  callbacks.delete(result.callbackId)
+                else {
+                  window.webContents.send('kernelData', result)
                 }
+                callbacks.delete(result.callbackId)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
-              }
-              break
-            case 'kernelServerCrashed':
-              if(!result.isReply){
-                console.error(result.message.error)
-                isKernelRunning = false
-                restartKernel(false)
-              }
-              else {
-                console.error('isReply may be wrong, expected: false, but the result is: ', result)
+                console.error(result.status.message)
+                callbacks.delete(result.callbackId)
+              }                
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'ready':
+            if(!result.isReply){
+              let reply = result
+              eventEmitter.emit('kernelReady')
+              reply.isReply = true
+              reply.status = {
+                code : 'SUCCESS',
+                message : ''
               }
-              break
-            case 'checkSettings':
-              if(result.isReply) {
-                const window = windows.get(result.message.windowId)
-                if(!window) {
-                  console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
+              writeToKernel(reply)
+              console.log(JSON.stringify(reply) + '\n')                
+            }
+            else {
+              console.error('isReply may be wrong, expected: false, but the result is: ', result)
+            }
+            break
+          case 'deleteRepo':
+            if(result.isReply){
+              if(result.status.code === 'SUCCESS'){
+                const window = windows.get(result.message.sessionId)
+                if(!window){
+                  console.error('Window not found from sessionId: ' + result.message.sessionId + ', the whole message is: ' + result)
                 }
                 else {
                   window.webContents.send('kernelData', result)
                 }
+                callbacks.delete(result.callbackId)
+              }
+              else{
+                console.error(result.status.message)
+                callbacks.delete(result.callbackId)
+              }
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'kernelServerCrashed':
+            if(!result.isReply){
+              console.error(result.message.error)
+              isKernelRunning = false
+              restartKernel(false)
+            }
+            else {
+              console.error('isReply may be wrong, expected: false, but the result is: ', result)
+            }
+            break
+          case 'checkSettings':
+            if(result.isReply) {
+              const window = windows.get(result.message.windowId)
+              if(!window) {
+                console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
+                window.webContents.send('kernelData', result)
               }
-              break
-            case 'updateSettings':
-              if(result.isReply) {
-                if(result.status.code === 'SUCCESS') {
-                  callbacks.delete(result.callbackId)
-                }
-                else {
-                  console.error(result.status.message)
-                  callbacks.delete(result.callbackId)
-                }
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'updateSettings':
+            if(result.isReply) {
+              if(result.status.code === 'SUCCESS') {
+                callbacks.delete(result.callbackId)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
+                console.error(result.status.message)
+                callbacks.delete(result.callbackId)
               }
-              break
-            case 'setApiKey':
-              if(result.isReply) {
-                if(result.status.code === 'SUCCESS') {
-                  callbacks.delete(result.callbackId)
-                }
-                else {
-                  console.error(result.status.message)
-                  callbacks.delete(result.callbackId)
-                }
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'setApiKey':
+            if(result.isReply) {
+              if(result.status.code === 'SUCCESS') {
+                callbacks.delete(result.callbackId)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
+                console.error(result.status.message)
+                callbacks.delete(result.callbackId)
               }
-              break
-            case 'getApiKey':
-              if(result.isReply) {
-                const window = windows.get(result.message.windowId)
-                if(!window) {
-                  console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
-                }
-                else {
-                  window.webContents.send('kernelData', result)
-                }
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'getApiKey':
+            if(result.isReply) {
+              const window = windows.get(result.message.windowId)
+              if(!window) {
+                console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
+                window.webContents.send('kernelData', result)
               }
-              break
-            case 'testApi':
-              if(result.isReply) {
-                const window = windows.get(result.message.windowId)
-                if(!window) {
-                  console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
-                }
-                else {
-                  window.webContents.send('kernelData', result)
-                }
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'testApi':
+            if(result.isReply) {
+              const window = windows.get(result.message.windowId)
+              if(!window) {
+                console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
+                window.webContents.send('kernelData', result)
               }
-              break
-            case 'getAvailableHardware':
-              if(result.isReply) {
-                const window = windows.get(result.message.windowId)
-                if(!window) {
-                  console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
-                }
-                else {
-                  window.webContents.send('kernelData', result)
-                }
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
+          case 'getAvailableHardware':
+            if(result.isReply) {
+              const window = windows.get(result.message.windowId)
+              if(!window) {
+                console.error('Window not found from sessionId: ' + result.message.windowId + ', the whole message is: ' + result)
               }
               else {
-                console.error('isReply may be wrong, expected: true, but the result is: ', result)
+                window.webContents.send('kernelData', result)
               }
-              break
+            }
+            else {
+              console.error('isReply may be wrong, expected: true, but the result is: ', result)
+            }
+            break
 
-          }
         }
-        else {
-          const window = windows.get(result.sessionId)
+      }
+      else {
+        const window = windows.get(result.sessionId)
 
-          if(!window) {
-            console.error('Window not found from sessionId: ' + result.sessionId + ', the whole message is: ', result)
-          }
-          else {
-            window.webContents.send('kernelData', result)
-          } 
+        if(!window) {
+          console.error('Window not found from sessionId: ' + result.sessionId + ', the whole message is: ', result)
         }
-      } catch(err){
-        console.error(err)
+        else {
+          window.webContents.send('kernelData', result)
+        } 
       }
+    } catch(err){
+      console.error(err)
     }
   }
 
@@ -421,7 +423,7 @@ function getRepos (event, callbackId) {
       sessionId : windowId
     }
   }
-  kernel.stdin.write(JSON.stringify(getRepos) + '\n')
+  writeToKernel(getRepos)
   console.log(JSON.stringify(getRepos) + '\n')
 }
 
@@ -456,7 +458,7 @@ async function openRepo (event, sessionId, repoName, repoPath){
       sessionId : sessionId
     }
   }
-  kernel.stdin.write(JSON.stringify(openRepo) + '\n')
+  writeToKernel(openRepo)
   console.log(JSON.stringify(openRepo) + '\n')
 }
 
@@ -500,14 +502,14 @@ async function createRepo (event) {
         sessionId : windowId
       }
     }
-    kernel.stdin.write(JSON.stringify(createRepo) + '\n')    
+    writeToKernel(createRepo)    
     console.log(JSON.stringify(createRepo) + '\n')
   }
 }
 
 
 
-function search(event, callbackId, query, accuracy) {
+function search(event, callbackId, query, accuracy, incremental = false, prefix = false) {
   const sessionId = getWindowId(BrowserWindow.fromWebContents(event.sender))
   const search = {
     sessionId : sessionId,
@@ -519,10 +521,12 @@ function search(event, callbackId, query, accuracy) {
     message : {
       type : 'search',
       query : query,
-      accuracy : accuracy
+      accuracy : accuracy,
+      incremental : incremental,
+      prefix : prefix
     }
   }
-  kernel.stdin.write(JSON.stringify(search) + '\n')
+  writeToKernel(search)
   console.log(JSON.stringify(search) + '\n')
 }
 
@@ -532,13 +536,13 @@ function sessionPreparedReply(event, reply){
   if(isSessionPrepared.has(windowId)) {
     isSessionPrepared.set(windowId, true)
   }
-  kernel.stdin.write(JSON.stringify(reply) + '\n')
+  writeToKernel(reply)
   console.log(JSON.stringify(reply) + '\n')
 }
 
 
 function embeddingStatusReply(event, reply){
-  kernel.stdin.write(JSON.stringify(reply) + '\n')
+  writeToKernel(reply)
   console.log(JSON.stringify(reply) + '\n')
 }
 
@@ -572,7 +576,7 @@ async function restartSession(event, repoName) {
     }
   }
   await readyPromise
-  kernel.stdin.write(JSON.stringify(restartSession) + '\n')
+  writeToKernel(restartSession)
   console.log(JSON.stringify(restartSession) + '\n')
 }
 
@@ -593,7 +597,7 @@ function beginConversation(event, callbackId, modelName, conversationId, query){
       query : query
     }
   }
-  kernel.stdin.write(JSON.stringify(beginConversation) + '\n')
+  writeToKernel(beginConversation)
   console.log(JSON.stringify(beginConversation) + '\n')
 }
 
@@ -612,7 +616,7 @@ function stopConversation(event, callbackId, conversationId){
       conversationId : conversationId
     }
   }
-  kernel.stdin.write(JSON.stringify(stopConversation) + '\n')
+  writeToKernel(stopConversation)
   console.log(JSON.stringify(stopConversation) + '\n')
 }
 
@@ -651,7 +655,7 @@ function deleteRepo (event, repoName){
       sessionId : windowId
     }
   }
-  kernel.stdin.write(JSON.stringify(deleteRepo) + '\n')
+  writeToKernel(deleteRepo)
   console.log(JSON.stringify(deleteRepo) + '\n')
 }
 
@@ -669,7 +673,7 @@ function getApiUsage(event, callbackId) {
       type : 'getApiUsage'
     }
   }
-  kernel.stdin.write(JSON.stringify(getApiUsage) + '\n')
+  writeToKernel(getApiUsage)
   console.log(JSON.stringify(getApiUsage) + '\n')
 }
 
@@ -690,7 +694,7 @@ function checkSettings(event, callbackId, settings) {
         windowId : windowId
       }
     }
-    kernel.stdin.write(JSON.stringify(checkSettings) + '\n')
+    writeToKernel(checkSettings)
     console.log(JSON.stringify(checkSettings) + '\n')
   }catch(err) {
     console.error('writing settings-modified.json failed: ', err)
@@ -713,7 +717,7 @@ function updateSettings(event, settings) {
         type : 'updateSettings'
       }
     }
-    kernel.stdin.write(JSON.stringify(updateSettings) + '\n')
+    writeToKernel(updateSettings)
     console.log(JSON.stringify(updateSettings) + '\n')
   }catch(err) {
     console.error('writing settings.json failed: ', err)
@@ -736,7 +740,7 @@ function setApiKey(event, modelName, apiKey) {
       apiKey : apiKey
     }
   }
-  kernel.stdin.write(JSON.stringify(setApiKey) + '\n')
+  writeToKernel(setApiKey)
   console.log(JSON.stringify(setApiKey) + '\n')
 }
 
@@ -756,7 +760,7 @@ function getApiKey(event, callbackId, modelName) {
       windowId : windowId
     }
   }
-  kernel.stdin.write(JSON.stringify(getApiKey) + '\n')
+  writeToKernel(getApiKey)
   console.log(JSON.stringify(getApiKey) + '\n')
 }
 
@@ -778,12 +782,12 @@ function testApi(event, callbackId, modelName, url, api) {
       windowId : windowId
     }
   }
-  kernel.stdin.write(JSON.stringify(testApi) + '\n')
+  writeToKernel(testApi)
   console.log(JSON.stringify(testApi) + '\n')
 }
 
 
-function getChunksInfo(event, callbackId) {
+function getChunksInfo(event, callbackId, afterChunkId = -1) {
   const sessionId = getWindowId(BrowserWindow.fromWebContents(event.sender))
   const getChunksInfo = {
     sessionId : sessionId,
@@ -793,10 +797,11 @@ function getChunksInfo(event, callbackId) {
     isReply : false,
 
     message : {
-      type : 'getChunksInfo'
+      type : 'getChunksInfo',
+      afterChunkId : afterChunkId
     }
   }
-  kernel.stdin.write(JSON.stringify(getChunksInfo) + '\n')
+  writeToKernel(getChunksInfo)
   console.log(JSON.stringify(getChunksInfo) + '\n')
 }
 
@@ -815,7 +820,7 @@ function getAvailableHardware(event, callbackId) {
       windowId : windowId
     }
   }
-  kernel.stdin.write(JSON.stringify(getAvailableHardware) + '\n')
+  writeToKernel(getAvailableHardware)
   console.log(JSON.stringify(getAvailableHardware) + '\n')
 }
 
@@ -1039,7 +1044,7 @@ function createWindow (event, windowType = 'repoList', windowState = null) {
             sessionId : windowId,
           }
         }
-        kernel.stdin.write(JSON.stringify(closeRepo) + '\n')
+        writeToKernel(closeRepo)
         console.log(JSON.stringify(closeRepo) + '\n')
         windows.delete(windowId)
         isSessionPrepared.delete(windowId)
@@ -1187,7 +1192,7 @@ async function createFirstWindow() {
         }
       }
       await readyPromise
-      kernel.stdin.write(JSON.stringify(openRepo) + '\n')
+      writeToKernel(openRepo)
       console.log(JSON.stringify(openRepo) + '\n')
     }
   }catch(err) {
@@ -1322,10 +1327,12 @@ function getConversation(event, repoPath) {
   const convDir = path.join(repoPath, '.PocketRAG', 'conversation')
   try {
     if(!fs.existsSync(convDir)) return []
-    return fs.readdirSync(convDir).filter(name => name.endsWith('.json') && !name.includes('_full')).map(name => {
-      const match = name.match(/^conversation-(\d+)\.json$/)
+    // conversation-<id>.jsonl, or legacy conversation-<id>.json which is converted by kernel when the conversation is opened
+    const conversationIds = fs.readdirSync(convDir).map(name => {
+      const match = name.match(/^conversation-(\d+)\.jsonl?$/)
       return match ? parseInt(match[1]) : null
     }).filter(Boolean)
+    return [...new Set(conversationIds)]
   }catch(err) {
     console.error('getConversation failed: ', err)
     return []
@@ -1333,6 +1340,82 @@ function getConversation(event, repoPath) {
 }// get conversation history
 
 
+function readFirstLine(filePath) {
+  const fd = fs.openSync(filePath, 'r')
+  try {
+    const chunks = []
+    const block = Buffer.alloc(4096)
+    let position = 0
+    let bytesRead = 0
+    while((bytesRead = fs.readSync(fd, block, 0, block.length, position)) > 0) {
+      const end = block.subarray(0, bytesRead).indexOf('\n')
+      chunks.push(Buffer.from(block.subarray(0, end === -1 ? bytesRead : end)))
+      if(end !== -1) break
+      position += bytesRead
+    }
+    return Buffer.concat(chunks).toString('utf-8')
+  }finally {
+    fs.closeSync(fd)
+  }
+}
+
+
+// read blocks from the end until a complete line is found, so long histories are not read
+function readLastLine(filePath) {
+  const fd = fs.openSync(filePath, 'r')
+  try {
+    let position = fs.fstatSync(fd).size
+    let tail = Buffer.alloc(0)
+    while(position > 0) {
+      const length = Math.min(64 * 1024, position)
+      position -= length
+      const block = Buffer.alloc(length)
+      fs.readSync(fd, block, 0, length, position)
+      tail = Buffer.concat([block, tail])
+      const lines = tail.toString('utf-8').split('\n').filter(line => line.trim())
+      if(lines.length > 1 || (position === 0 && lines.length > 0)) return lines[lines.length - 1]
+    }
+    return null
+  }finally {
+    fs.closeSync(fd)
+  }
+}
+
+
+// parse a history file into {conversationId, topic, history}
+// .jsonl: a header line and one line per turn, legacy .json: the whole object
+// summaryOnly: only the header and the last turn are read, enough for the conversation list
+function getConversationHistory(event, filePath, summaryOnly = false) {
+  try {
+    if(!fs.existsSync(filePath) && filePath.endsWith('.jsonl') && fs.existsSync(filePath.slice(0, -1))) {
+      filePath = filePath.slice(0, -1) // not converted yet
+    }
+    if(filePath.endsWith('.json')) {
+      return JSON.parse(fs.readFileSync(filePath, {encoding: 'utf-8'}))
+    }
+    if(summaryOnly) {
+      const header = JSON.parse(readFirstLine(filePath))
+      const lastLine = readLastLine(filePath)
+      const lastTurn = lastLine ? JSON.parse(lastLine) : null
+      return {...header, history: lastTurn && lastTurn.query !== undefined ? [lastTurn] : []}
+    }
+    const lines = fs.readFileSync(filePath, {encoding: 'utf-8'}).split('\n').filter(line => line.trim())
+    const history = []
+    for(const line of lines.slice(1)) {
+      try {
+        history.push(JSON.parse(line))
+      }catch(err) {
+        console.error('跳过损坏的对话记录:', err) // such as a line partly written when the app crashed
+      }
+    }
+    return {...JSON.parse(lines[0]), history}
+  }catch(err) {
+    console.error('读取对话记录失败:', err)
+    return null
+  }
+}// expose it to the renderer process
+
+
 function updateFile(event, path, data) {
   try {
     console.log('更新文件内容')
@@ -1466,6 +1549,7 @@ app.whenReady().then(async () => {
   ipcMain.handle('repoListCheck', checkRepoList)
   ipcMain.on('watchRepoDir', watchRepoDir)
   ipcMain.handle('getConversation', getConversation)
+  ipcMain.handle('getConversationHistory', getConversationHistory)
   ipcMain.on('updateFile', updateFile)
   ipcMain.handle('getFile', getFile)
   ipcMain.handle('deleteRepoCheck', deleteRepoCheck)
@@ -1512,10 +1596,13 @@ app.whenReady().then(async () => {
   }
   // use default settings if needed
 
+  kernelChannel = createKernelChannel(ipcFormat)
   kernel = spawn(kernelPath, [], {
     cwd: path.dirname(kernelPath), // set work directory to the same as the kernel path
     env: {
-      POCKETRAG_USERDATA_PATH: userDataPath
+      POCKETRAG_USERDATA_PATH: userDataPath,
+      POCKETRAG_IPC_FORMAT: ipcFormat,
+      POCKETRAG_SEARCH_TRACE: searchTracePath
     }
   })
   isKernelRunning = true
@@ -1575,7 +1662,7 @@ app.on('will-quit', (event) => {
         type : 'stopAll'
       }
     }
-    kernel.stdin.write(JSON.stringify(stopAll) + '\n')
+    writeToKernel(stopAll)
     console.log(JSON.stringify(stopAll) + '\n')
     event.preventDefault()
   }
@@ -11,7 +11,7 @@ contextBridge.exposeInMainWorld('electronAPI', {
 
   createRepo : () => ipcRenderer.send('createRepo'),
 
-  search : (callbackId, query, accuracy) => ipcRenderer.send('search', callbackId, query, accuracy),
+  search : (callbackId, query, accuracy, incremental, prefix) => ipcRenderer.send('search', callbackId, query, accuracy, incremental, prefix),
 
   createNewWindow : (windowType) => ipcRenderer.invoke('createNewWindow', windowType),
 
@@ -60,6 +60,9 @@ contextBridge.exposeInMainWorld('electronAPI', {
 
   getConversation : (repoPath) => ipcRenderer.invoke('getConversation', repoPath),
 
+  getConversationHistory : (filePath, summaryOnly = false) => ipcRenderer.invoke('getConversationHistory', filePath, summaryOnly),
+  //get {conversationId, topic, history} of a conversation history file
+
   updateFile : (path, data) => ipcRenderer.send('updateFile', path, data),
 
   getFile : (filePath) => ipcRenderer.invoke('getFile', filePath),
@@ -77,7 +80,7 @@ contextBridge.exposeInMainWorld('electronAPI', {
 
   testApi : (callbackId, modelName, url, api) => ipcRenderer.send('testApi', callbackId, modelName, url, api),
 
-  getChunksInfo : (callbackId) => ipcRenderer.send('getChunksInfo', callbackId),
+  getChunksInfo : (callbackId, afterChunkId) => ipcRenderer.send('getChunksInfo', callbackId, afterChunkId),
   
   getAvailableHardware : (callbackId) => ipcRenderer.send('getAvailableHardware', callbackId),
 
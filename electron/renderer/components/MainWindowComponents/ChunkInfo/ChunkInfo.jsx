@@ -6,6 +6,11 @@ const ChunkInfo = ({ className }) => {
     const [chunkInfo, setChunkInfo] = useState([]);
     const [loading, setLoading] = useState(true);
     const [expandedRows, setExpandedRows] = useState(new Set());
+    // 分页：只保留当前页，pageCursors[i]为第i页请求时的afterChunkId
+    const [pageCursors, setPageCursors] = useState([-1]);
+    const [pageIndex, setPageIndex] = useState(0);
+    const [hasMore, setHasMore] = useState(false);
+    const [nextChunkId, setNextChunkId] = useState(-1);
 
     // 处理展开状态的函数
     const handleExpand = (key, expanded) => {
@@ -19,23 +24,54 @@ const ChunkInfo = ({ className }) => {
         setExpandedRows(newExpandedRows);
     };
 
-    // 获取分块信息
+    // 获取当前页的分块信息
     useEffect(() => {
         const fetchChunkInfo = async () => {
             try {
                 setLoading(true);
-                const result = await window.getChunksInfo();
-                setChunkInfo(result || []);
+                const result = await window.getChunksInfo(pageCursors[pageIndex]);
+                setChunkInfo(result?.chunkInfo || []);
+                setHasMore(!!result?.hasMore);
+                setNextChunkId(result?.nextChunkId ?? -1);
+                setExpandedRows(new Set());
             } catch (error) {
                 console.error("获取分块信息出错:", error);
                 setChunkInfo([]);
+                setHasMore(false);
             } finally {
                 setLoading(false);
             }
         };
 
         fetchChunkInfo();
-    }, []);
+    }, [pageIndex, pageCursors]);
+
+    // 翻页，下一页从本页最后一个chunkId之后开始
+    const handleNextPage = () => {
+        if (!hasMore) return;
+        setPageCursors(prev => [...prev.slice(0, pageIndex + 1), nextChunkId]);
+        setPageIndex(pageIndex + 1);
+    };
+
+    const handlePrevPage = () => {
+        if (pageIndex === 0) return;
+        setPageIndex(pageIndex - 1);
+    };
+
+    // 渲染翻页按钮
+    const renderPageLink = (label, enabled, onClick) => (
+        <a
+            onClick={enabled ? onClick : undefined}
+            style={{
+                color: enabled ? '#00b0b0' : '#666',
+                cursor: enabled ? 'pointer' : 'default',
+                textDecoration: 'none',
+                margin: '0 6px'
+            }}
+        >
+            {label}
+        </a>
+    );
 
     // 文本截断函数
     const truncateText = (text, maxLength) => {
@@ -338,7 +374,7 @@ const ChunkInfo = ({ className }) => {
         );
     }
 
-    if (!chunkInfo || chunkInfo.length === 0) {
+    if ((!chunkInfo || chunkInfo.length === 0) && pageIndex === 0) {
         return (
             <div
                 className="chunkinfo-container"
@@ -415,7 +451,9 @@ const ChunkInfo = ({ className }) => {
                                 fontFamily: "'Microsoft YaHei', 'SF Pro Display', -apple-system, BlinkMacSystemFont, 'Segoe UI', Roboto, sans-serif"
                             }}
                         >
-                            共 {chunkInfo.length} 个分块
+                            {renderPageLink('上一页', pageIndex > 0, handlePrevPage)}
+                            第 {pageIndex + 1} 页，本页 {chunkInfo.length} 个分块
+                            {renderPageLink('下一页', hasMore, handleNextPage)}
                         </div>
                     </div>
 
@@ -71,7 +71,7 @@ export function MainWindowInit() {
       await window.repoInitializePromise
       const conversationIds = await window.electronAPI.getConversation(window.repoPath)
       for(const conversationId of conversationIds) {
-        const conversationPath = await window.electronAPI.pathJoin(window.repoPath, '.PocketRAG', 'conversation', `conversation-${conversationId}.json`)
+        const conversationPath = await window.electronAPI.pathJoin(window.repoPath, '.PocketRAG', 'conversation', `conversation-${conversationId}.jsonl`)
         window.conversations.set(conversationId, conversationPath)
       }
     }
@@ -102,9 +102,19 @@ export function MainWindowInit() {
       await window.electronAPI.createNewWindow('repoList')
     }
 
-    window.search = async (query, accuracy = false) => {
+    // if onPartial is set, the kernel sends faster partial results (full text search, then fused results) before the final result
+    // if prefix is set, the last word of query matches the words it begins, for searching while typing
+    window.search = async (query, accuracy = false, onPartial = undefined, prefix = false) => {
       await window.sessionPreparedPromise
       const callbackId = window.callbackRegister()
+      const partialListener = (event) => {
+        if(event.detail.callbackId === callbackId) {
+          onPartial(event.detail.results, event.detail.phase)
+        }
+      }
+      if(onPartial) {
+        window.addEventListener('searchPartialResult', partialListener)
+      }
       try{
         const result = await new Promise ((resolve, reject) => {
           let timeout
@@ -113,7 +123,7 @@ export function MainWindowInit() {
             resolve(event.detail)
           }
           window.addEventListener('searchResult', listener, {once : true})
-          window.electronAPI.search(callbackId, query, accuracy)
+          window.electronAPI.search(callbackId, query, accuracy, !!onPartial, prefix)
           timeout = setTimeout(() => {
             window.removeEventListener('searchResult', listener)
             reject(new Error('search timeout'))
@@ -124,6 +134,7 @@ export function MainWindowInit() {
         console.error(err)
         throw err
       } finally {
+        window.removeEventListener('searchPartialResult', partialListener)
         window.callbacks.delete(callbackId)
       }
     }
@@ -163,7 +174,7 @@ export function MainWindowInit() {
         }
       })
       const conversationId = id ? id : Date.now()
-      if(!id)window.conversations.set(conversationId, await window.electronAPI.pathJoin(window.repoPath, '.PocketRAG','conversation',`conversation-${conversationId}.json`))
+      if(!id)window.conversations.set(conversationId, await window.electronAPI.pathJoin(window.repoPath, '.PocketRAG','conversation',`conversation-${conversationId}.jsonl`))
       window.electronAPI.beginConversation(callbackId, modelName, conversationId, query)
       window.addEventListener('conversation', window.callbacks.get(callbackId))
       return conversationId
@@ -201,24 +212,24 @@ export function MainWindowInit() {
       }
     }
 
-    window.getChunksInfo = async () => {
+    // the kernel returns chunks page by page, only one page is kept by the renderer
+    window.getChunksInfo = async (afterChunkId = -1) => {
       await window.sessionPreparedPromise
       const callbackId = window.callbackRegister()
       try {
-        const chunksInfo = await new Promise((resolve, reject) => {
+        return await new Promise((resolve, reject) => {
           let timeout
           const listener = (event) => {
             clearTimeout(timeout)
             resolve(event.detail)
           }
           window.addEventListener('getChunksInfoResult', listener, {once : true})
-          window.electronAPI.getChunksInfo(callbackId)
-          setTimeout(() => {
+          window.electronAPI.getChunksInfo(callbackId, afterChunkId)
+          timeout = setTimeout(() => {
             window.removeEventListener('getChunksInfoResult', listener)
             reject(new Error('getChunksInfo timeout!'))
           }, window.timeLimit)
         })
-        return chunksInfo
       }catch(err) {
         console.error(err)
         throw err
@@ -112,8 +112,10 @@ export default function MainWindowContents() {
 
             for (const [conversationId, conversationPath] of window.conversations.entries()) {
                 try {
-                    const historyData = await window.electronAPI.getFile(conversationPath);
-                    const history = JSON.parse(historyData);
+                    const history = await window.electronAPI.getConversationHistory(conversationPath, true);
+                    if (!history) {
+                        throw new Error(`Failed to read ${conversationPath}`);
+                    }
                     conversations.push({
                         conversationId: conversationId, // 保持原始类型，不强制转换为数字
                         topic: history.topic || `对话 ${conversationId}`,
@@ -152,8 +154,10 @@ export default function MainWindowContents() {
             }
 
             // 读取对话历史
-            const historyData = await window.electronAPI.getFile(conversationPath);
-            const conversationData = JSON.parse(historyData);
+            const conversationData = await window.electronAPI.getConversationHistory(conversationPath);
+            if (!conversationData) {
+                throw new Error(`Failed to read ${conversationPath}`);
+            }
             
             setHistory(conversationData.history || []);
             setCurrentConversationTopic(conversationData.topic || `对话 ${conversationId}`);
@@ -510,7 +514,8 @@ export default function MainWindowContents() {
         setSearchResult([]);
 
         try {
-            let result = await window.search(inputValue, true);
+            // show full text search results first, replaced when better results arrive
+            let result = await window.search(inputValue, true, (partialResult) => setSearchResult(partialResult));
             setSearchResult(result);
         } catch (error) {
             console.error('Search error:', error);
@@ -658,9 +663,11 @@ export default function MainWindowContents() {
 
             console.log('Loading conversation from path:', conversationPath);
 
-            // 使用 window.electronAPI.getFile 获取内容
-            const historyData = await window.electronAPI.getFile(conversationPath);
-            const conversationData = JSON.parse(historyData);
+            // 使用 window.electronAPI.getConversationHistory 获取内容
+            const conversationData = await window.electronAPI.getConversationHistory(conversationPath);
+            if (!conversationData) {
+                throw new Error(`Failed to read ${conversationPath}`);
+            }
 
             console.log('Loaded conversation data:', conversationData);
 
@@ -702,7 +709,7 @@ export default function MainWindowContents() {
                 window.repoPath,
                 '.PocketRAG',
                 'conversation',
-                `conversation-${newConversationId}.json`
+                `conversation-${newConversationId}.jsonl`
             );
             window.conversations.set(newConversationId, conversationPath);
             console.log('Created new conversation:', newConversationId);
@@ -33,8 +33,8 @@ const Search = ({
                     />
                 </div>
 
-                {/* 加载中状态 - 居中显示 */}
-                {isLoading && (
+                {/* 加载中状态 - 居中显示，已有部分结果时直接显示结果 */}
+                {isLoading && resultItem.length === 0 && (
                     <div
                         style={{
                             display: 'flex',
@@ -146,8 +146,8 @@ const Search = ({
                     </div>
                 )}
 
-                {/* 搜索结果容器 - 只在有结果时显示 */}
-                {!isLoading && !isTimeout && showResult && resultItem.length > 0 && (
+                {/* 搜索结果容器 - 只在有结果时显示，加载中会先显示全文搜索的部分结果 */}
+                {!isTimeout && showResult && resultItem.length > 0 && (
                     <div className='searchresult-container'>
                         <div className='result-ul-container'>
                             <ul className='result-ul'>
@@ -39,10 +39,17 @@ window.electronAPI.onKernelData(async (data) => {
       break
     case 'search':
       if(data.isReply){
-        if(data.status.code === 'SUCCESS'){
+        if(data.status.code === 'SUCCESS' && data.data.type === 'partial'){
+          const searchPartialResultEvent = new CustomEvent('searchPartialResult', {detail : {callbackId : data.callbackId, phase : data.data.phase, results : data.data.results}})
+          window.dispatchEvent(searchPartialResultEvent)
+        }
+        else if(data.status.code === 'SUCCESS'){
           const searchResultEvent = new CustomEvent('searchResult', {detail : data.data.results})
           window.dispatchEvent(searchResultEvent)        
         }
+        else if(data.status.code === 'CANCELLED') {
+          // superseded by a newer search, its result will be dispatched instead
+        }
         else {
           console.error(data.status.message)
         }        
@@ -191,7 +198,7 @@ window.electronAPI.onKernelData(async (data) => {
     case 'getChunksInfo':
       if(data.isReply) {
         if(data.status.code === 'SUCCESS'){
-          const getChunksInfoResultEvent = new CustomEvent('getChunksInfoResult', {detail : data.data.chunkInfo})
+          const getChunksInfoResultEvent = new CustomEvent('getChunksInfoResult', {detail : data.data})
           window.dispatchEvent(getChunksInfoResultEvent)
         }
         else {
@@ -0,0 +1,557 @@
+/*
+Benchmarks of kernel components, not built by default:
+    cmake --build . --target kernel_bench
+usage:
+    kernel_bench [--model <dir>] [--corpus <dir>] [--work <dir>] [--output <file>] [--scale <n>] [--filter <name>]
+
+--model   embedding model directory, `scripts/makeBenchModel.py` generates a tiny random one,
+          embedding and indexing benchmarks are skipped without it
+--corpus  directory of real .md/.txt documents, used by the chunker benchmark besides generated text
+--work    directory for temporary databases, will be cleared, default is <temp>/PocketRAG_bench/work
+--output  write the results as JSON to this file, default is stdout only
+--scale   multiply the size of every benchmark, use 0.1 for a quick check
+--filter  only run benchmarks whose name contains this string
+
+Results are printed as one JSON object, so they can be collected for trend tracking.
+Time is measured by steady_clock, latencies are in milliseconds, rates are per second.
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <sentencepiece_processor.h>
+
+#include "Chunker.h"
+#include "Metrics.h"
+#include "ONNXModel.h"
+#include "Repository.h"
+#include "SqliteConnection.h"
+#include "TextSearchTable.h"
+#include "Utils.h"
+#include "VectorTable.h"
+
+std::filesystem::path dataPath = std::filesystem::temp_directory_path() / "PocketRAG_bench";
+Logger logger(dataPath / "logs", false, Logger::Level::WARNING, 5);
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        std::filesystem::path modelPath;
+        std::filesystem::path corpusPath;
+        std::filesystem::path workPath = dataPath / "work";
+        std::filesystem::path outputPath;
+        double scale = 1.0;
+        std::string filter;
+
+        int scaled(int n) const
+        {
+            return std::max(1, static_cast<int>(n * scale));
+        }
+    };
+
+    double secondsSince(Clock::time_point begin)
+    {
+        return std::chrono::duration<double>(Clock::now() - begin).count();
+    }
+
+    // clear and return a directory under the work directory
+    std::filesystem::path freshDir(const Options &options, const std::string &name)
+    {
+        auto path = options.workPath / name;
+        std::filesystem::remove_all(path);
+        std::filesystem::create_directories(path);
+        return path;
+    }
+
+    /*
+    Deterministic random text, mixed with Chinese words so that jieba does real work.
+    Same seed always generates same text, results of different builds are comparable.
+    */
+    class TextGenerator
+    {
+    private:
+        std::mt19937 rng;
+        const std::vector<std::string> words = {
+            "kernel", "search", "index", "chunk", "vector", "query", "embedding", "document", "markdown",
+            "repository", "session", "model", "token", "latency", "thread", "queue", "cache", "table", "score",
+            "result", "rerank", "batch", "memory", "storage", "update", "insert", "delete",
+            "知识", "检索", "文档", "向量", "模型", "分词", "索引", "查询", "结果", "仓库", "对话", "内容", "标题", "段落", "性能"};
+
+        int randInt(int min, int max)
+        {
+            return std::uniform_int_distribution<int>(min, max)(rng);
+        }
+
+    public:
+        explicit TextGenerator(unsigned seed = 42) : rng(seed) {}
+
+        std::string word()
+        {
+            return words[randInt(0, static_cast<int>(words.size()) - 1)];
+        }
+
+        std::string sentence(int minWords, int maxWords)
+        {
+            std::string result;
+            int count = randInt(minWords, maxWords);
+            for (int i = 0; i < count; i++)
+            {
+                if (i > 0)
+                    result += ' ';
+                result += word();
+            }
+            return result;
+        }
+
+        // markdown document with headings, paragraphs, lists and code blocks, about targetBytes long
+        std::string markdown(size_t targetBytes)
+        {
+            std::string doc = "# " + sentence(2, 5) + "\n\n";
+            while (doc.size() < targetBytes)
+            {
+                switch (randInt(0, 5))
+                {
+                case 0:
+                    doc += "## " + sentence(2, 6) + "\n\n";
+                    break;
+                case 1:
+                    for (int i = randInt(2, 6); i > 0; i--)
+                        doc += "- " + sentence(3, 12) + "\n";
+                    doc += "\n";
+                    break;
+                case 2:
+                    doc += "```cpp\n";
+                    for (int i = randInt(2, 8); i > 0; i--)
+                        doc += "auto " + word() + " = " + word() + "(" + word() + ");\n";
+                    doc += "```\n\n";
+                    break;
+                default:
+                    doc += sentence(20, 80) + ".\n\n";
+                    break;
+                }
+            }
+            return doc;
+        }
+
+        std::vector<float> vector(int dimension)
+        {
+            std::normal_distribution<float> dist;
+            std::vector<float> v(dimension);
+            float norm = 0.0f;
+            for (auto &x : v)
+            {
+                x = dist(rng);
+                norm += x * x;
+            }
+            norm = std::sqrt(norm);
+            for (auto &x : v)
+                x /= norm;
+            return v;
+        }
+    };
+
+    std::string readFile(const std::filesystem::path &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    //--------------------------Benchmarks--------------------------//
+    nlohmann::json chunkDocuments(const std::vector<std::pair<Chunker::docType, std::string>> &docs, int maxLength)
+    {
+        size_t bytes = 0;
+        size_t chunks = 0;
+        auto begin = Clock::now();
+        for (const auto &[type, content] : docs)
+        {
+            Chunker chunker(type, maxLength);
+            chunks += chunker(content).size();
+            bytes += content.size();
+        }
+        auto seconds = secondsSince(begin);
+        nlohmann::json result;
+        result["documents"] = docs.size();
+        result["bytes"] = bytes;
+        result["chunks"] = chunks;
+        result["seconds"] = seconds;
+        result["MBPerSecond"] = bytes / 1e6 / seconds;
+        result["chunksPerSecond"] = chunks / seconds;
+        return result;
+    }
+
+    nlohmann::json benchChunker(const Options &options)
+    {
+        nlohmann::json result;
+        // jieba dictionary is loaded on first use, do not count it in chunking speed
+        auto begin = Clock::now();
+        jiebaTokenizer::get_jieba_ptr();
+        result["jiebaLoadSeconds"] = secondsSince(begin);
+
+        TextGenerator generator;
+        std::vector<std::pair<Chunker::docType, std::string>> markdownDocs;
+        std::vector<std::pair<Chunker::docType, std::string>> plainDocs;
+        for (int i = 0; i < options.scaled(200); i++)
+        {
+            markdownDocs.emplace_back(Chunker::docType::Markdown, generator.markdown(20 * 1024));
+            plainDocs.emplace_back(Chunker::docType::plainText, generator.markdown(20 * 1024));
+        }
+        result["markdown"] = chunkDocuments(markdownDocs, 512);
+        result["plainText"] = chunkDocuments(plainDocs, 512);
+
+        if (!options.corpusPath.empty())
+        {
+            std::vector<std::pair<Chunker::docType, std::string>> corpusDocs;
+            for (const auto &entry : std::filesystem::recursive_directory_iterator(options.corpusPath))
+            {
+                auto extension = entry.path().extension().string();
+                if (!entry.is_regular_file() || (extension != ".md" && extension != ".txt"))
+                    continue;
+                auto type = extension == ".md" ? Chunker::docType::Markdown : Chunker::docType::plainText;
+                corpusDocs.emplace_back(type, readFile(entry.path()));
+            }
+            result["corpus"] = chunkDocuments(corpusDocs, 512);
+        }
+        return result;
+    }
+
+    nlohmann::json benchTextSearch(const Options &options)
+    {
+        auto dir = freshDir(options, "fts");
+        SqliteConnection sqlite(dir.string(), "bench");
+        TextSearchTable table(sqlite, "bench_fts");
+        TextGenerator generator;
+        nlohmann::json result;
+
+        // insert in transactions of 1000 chunks, like DocPipe does
+        int chunkCount = options.scaled(20000);
+        auto begin = Clock::now();
+        auto trans = sqlite.beginTransaction();
+        for (int i = 1; i <= chunkCount; i++)
+        {
+            table.addChunk({generator.sentence(40, 120), "Title: " + generator.sentence(2, 6), i});
+            if (i % 1000 == 0)
+            {
+                trans.commit();
+                trans = sqlite.beginTransaction();
+            }
+        }
+        trans.commit();
+        auto seconds = secondsSince(begin);
+        result["insert"]["chunks"] = chunkCount;
+        result["insert"]["seconds"] = seconds;
+        result["insert"]["chunksPerSecond"] = chunkCount / seconds;
+
+        int queryCount = options.scaled(500);
+        Metrics::Histogram latency;
+        size_t hits = 0;
+        begin = Clock::now();
+        for (int i = 0; i < queryCount; i++)
+        {
+            auto query = generator.sentence(1, 3);
+            Metrics::ScopedTimer timer(latency);
+            hits += table.search(query, 20).size();
+        }
+        seconds = secondsSince(begin);
+        result["query"] = latency.toJson();
+        result["query"]["queriesPerSecond"] = queryCount / seconds;
+        result["query"]["meanHits"] = static_cast<double>(hits) / queryCount;
+
+        Metrics::Histogram contentLatency;
+        for (int i = 0; i < queryCount; i++)
+        {
+            Metrics::ScopedTimer timer(contentLatency);
+            table.getContent(1 + i * 7919 % chunkCount);
+        }
+        result["getContent"] = contentLatency.toJson();
+        return result;
+    }
+
+    nlohmann::json benchVectorTable(const Options &options)
+    {
+        constexpr int dimension = 384;
+        auto dir = freshDir(options, "faiss");
+        SqliteConnection sqlite(dir.string(), "bench");
+        TextGenerator generator;
+        nlohmann::json result;
+        result["dimension"] = dimension;
+
+        int vectorCount = options.scaled(20000);
+        std::vector<std::vector<float>> vectors;
+        for (int i = 0; i < vectorCount; i++)
+            vectors.push_back(generator.vector(dimension));
+
+        {
+            // one by one, as DocPipe adds vectors
+            VectorTable table(dir, "bench_single", sqlite, dimension);
+            auto begin = Clock::now();
+            auto trans = sqlite.beginTransaction();
+            for (int i = 0; i < vectorCount; i++)
+                table.addVector(i + 1, vectors[i]);
+            trans.commit();
+            auto seconds = secondsSince(begin);
+            result["addSingle"]["vectors"] = vectorCount;
+            result["addSingle"]["vectorsPerSecond"] = vectorCount / seconds;
+        }
+
+        VectorTable table(dir, "bench_batch", sqlite, dimension);
+        std::vector<VectorTable::idx_t> ids;
+        for (int i = 0; i < vectorCount; i++)
+            ids.push_back(i + 1);
+        auto begin = Clock::now();
+        {
+            auto trans = sqlite.beginTransaction();
+            table.addVector(ids, vectors);
+            trans.commit();
+        }
+        auto seconds = secondsSince(begin);
+        result["addBatch"]["vectors"] = vectorCount;
+        result["addBatch"]["vectorsPerSecond"] = vectorCount / seconds;
+
+        int queryCount = options.scaled(1000);
+        Metrics::Histogram latency;
+        begin = Clock::now();
+        for (int i = 0; i < queryCount; i++)
+        {
+            auto query = generator.vector(dimension);
+            Metrics::ScopedTimer timer(latency);
+            table.search(query, 20);
+        }
+        seconds = secondsSince(begin);
+        result["search"] = latency.toJson();
+        result["search"]["queriesPerSecond"] = queryCount / seconds;
+
+        begin = Clock::now();
+        table.write();
+        result["writeSeconds"] = secondsSince(begin);
+
+        // removing many vectors makes VectorTable rebuild the faiss index
+        std::vector<VectorTable::idx_t> removeIds(ids.begin(), ids.begin() + std::min<size_t>(ids.size(), 1000));
+        begin = Clock::now();
+        {
+            auto trans = sqlite.beginTransaction();
+            table.removeVector(removeIds);
+            trans.commit();
+        }
+        result["removeAndRebuild"]["vectors"] = removeIds.size();
+        result["removeAndRebuild"]["seconds"] = secondsSince(begin);
+        return result;
+    }
+
+    nlohmann::json benchEmbedding(const Options &options)
+    {
+        EmbeddingModel model(options.modelPath);
+        sentencepiece::SentencePieceProcessor tokenizer;
+        if (!tokenizer.Load((options.modelPath / "sentencepiece.bpe.model").string()).ok())
+            throw Error{"Failed to load tokenizer in " + options.modelPath.string(), Error::Type::FileAccess};
+
+        TextGenerator generator;
+        std::vector<std::string> texts;
+        for (int i = 0; i < 256; i++)
+            texts.push_back(generator.sentence(40, 200));
+
+        nlohmann::json result;
+        result["dimension"] = model.getDimension();
+        result["maxLength"] = model.getMaxLength();
+        model.embed(texts[0]); // warm up, the first run initializes the session
+
+        for (int batchSize : {1, 4, 16, 32})
+        {
+            int batchCount = std::max(1, options.scaled(128) / batchSize);
+            size_t tokens = 0;
+            Metrics::Histogram latency;
+            auto begin = Clock::now();
+            for (int i = 0; i < batchCount; i++)
+            {
+                std::vector<std::string> batch;
+                for (int j = 0; j < batchSize; j++)
+                {
+                    batch.push_back(texts[(i * batchSize + j) % texts.size()]);
+                    tokens += std::min<size_t>(tokenizer.EncodeAsIds(batch.back()).size() + 2, model.getMaxLength());
+                }
+                Metrics::ScopedTimer timer(latency);
+                model.embed(batch, ONNXModel::priority::background);
+            }
+            auto seconds = secondsSince(begin);
+            auto &entry = result["batch" + std::to_string(batchSize)];
+            entry = latency.toJson();
+            entry["texts"] = batchCount * batchSize;
+            entry["textsPerSecond"] = batchCount * batchSize / seconds;
+            entry["tokensPerSecond"] = tokens / seconds;
+        }
+        return result;
+    }
+
+    // generate a markdown corpus, index it with a Repository, then search it
+    nlohmann::json benchIndexing(const Options &options)
+    {
+        auto repoDir = freshDir(options, "repo");
+        TextGenerator generator;
+        int docCount = options.scaled(100);
+        size_t bytes = 0;
+        for (int i = 0; i < docCount; i++)
+        {
+            auto content = generator.markdown(8 * 1024);
+            bytes += content.size();
+            std::ofstream(repoDir / ("doc" + std::to_string(i) + ".md"), std::ios::binary) << content;
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        int doneCount = 0;
+        std::exception_ptr error = nullptr;
+        auto &chunksAdded = Metrics::counter("docpipe.chunksAdded");
+        auto chunksBefore = chunksAdded.get();
+
+        Utils::PriorityMutex sqliteMutex;
+        auto begin = Clock::now();
+        Repository repository("bench", repoDir, sqliteMutex, ONNXModel::device::cpu,
+            [&](std::exception_ptr e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = e;
+                cv.notify_all();
+            },
+            nullptr, nullptr,
+            [&](std::string) {
+                std::lock_guard<std::mutex> lock(mutex);
+                doneCount++;
+                cv.notify_all();
+            });
+        repository.configEmbedding({{"bench", "bench", options.modelPath.string(), 512}});
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!cv.wait_for(lock, std::chrono::minutes(30), [&]() { return doneCount >= docCount || error; }))
+                throw Error{"Indexing timeout, " + std::to_string(doneCount) + " of " + std::to_string(docCount) + " documents done", Error::Type::Internal};
+            if (error)
+                std::rethrow_exception(error);
+        }
+        auto seconds = secondsSince(begin);
+        auto chunks = chunksAdded.get() - chunksBefore;
+
+        nlohmann::json result;
+        result["index"]["documents"] = docCount;
+        result["index"]["bytes"] = bytes;
+        result["index"]["chunks"] = chunks;
+        result["index"]["seconds"] = seconds;
+        result["index"]["documentsPerSecond"] = docCount / seconds;
+        result["index"]["chunksPerSecond"] = chunks / seconds;
+
+        int queryCount = options.scaled(200);
+        Metrics::Histogram latency;
+        for (int i = 0; i < queryCount; i++)
+        {
+            auto query = generator.sentence(1, 4);
+            Metrics::ScopedTimer timer(latency);
+            repository.search(query, Repository::searchAccuracy::low, 10);
+        }
+        result["search"] = latency.toJson();
+        return result;
+    }
+
+    Options parseOptions(int argc, char *argv[])
+    {
+        Options options;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+                throw std::invalid_argument("missing value of " + arg);
+            std::string value = argv[++i];
+            if (arg == "--model")
+                options.modelPath = value;
+            else if (arg == "--corpus")
+                options.corpusPath = value;
+            else if (arg == "--work")
+                options.workPath = value;
+            else if (arg == "--output")
+                options.outputPath = value;
+            else if (arg == "--scale")
+                options.scale = std::stod(value);
+            else if (arg == "--filter")
+                options.filter = value;
+            else
+                throw std::invalid_argument("unknown option " + arg);
+        }
+        return options;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Utils::setupUtf8();
+    Options options;
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << "\nusage: kernel_bench [--model <dir>] [--corpus <dir>] [--work <dir>] [--output <file>] [--scale <n>] [--filter <name>]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    struct Benchmark
+    {
+        std::string name;
+        std::function<nlohmann::json(const Options &)> func;
+        bool needModel;
+    };
+    std::vector<Benchmark> benchmarks = {
+        {"chunker", benchChunker, false},
+        {"textSearch", benchTextSearch, false},
+        {"vectorTable", benchVectorTable, false},
+        {"embedding", benchEmbedding, true},
+        {"indexing", benchIndexing, true},
+    };
+
+    nlohmann::json output;
+    output["kernelVersion"] = KERNEL_VERSION;
+    output["time"] = Utils::getTimeStr();
+    output["scale"] = options.scale;
+    output["model"] = options.modelPath.string();
+    output["results"] = nlohmann::json::object();
+    for (const auto &benchmark : benchmarks)
+    {
+        if (!options.filter.empty() && benchmark.name.find(options.filter) == std::string::npos)
+            continue;
+        if (benchmark.needModel && options.modelPath.empty())
+        {
+            output["results"][benchmark.name]["skipped"] = "no --model given";
+            continue;
+        }
+        std::cerr << "running " << benchmark.name << "..." << std::endl;
+        try
+        {
+            output["results"][benchmark.name] = benchmark.func(options);
+        }
+        catch (const std::exception &e)
+        {
+            output["results"][benchmark.name]["error"] = e.what();
+        }
+    }
+    // kernel-wide metrics collected while running, such as search stages and lock waits
+    output["metrics"] = Metrics::registry().toJson();
+
+    auto text = output.dump(4);
+    std::cout << text << std::endl;
+    if (!options.outputPath.empty())
+    {
+        std::ofstream file(options.outputPath, std::ios::binary);
+        file << text;
+    }
+    std::filesystem::remove_all(options.workPath);
+    return 0;
+}
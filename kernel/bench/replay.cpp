@@ -0,0 +1,311 @@
+/*
+Replay a search trace recorded by KernelServer against a repository, not built by default:
+    cmake --build . --target kernel_replay
+record:
+    set env POCKETRAG_SEARCH_TRACE=/path/to/trace.jsonl before starting the app, every search message is appended
+usage:
+    kernel_replay --trace <file> --repo <dir> [--name <repoName>] [--models <dir>] [--reranker <dir>]
+                  [--k 10] [--warmup 5] [--baseline <file>] [--saveBaseline <file>] [--output <file>]
+
+--repo          a COPY of the repository directory, including .PocketRAG, the background process of Repository
+                will update it if documents are changed
+--name          repository name, which is the name of the .db file in .PocketRAG/db, found automatically if only one
+--models        if a model path stored in the repository does not exist, look for a directory with the same name here
+--reranker      reranker model directory, searches with high accuracy are reranked only if it is given
+--k             number of results compared with the baseline for recall@k
+--warmup        run the first n queries before measuring
+--baseline      compare results with a baseline saved by --saveBaseline, report recall@k
+--saveBaseline  save top-k chunk ids of every query, run it before changing search code
+
+Reports p50/p95/p99 latency of whole searches and of every stage (Metrics histograms "search.*"), as one JSON object.
+*/
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "Metrics.h"
+#include "ONNXModel.h"
+#include "Repository.h"
+#include "SqliteConnection.h"
+#include "Utils.h"
+
+std::filesystem::path dataPath = std::filesystem::temp_directory_path() / "PocketRAG_replay";
+Logger logger(dataPath / "logs", false, Logger::Level::WARNING, 5);
+
+namespace
+{
+    struct Options
+    {
+        std::filesystem::path tracePath;
+        std::filesystem::path repoPath;
+        std::string repoName;
+        std::filesystem::path modelsPath;
+        std::filesystem::path rerankerPath;
+        int k = 10;
+        int warmup = 5;
+        std::filesystem::path baselinePath;
+        std::filesystem::path saveBaselinePath;
+        std::filesystem::path outputPath;
+    };
+
+    struct TraceEntry
+    {
+        std::string query;
+        bool accuracy;
+        int limit;
+        bool prefix; // search-as-you-type query, the last word is matched as a prefix
+    };
+
+    Options parseOptions(int argc, char *argv[])
+    {
+        Options options;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if (i + 1 >= argc)
+                throw std::invalid_argument("missing value of " + arg);
+            std::string value = argv[++i];
+            if (arg == "--trace")
+                options.tracePath = value;
+            else if (arg == "--repo")
+                options.repoPath = value;
+            else if (arg == "--name")
+                options.repoName = value;
+            else if (arg == "--models")
+                options.modelsPath = value;
+            else if (arg == "--reranker")
+                options.rerankerPath = value;
+            else if (arg == "--k")
+                options.k = std::stoi(value);
+            else if (arg == "--warmup")
+                options.warmup = std::stoi(value);
+            else if (arg == "--baseline")
+                options.baselinePath = value;
+            else if (arg == "--saveBaseline")
+                options.saveBaselinePath = value;
+            else if (arg == "--output")
+                options.outputPath = value;
+            else
+                throw std::invalid_argument("unknown option " + arg);
+        }
+        if (options.tracePath.empty() || options.repoPath.empty())
+            throw std::invalid_argument("--trace and --repo are required");
+        return options;
+    }
+
+    std::string findRepoName(const std::filesystem::path &dbDir)
+    {
+        std::vector<std::string> names;
+        for (const auto &entry : std::filesystem::directory_iterator(dbDir))
+        {
+            if (entry.path().extension() == ".db")
+                names.push_back(entry.path().stem().string());
+        }
+        if (names.size() != 1)
+            throw std::invalid_argument(std::to_string(names.size()) + " databases found in " + dbDir.string() + ", please set --name");
+        return names[0];
+    }
+
+    // only entries of the replayed repository, a trace may contain searches of several repositories
+    std::vector<TraceEntry> readTrace(const std::filesystem::path &path, const std::string &repoName)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open())
+            throw std::invalid_argument("failed to open trace: " + path.string());
+        std::vector<TraceEntry> entries;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (line.empty())
+                continue;
+            auto json = nlohmann::json::parse(line);
+            if (json.value("repoName", repoName) != repoName)
+                continue;
+            // prefix is not in traces recorded by older versions
+            entries.push_back({json["query"].get<std::string>(), json["accuracy"].get<bool>(), json["limit"].get<int>(),
+                               json.value("prefix", false)});
+        }
+        return entries;
+    }
+
+    // embedding configs stored in the repository, so the same vector tables are used
+    Repository::EmbeddingConfigList readEmbeddingConfigs(const std::filesystem::path &dbDir, const std::string &repoName,
+                                                         const std::filesystem::path &modelsPath)
+    {
+        SqliteConnection sqlite(dbDir.string(), repoName);
+        auto stmt = sqlite.getStatement("SELECT config_name, model_name, model_path, input_length FROM embedding_config WHERE valid = 1;");
+        Repository::EmbeddingConfigList configs;
+        while (stmt.step())
+        {
+            Repository::EmbeddingConfig config;
+            config.configName = stmt.get<std::string>(0);
+            config.modelName = stmt.get<std::string>(1);
+            config.modelPath = stmt.get<std::string>(2);
+            config.inputLength = stmt.get<int>(3);
+            auto rebased = modelsPath / std::filesystem::path(config.modelPath).filename();
+            if (!std::filesystem::exists(config.modelPath) && !modelsPath.empty() && std::filesystem::exists(rebased))
+                config.modelPath = rebased.string();
+            configs.push_back(config);
+        }
+        if (configs.empty())
+            throw std::invalid_argument("no embedding config found in repository " + repoName);
+        return configs;
+    }
+
+    std::vector<int64_t> topChunkIds(const std::vector<Repository::SearchResult> &results, int k)
+    {
+        std::vector<int64_t> ids;
+        for (int i = 0; i < std::min<int>(k, results.size()); i++)
+            ids.push_back(results[i].chunkId);
+        return ids;
+    }
+
+    double recallAtK(const std::vector<int64_t> &baseline, const std::vector<int64_t> &current)
+    {
+        if (baseline.empty())
+            return current.empty() ? 1.0 : 0.0;
+        std::set<int64_t> currentSet(current.begin(), current.end());
+        auto hits = std::count_if(baseline.begin(), baseline.end(), [&](int64_t id) { return currentSet.count(id) > 0; });
+        return static_cast<double>(hits) / baseline.size();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Utils::setupUtf8();
+    Options options;
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << "\nusage: kernel_replay --trace <file> --repo <dir> [--name <repoName>] [--models <dir>] [--reranker <dir>] "
+                     "[--k 10] [--warmup 5] [--baseline <file>] [--saveBaseline <file>] [--output <file>]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        auto dbDir = options.repoPath / ".PocketRAG" / "db";
+        auto repoName = options.repoName.empty() ? findRepoName(dbDir) : options.repoName;
+        auto trace = readTrace(options.tracePath, repoName);
+        if (trace.empty())
+            throw std::invalid_argument("no search of repository " + repoName + " in trace");
+
+        Utils::PriorityMutex sqliteMutex;
+        std::mutex errorMutex;
+        std::exception_ptr error = nullptr; // error of the background process
+        Repository repository(repoName, options.repoPath, sqliteMutex, ONNXModel::device::cpu,
+                              [&](std::exception_ptr e) {
+                                  std::lock_guard<std::mutex> lock(errorMutex);
+                                  error = e;
+                              });
+        repository.configEmbedding(readEmbeddingConfigs(dbDir, repoName, options.modelsPath));
+        if (!options.rerankerPath.empty())
+            repository.configReranker(options.rerankerPath);
+
+        auto search = [&repository](const TraceEntry &entry) {
+            auto accuracy = entry.accuracy ? Repository::searchAccuracy::high : Repository::searchAccuracy::low;
+            return repository.search(entry.query, accuracy, entry.limit, nullptr, nullptr, entry.prefix);
+        };
+
+        std::cerr << "warming up with " << std::min<size_t>(options.warmup, trace.size()) << " queries..." << std::endl;
+        for (int i = 0; i < std::min<int>(options.warmup, trace.size()); i++)
+            search(trace[i]);
+        Metrics::registry().reset();
+
+        std::cerr << "replaying " << trace.size() << " queries..." << std::endl;
+        Metrics::Histogram latency;
+        std::vector<std::vector<int64_t>> topIds;
+        auto begin = std::chrono::steady_clock::now();
+        for (const auto &entry : trace)
+        {
+            Metrics::ScopedTimer timer(latency);
+            auto results = search(entry);
+            timer.stop();
+            topIds.push_back(topChunkIds(results, options.k));
+        }
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        nlohmann::json output;
+        output["kernelVersion"] = KERNEL_VERSION;
+        output["time"] = Utils::getTimeStr();
+        output["repoName"] = repoName;
+        output["queries"] = trace.size();
+        output["queriesPerSecond"] = trace.size() / seconds;
+        output["latency"]["search"] = latency.toJson();
+        for (const auto &[name, stage] : Metrics::registry().toJson()["histograms"].items())
+        {
+            if (name.starts_with("search.") || name.starts_with("lock.wait.") || name.starts_with("onnx."))
+                output["latency"][name] = stage;
+        }
+
+        if (!options.baselinePath.empty())
+        {
+            std::ifstream file(options.baselinePath, std::ios::binary);
+            auto baseline = nlohmann::json::parse(file);
+            int compared = 0;
+            int mismatched = 0;
+            double sum = 0.0;
+            double min = 1.0;
+            for (size_t i = 0; i < std::min(trace.size(), baseline["results"].size()); i++)
+            {
+                const auto &base = baseline["results"][i];
+                if (base["query"] != trace[i].query || base["accuracy"] != trace[i].accuracy ||
+                    base.value("prefix", false) != trace[i].prefix)
+                {
+                    mismatched++; // baseline of another trace
+                    continue;
+                }
+                auto baseIds = base["chunkIds"].get<std::vector<int64_t>>();
+                baseIds.resize(std::min<size_t>(baseIds.size(), options.k));
+                auto recall = recallAtK(baseIds, topIds[i]);
+                sum += recall;
+                min = std::min(min, recall);
+                compared++;
+            }
+            output["recall"]["k"] = options.k;
+            output["recall"]["compared"] = compared;
+            output["recall"]["mismatched"] = mismatched;
+            output["recall"]["mean"] = compared == 0 ? 0.0 : sum / compared;
+            output["recall"]["min"] = compared == 0 ? 0.0 : min;
+        }
+
+        if (!options.saveBaselinePath.empty())
+        {
+            nlohmann::json baseline;
+            baseline["k"] = options.k;
+            baseline["results"] = nlohmann::json::array();
+            for (size_t i = 0; i < trace.size(); i++)
+                baseline["results"].push_back({{"query", trace[i].query}, {"accuracy", trace[i].accuracy},
+                                               {"prefix", trace[i].prefix}, {"chunkIds", topIds[i]}});
+            std::ofstream(options.saveBaselinePath, std::ios::binary) << baseline.dump(4);
+        }
+
+        auto text = output.dump(4);
+        std::cout << text << std::endl;
+        if (!options.outputPath.empty())
+            std::ofstream(options.outputPath, std::ios::binary) << text;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "replay failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
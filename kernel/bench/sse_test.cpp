@@ -0,0 +1,373 @@
+/*
+Test of the server-sent events handling of HttpClient and OpenAIConv against a mock endpoint, not built by default:
+    cmake --build . --target kernel_sse_test
+usage:
+    kernel_sse_test
+
+A mock OpenAI-style server is started on a free port of 127.0.0.1, it answers every request with a fixed event stream:
+/split      events cut into pieces of 1 to 7 bytes, so lines, "\r\n" pairs and UTF-8 characters span several reads,
+            with a comment, other fields and a delta without content between them
+/multiline  events whose data is split into several "data:" lines, which are joined with "\n", checked both as raw data
+            of HttpClient and as deltas of OpenAIConv
+/slow       a long stream, the client stops the connection in the middle of it
+
+Prints one line per case and exits with 1 if any case failed.
+*/
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+#include "LLMConv.h"
+#include "Utils.h"
+
+std::filesystem::path dataPath = std::filesystem::temp_directory_path() / "PocketRAG_sse_test";
+Logger logger(dataPath / "logs", false, Logger::Level::WARNING, 5);
+
+namespace
+{
+#ifdef _WIN32
+    using socket_t = SOCKET;
+    constexpr socket_t invalidSocket = INVALID_SOCKET;
+    void closeSocket(socket_t s) { closesocket(s); }
+#else
+    using socket_t = int;
+    constexpr socket_t invalidSocket = -1;
+    void closeSocket(socket_t s) { close(s); }
+#endif
+
+    // a stream event of OpenAI chat completions with one content delta
+    std::string deltaEvent(const std::string &content)
+    {
+        nlohmann::json json = {{"choices", {{{"index", 0}, {"delta", {{"content", content}}}}}}};
+        return "data: " + json.dump() + "\n\n";
+    }
+
+    struct Route
+    {
+        std::vector<std::string> pieces; // written one by one, the client reads them separately
+        std::chrono::milliseconds delay{0}; // between two pieces
+    };
+
+    /*
+    Minimal http server for the test, one connection at a time, every response is sent with "Connection: close"
+    and ends when the connection is closed, so the client never reuses a connection the server does not serve.
+    */
+    class MockSseServer
+    {
+    private:
+        socket_t listenSocket = invalidSocket;
+        int port = 0;
+        std::map<std::string, Route> routes;
+        std::atomic<bool> stopped = false;
+        std::atomic<bool> clientClosed = false; // a write failed because the client closed the connection
+        std::thread thread;
+
+        static bool sendAll(socket_t s, std::string_view data)
+        {
+            while (!data.empty())
+            {
+                auto sent = send(s, data.data(), static_cast<int>(data.size()), 0);
+                if (sent <= 0)
+                    return false;
+                data.remove_prefix(sent);
+            }
+            return true;
+        }
+
+        // read the request head and body, return the path
+        static std::string readRequest(socket_t s)
+        {
+            std::string request;
+            char buffer[4096];
+            size_t headEnd;
+            while ((headEnd = request.find("\r\n\r\n")) == std::string::npos)
+            {
+                auto received = recv(s, buffer, sizeof(buffer), 0);
+                if (received <= 0)
+                    return "";
+                request.append(buffer, received);
+            }
+            size_t contentLength = 0;
+            auto lengthPos = request.find("Content-Length:");
+            if (lengthPos != std::string::npos && lengthPos < headEnd)
+                contentLength = std::stoul(request.substr(lengthPos + 15));
+            while (request.size() < headEnd + 4 + contentLength)
+            {
+                auto received = recv(s, buffer, sizeof(buffer), 0);
+                if (received <= 0)
+                    return "";
+                request.append(buffer, received);
+            }
+            auto pathBegin = request.find(' ') + 1;
+            return request.substr(pathBegin, request.find(' ', pathBegin) - pathBegin);
+        }
+
+        void serve(socket_t client)
+        {
+            int noDelay = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
+            auto path = readRequest(client);
+            auto it = routes.find(path);
+            if (it == routes.end())
+            {
+                sendAll(client, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+                return;
+            }
+            if (!sendAll(client, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nConnection: close\r\n\r\n"))
+                return;
+            for (const auto &piece : it->second.pieces)
+            {
+                if (stopped || !sendAll(client, piece))
+                {
+                    clientClosed = !stopped;
+                    return;
+                }
+                std::this_thread::sleep_for(it->second.delay);
+            }
+        }
+
+    public:
+        MockSseServer(std::map<std::string, Route> routes) : routes(std::move(routes))
+        {
+            listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (listenSocket == invalidSocket)
+                throw std::runtime_error("failed to create socket");
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = 0; // any free port
+            socklen_t length = sizeof(address);
+            if (bind(listenSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listenSocket, 8) != 0 ||
+                getsockname(listenSocket, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+            {
+                closeSocket(listenSocket);
+                throw std::runtime_error("failed to listen on 127.0.0.1");
+            }
+            port = ntohs(address.sin_port);
+            thread = std::thread([this]() {
+                while (!stopped)
+                {
+                    auto client = accept(listenSocket, nullptr, nullptr);
+                    if (client == invalidSocket)
+                        continue;
+                    if (!stopped)
+                        serve(client);
+                    closeSocket(client);
+                }
+            });
+        }
+
+        ~MockSseServer()
+        {
+            // wake up accept() by a connection, closing the socket does not interrupt it on every platform
+            stopped = true;
+            auto wake = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            connect(wake, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+            thread.join();
+            closeSocket(wake);
+            closeSocket(listenSocket);
+        }
+
+        std::string url(const std::string &path) const { return "http://127.0.0.1:" + std::to_string(port) + path; }
+
+        bool sawClientClose() const { return clientClosed; }
+    };
+
+    // cut data into pieces of 1 to 7 bytes
+    std::vector<std::string> cutPieces(const std::string &data)
+    {
+        std::vector<std::string> pieces;
+        size_t size = 1;
+        for (size_t pos = 0; pos < data.size(); pos += size, size = size % 7 + 1)
+            pieces.push_back(data.substr(pos, size));
+        return pieces;
+    }
+
+    std::shared_ptr<LLMConv> createConv(const std::string &url)
+    {
+        auto conv = LLMConv::createConv(LLMConv::type::OpenAIapi, "mock", {{"api_key", "mock"}, {"api_url", url}, {"max_retry", "0"}});
+        conv->setMessage("user", "hello");
+        return conv;
+    }
+
+    struct Case
+    {
+        std::string name;
+        std::function<std::string()> run; // return an empty string if passed, else what went wrong
+    };
+}
+
+int main()
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+    std::signal(SIGPIPE, SIG_IGN); // the mock server writes to connections closed by the client
+#endif
+
+    // "你好" is 6 bytes in UTF-8, cut pieces split it
+    std::vector<std::string> splitContents = {"Hel", "lo", ", ", "\xe4\xbd\xa0\xe5\xa5\xbd", "!"};
+    std::string split = ": keep-alive\n\n";
+    split += "event: message\nid: 1\ndata: {\"choices\":[{\"index\":0,\"delta\":{\"role\":\"assistant\",\"content\":null}}]}\n\n";
+    for (size_t i = 0; i < splitContents.size(); i++)
+    {
+        auto event = deltaEvent(splitContents[i]);
+        if (i % 2 == 1) // CRLF line endings, some "\r\n" pairs are cut in the middle
+        {
+            event = event.substr(0, event.size() - 2) + "\r\n\r\n";
+        }
+        split += event;
+    }
+    split += "data: [DONE]\n\n";
+
+    // data of events as HttpClient passes it to the parser, one leading space is removed, "\r" of line ends is dropped
+    std::string rawEvents = "data: first\ndata:second\r\ndata:  third\n\n";
+    rawEvents += "event: ignored\r\ndata: one line\r\n\r\n";
+    rawEvents += "data:\ndata: after empty\n\n";
+    std::vector<std::string> rawData = {"first\nsecond\n third", "one line", "\nafter empty"};
+
+    std::string multiline = "data: {\"choices\":[{\"delta\":\ndata: {\"content\":\"first\"}}]}\n\n"; // joined with "\n", still valid JSON
+    multiline += "data:{\"choices\":[{\"delta\":{\"content\":\"a\\nb\"}}]}\r\n\r\n"; // no space after colon, escaped newline in content
+    multiline += "data: {\"choices\":\ndata: [{\"delta\":\ndata: {\"content\":\"last\"}}]}\n\n";
+    multiline += "data: [DONE]\n\n";
+
+    Route slow;
+    const int slowEvents = 500;
+    std::string slowContent;
+    for (int i = 0; i < slowEvents; i++)
+    {
+        slow.pieces.push_back(deltaEvent("t" + std::to_string(i) + " "));
+        slowContent += "t" + std::to_string(i) + " ";
+    }
+    slow.delay = std::chrono::milliseconds(10);
+
+    MockSseServer server({
+        {"/split", {cutPieces(split), std::chrono::milliseconds(1)}},
+        {"/raw", {{rawEvents}}},
+        {"/multiline", {{multiline}}},
+        {"/slow", slow},
+    });
+
+    std::vector<Case> cases = {
+        {"split events", [&]() -> std::string {
+             std::vector<std::string> received;
+             auto response = createConv(server.url("/split"))->getStreamResponse([&](const std::string &content) { received.push_back(content); });
+             if (received != splitContents)
+                 return "callbacks do not match the deltas, got " + nlohmann::json(received).dump();
+             std::string expected;
+             for (const auto &content : splitContents)
+                 expected += content;
+             if (response != expected)
+                 return "response is " + response + ", expected " + expected;
+             return "";
+         }},
+        {"multi-line data", [&]() -> std::string {
+             HttpClient client("mock", server.url("/raw"));
+             std::vector<std::string> data;
+             auto result = client.sendStreamRequest("{}", [&](std::string_view chunk, std::string &content) {
+                 data.emplace_back(chunk);
+                 content = chunk;
+                 return true;
+             });
+             if (result.http_code != 200)
+                 return "raw request failed: " + result.error_message;
+             if (data != rawData)
+                 return "data lines are not joined as expected, got " + nlohmann::json(data).dump();
+
+             std::vector<std::string> received;
+             auto response = createConv(server.url("/multiline"))->getStreamResponse([&](const std::string &content) { received.push_back(content); });
+             std::vector<std::string> expected = {"first", "a\nb", "last"};
+             if (received != expected)
+                 return "callbacks do not match the deltas, got " + nlohmann::json(received).dump();
+             if (response != "firsta\nblast")
+                 return "response is " + response;
+             return "";
+         }},
+        {"cancel mid-stream", [&]() -> std::string {
+             auto conv = createConv(server.url("/slow"));
+             std::atomic<int> count = 0;
+             std::thread stopper([&]() {
+                 while (count < 5)
+                     std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                 conv->stopConnection();
+             });
+             auto begin = std::chrono::steady_clock::now();
+             std::string received;
+             std::string response;
+             try
+             {
+                 response = conv->getStreamResponse([&](const std::string &content) {
+                     received += content;
+                     count++;
+                 });
+             }
+             catch (...)
+             {
+                 count = slowEvents; // let the stopper exit
+                 stopper.join();
+                 throw;
+             }
+             stopper.join();
+             auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+             if (elapsed > slow.delay * slowEvents / 2)
+                 return "stopConnection did not end the stream, took " + std::to_string(elapsed.count()) + " ms";
+             if (response.empty() || response != received)
+                 return "the partial response does not match the callbacks, got \"" + response + "\"";
+             if (!slowContent.starts_with(response) || response.size() == slowContent.size())
+                 return "the response is not a part of the stream, got \"" + response + "\"";
+             for (int i = 0; i < 100 && !server.sawClientClose(); i++)
+                 std::this_thread::sleep_for(std::chrono::milliseconds(10));
+             if (!server.sawClientClose())
+                 return "the connection was not closed by the client";
+             return "";
+         }},
+    };
+
+    int failed = 0;
+    for (const auto &testCase : cases)
+    {
+        std::string error;
+        try
+        {
+            error = testCase.run();
+        }
+        catch (const std::exception &e)
+        {
+            error = std::string("exception: ") + e.what();
+        }
+        std::cout << (error.empty() ? "[PASS] " : "[FAIL] ") << testCase.name << (error.empty() ? "" : ": " + error) << std::endl;
+        failed += error.empty() ? 0 : 1;
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return failed == 0 ? 0 : 1;
+}
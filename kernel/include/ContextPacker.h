@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Repository.h"
+
+/*
+This class packs retrieved chunks into the prompt of a conversation within a token budget.
+1. chunks of the same file adjacent in lines are merged into one block, chunks contained in another chunk are dropped.
+2. blocks are selected greedily by maximal marginal relevance: relevance minus similarity to the selected blocks,
+   so near-duplicate chunks (such as the same section chunked by several embedding configs) do not fill the budget.
+3. a block which does not fit in the remaining budget is skipped, if no block fits, the most relevant one is truncated.
+Tokens are counted by a local tokenizer, usually the sentencepiece tokenizer of the reranker or embedding model,
+which is close to but not exactly the tokenizer of the generation model, so leave some margin in the budget.
+*/
+class ContextPacker
+{
+public:
+    // return token ids of text, without special tokens
+    using Tokenizer = std::function<std::vector<int>(const std::string &)>;
+
+    struct Block
+    {
+        std::string content;
+        std::string metadata;
+        std::string filePath;
+        int beginLine = 0;
+        int endLine = 0;
+        double score = 0.0; // max score of merged chunks
+        std::vector<int64_t> chunkIds; // merged chunks
+        int tokenCount = 0; // tokens of format(block)
+    };
+
+private:
+    Tokenizer tokenizer;
+    double diversity; // weight of similarity to selected blocks, in [0, 1]
+
+    constexpr static double defaultDiversity = 0.3;
+
+    // token ids, or unicode code points if no tokenizer is set, which overestimates tokens
+    std::vector<int> tokenize(const std::string &text) const;
+
+    // merge adjacent chunks of the same file, remove contained chunks
+    static std::vector<Block> mergeChunks(const std::vector<Repository::SearchResult> &results);
+
+    // shrink the content of block to fit tokenBudget, keep utf-8 characters complete
+    void truncate(Block &block, int tokenBudget) const;
+
+public:
+    ContextPacker(Tokenizer tokenizer = nullptr, double diversity = defaultDiversity);
+
+    int countTokens(const std::string &text) const;
+
+    // selected blocks in the order of selection, the sum of tokenCount is not greater than tokenBudget
+    std::vector<Block> pack(const std::vector<Repository::SearchResult> &results, int tokenBudget) const;
+
+    // text of a block in prompt
+    static std::string format(const Block &block);
+};
@@ -1,6 +1,9 @@
 # pragma once
 #include <filesystem>
+#include <chrono>
 #include <functional>
+#include <optional>
+#include <set>
 
 #include "SqliteConnection.h"
 #include "VectorTable.h"
@@ -27,17 +30,18 @@ manges sqlite with chunks table
 CREATE TABLE IF NOT EXISTS chunks (
     chunk_id INTEGER PRIMARY KEY AUTOINCREMENT, -- unique primary key for other tables(tect search table and vector table) to reference
     doc_id INTEGER NOT NULL,
-    embedding_id INTEGER NOT NULL,
-    chunk_index INTEGER NOT NULL,   -- index in one document with one embedding 
+    chunk_length INTEGER NOT NULL,  -- max length of chunks, chunks are shared by all embeddings with the same chunk length
+    chunk_index INTEGER,            -- index in one document with one chunk length
     content_hash TEXT NOT NULL, -- hash of the content and metadata
     begin_line INTEGER, 
     end_line INTEGER, 
 
-    -- UNIQUE(doc_id, embedding_id, chunk_index),
+    UNIQUE(doc_id, chunk_length, chunk_index),
 
-    FOREIGN KEY(doc_id) REFERENCES documents(id) ON DELETE CASCADE,
-    FOREIGN KEY(embedding_id) REFERENCES embeddings(id) ON DELETE CASCADE
+    FOREIGN KEY(doc_id) REFERENCES documents(id) ON DELETE CASCADE
 );
+A document is chunked once for each chunk length, every chunk has one row in text search table,
+and one vector in the vector table of each embedding with this chunk length.
 
 This class is a single threaded class, it is not thread safe.
 */
@@ -47,6 +51,7 @@ public:
     enum class DocState {unchecked, modified, created, deleted, unchanged, skipped};
     
     class Progress;
+    class GroupCommit;
 
     // A wrapper for embedding model, used to store the model and its parameters
     struct Embedding
@@ -56,6 +61,7 @@ public:
         int dimension;
         int inputLength;
         std::shared_ptr<EmbeddingModel> model;
+        int chunkLength; // inputLength limited by max length of the model, embeddings with the same chunk length share chunks
     };
 
 private:  
@@ -92,8 +98,12 @@ private:
     // update document to text search table and vector table
     void updateToTable(Progress &progress, std::function<bool(void)> stopFlag);
 
-    // update one embedding to text search table and vector table
-    void updateOneEmbedding(const std::string &content, std::shared_ptr<Embedding> &embedding, std::shared_ptr<VectorTable> &vectortable, Progress &progress, std::function<bool(void)> stopFlag);
+    // chunk document with one chunk length, update chunks table and text search table,
+    // then embed chunks which have no vector for each embedding in group (indexes of embeddings)
+    void updateChunks(const std::string &content, int chunkLength, const std::vector<size_t> &group, Progress &progress, std::function<bool(void)> stopFlag);
+
+    // delete chunks of this document with a chunk length no embedding uses, such as after an embedding config is removed
+    void deleteUnusedChunks(const std::set<int> &chunkLengths);
 
     // update last_modified, last_checked, content_hash, file_size in sqlite
     void updateSqlite(std::string hash = "");
@@ -146,4 +156,42 @@ public:
 
     void finishSubprogress();
     
+};
+
+/*
+This class groups the transactions of many documents into one sqlite transaction, to reduce commits (WAL syncs).
+Transactions opened by DocPipe inside it become savepoints, which are released without syncing,
+the group is committed when maxDocuments documents are done or maxDuration passed since it began.
+A document is only marked as unchanged by its last statement (updateSqlite), in the same group as its other changes,
+so if the process crashes before the group is committed, all documents of the group are processed again.
+Vectors are added to faiss in memory at once, but VectorTable only writes them to disk outside transactions,
+so vectors of a group lost by a crash never reach the disk. If a document fails, the caller rolls back only its savepoint,
+commits the documents done before it, and drops vectors of the rolled back rows by VectorTable::dropUncommittedVectors().
+Readers see changes of a group after it is committed, commit() before releasing the lock to other writers.
+*/
+class DocPipe::GroupCommit
+{
+private:
+    SqliteConnection &sqlite;
+    std::optional<SqliteConnection::Transaction> transaction; // rollback by its destructor if not committed
+    std::chrono::steady_clock::time_point beginTime;
+    int documentCount = 0; // documents done in current group
+
+    constexpr static int maxDocuments = 64;
+    constexpr static std::chrono::milliseconds maxDuration{1000};
+
+public:
+    GroupCommit(SqliteConnection &sqlite) : sqlite(sqlite) {}
+
+    // begin a group if there is no active one, call before processing a document
+    void begin();
+
+    // call after a document is processed, return true if the group is committed
+    bool done();
+
+    // commit the active group, if any
+    void commit();
+
+    // roll back the active group, if any
+    void rollback();
 };
\ No newline at end of file
@@ -0,0 +1,112 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+A process-wide work-stealing executor for short tasks, shared by all sessions instead of a thread pool per session.
+It runs the concurrent requests of sessions (search, getChunksInfo, getApiUsage) and the jieba preload.
+Loops which block for their whole lifetime keep their own WorkerThread, each of them would hold a worker forever:
+the background indexer of Repository, conversations, the worker of Session and the message sender/receiver of KernelServer.
+The number of workers is the cpu budget of the kernel, at least 2, so opening more windows adds tasks, not threads.
+Tasks are taken by priority class, then from the worker's own deque (newest first, tasks posted by the task running on it),
+the global queue of tasks posted from other threads, and at last stolen from other workers (oldest first).
+Background tasks never occupy all workers, one worker is always left for interactive tasks.
+Tasks should not wait for other tasks of the executor, blocking calls such as sqlite locks and ONNX runs are fine.
+*/
+class Executor
+{
+public:
+    // interactive: user is waiting for the result, such as search requests
+    // background: indexing and preloading, can be delayed
+    enum class Priority{interactive, background};
+    constexpr static int priorityCount = 2;
+
+    using Task = std::function<void()>;
+
+private:
+    struct Item
+    {
+        Task task;
+        std::chrono::steady_clock::time_point postTime;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::array<std::deque<Item>, priorityCount> queues; // tasks posted by tasks running on this worker
+    };
+
+    const int budget;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex; // mutex for global queues, epoch and shutdownFlag
+    std::condition_variable cv;
+    std::array<std::deque<Item>, priorityCount> queues; // tasks posted from threads outside the executor
+    uint64_t epoch = 0; // increased when a task is posted or finished, idle workers rescan when it changes
+    bool shutdownFlag = false;
+
+    std::array<std::atomic<int>, priorityCount> running{}; // running tasks of each class
+    std::array<int, priorityCount> maxRunning;
+
+    static thread_local int currentWorker; // index of the worker running on this thread, -1 outside the executor
+    static inline std::atomic<int> configuredBudget = 0;
+    static inline std::atomic<bool> started = false;
+
+    constexpr static int minWorkers = 2; // one for interactive tasks while a background task runs
+
+    explicit Executor(int budget);
+
+    // take a task of class p if its class is below the running limit, reserve a running slot for it
+    bool take(int index, Priority p, Item &item);
+    bool popOwn(int index, Priority p, Item &item);
+    bool popGlobal(Priority p, Item &item);
+    bool steal(int index, Priority p, Item &item);
+
+    void workLoop(int index);
+    void signal();
+
+public:
+    ~Executor();
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    // set the cpu budget before the first call of instance(), 0 means all hardware threads
+    // return false if the executor has started with another budget, the new one takes effect after restart
+    static bool configure(int cpuBudget);
+    // cpu budget of the process
+    static int cpuBudget();
+    // size of the global ONNX intra-op pool, the budget left after one core for the non-ONNX work of tasks
+    // (sqlite, FTS5, tokenizing), the worker calling Run() computes in the pool, so it is not counted again
+    static int onnxThreads();
+
+    // the executor is created on first use with the configured budget
+    static Executor &instance();
+
+    // run task on a worker, exceptions are logged and dropped
+    void post(Priority p, Task task);
+
+    // run f on a worker, the result or exception is delivered by the returned future
+    template <typename F>
+    auto submit(Priority p, F &&f) -> std::future<std::invoke_result_t<F>>
+    {
+        using Result = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+        auto future = task->get_future();
+        post(p, [task]() { (*task)(); });
+        return future;
+    }
+
+    int workerCount() const { return static_cast<int>(workers.size()); }
+};
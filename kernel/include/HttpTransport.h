@@ -0,0 +1,84 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+/*
+Run http requests of all HttpClient instances on one I/O thread with curl multi, instead of a blocking easy handle per request.
+Connections are cached by the multi handle and reused by later requests to the same host (keep-alive, HTTP/2 multiplexing),
+DNS and TLS sessions are shared by all requests, so repeat requests to an endpoint skip TCP and TLS setup.
+Callbacks are called in the I/O thread, they should be short and must not wait for other requests.
+*/
+class HttpTransport
+{
+public:
+    struct Request
+    {
+        std::string url;
+        std::shared_ptr<curl_slist> headers; // shared by requests of a client, kept alive until the request is finished
+        std::string body; // POST body
+        long connectTimeout = 10; // s
+        bool verbose = false;
+        std::chrono::milliseconds delay{0}; // start after delay, used for retries
+
+        std::function<bool(std::string_view)> onData; // called for each received piece of body, return false to abort
+        std::function<bool()> stopFlag; // return true to abort, checked between and during transfers
+        std::function<void(CURLcode code, long httpCode)> onDone; // called once when finished, aborted or failed
+    };
+
+private:
+    struct Transfer
+    {
+        Request request;
+        std::chrono::steady_clock::time_point startTime;
+
+        static size_t writeCallback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    };
+
+    CURLM *multi = nullptr;
+    CURLSH *share = nullptr; // DNS cache and TLS sessions, only used in the I/O thread, so no lock functions
+
+    // only used in the I/O thread
+    std::map<CURL *, std::unique_ptr<Transfer>> running;
+    std::multimap<std::chrono::steady_clock::time_point, std::unique_ptr<Transfer>> delayed;
+    std::vector<CURL *> idleHandles; // easy handles are reset and reused, saving allocation of their buffers
+
+    std::mutex mutex; // mutex for incoming and shutdownFlag
+    std::vector<std::unique_ptr<Transfer>> incoming;
+    bool shutdownFlag = false;
+
+    std::thread thread;
+
+    constexpr static size_t maxIdleHandles = 8;
+    constexpr static int maxPollMs = 200; // stop flags of running transfers are checked at least this often
+
+    HttpTransport();
+
+    void ioLoop();
+    void startTransfer(std::unique_ptr<Transfer> transfer);
+    void finishTransfer(CURL *easy, CURLcode code);
+    static void complete(Transfer &transfer, CURLcode code, long httpCode);
+
+public:
+    ~HttpTransport();
+
+    HttpTransport(const HttpTransport &) = delete;
+    HttpTransport &operator=(const HttpTransport &) = delete;
+
+    // created on first use, the I/O thread runs until the process exits
+    static HttpTransport &instance();
+
+    // queue a request, thread-safe, request.onDone is always called unless the process exits first
+    void send(Request request);
+
+    // let the I/O thread check stop flags now, such as after a client is stopped
+    void wakeUp();
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include <condition_variable>
+#include <fstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -26,10 +27,14 @@ class KernelServer
 public:
     using Json = nlohmann::json;
 
+    // directory of log files under userData, also used by the Logger in main.cpp
+    constexpr static const char *logDirName = "logs";
+
 private:
     const std::filesystem::path userDataPath;
     const std::filesystem::path userDataDBPath = userDataPath / "db";
-    const std::filesystem::path logPath = userDataPath / "log";
+    const std::filesystem::path logPath = userDataPath / logDirName;
+    const std::filesystem::path metricsPath = logPath / "metrics.json";
 
     // messagequeue for frontend and backend communication
     std::shared_ptr<Utils::MessageQueue> kernelMessageQueue = std::make_shared<Utils::MessageQueue>(); // for kernel server
@@ -58,6 +63,11 @@ private:
 
     void openSession(int64_t windowId, const std::string &repoName, const std::string &repoPath);
 
+    // if env POCKETRAG_SEARCH_TRACE is set, search messages are appended to that file, one JSON per line,
+    // the trace can be replayed against a copy of the repository by kernel_replay
+    std::ofstream searchTrace;
+    void recordSearch(const Session &session, const nlohmann::json &json);
+
     std::mutex errorMutex;
     std::exception_ptr error = nullptr; // error from other threads
 
@@ -69,12 +79,24 @@ private:
     std::shared_ptr<Utils::WorkerThread> messageSenderThread;
     void startMessageSender();
     void messageSender(std::function<bool()> stopFlag);
+    // serialize a message and append it to buffer, messages are written to stdout in batch
+    void appendMessage(const std::shared_ptr<Utils::MessageQueue::Message> &message, std::string &buffer);
+    constexpr static size_t maxBatchSize = 1 << 20; // write to stdout once the batch is larger than this, in bytes
 
     // this thread will receive messages from frontend
     std::shared_ptr<Utils::WorkerThread> messageReceiverThread;
     void startMessageReceiver();
     void messageReceiver(std::function<bool()> stopFlag);
 
+    // load jieba dictionary in the executor at startup, so the first search or index operation need not wait for it
+    void startJiebaPreload();
+
+    // this thread will dump Metrics::registry() to metricsPath periodically, and once more when stopped
+    std::shared_ptr<Utils::WorkerThread> metricsDumpThread;
+    void startMetricsDump();
+    void dumpMetrics() const;
+    constexpr static auto metricsDumpInterval = std::chrono::seconds(60);
+
     class Settings;
     friend class Settings;
     std::shared_ptr<Settings> settings = nullptr;
@@ -83,6 +105,22 @@ private:
     // interface for settings class
     std::string getApiKey(const std::string &modelName) const;
 public:
+    // format of messages on stdin/stdout, set by env POCKETRAG_IPC_FORMAT, json by default
+    // json: one message per line, readable for debugging
+    // msgpack: 4 bytes little-endian payload length + MessagePack payload
+    enum class IpcFormat
+    {
+        json,
+        msgpack
+    };
+    static IpcFormat getIpcFormat();
+    // serialize a message in current ipc format and append it to out
+    static void encodeMessage(const Json &json, std::string &out);
+    // block until a whole message is read from stdin, return false if stdin is closed
+    static bool readMessage(std::string &input);
+    // parse a message read by readMessage(), throw if it is not valid
+    static Json decodeMessage(const std::string &input);
+
     KernelServer(const std::filesystem::path &userDataPath);
     ~KernelServer();
 
@@ -106,6 +144,7 @@ public:
     std::filesystem::path getRerankerConfigs() const;
     int getSearchLimit() const;
     int getHistoryLength() const;
+    int getContextTokens() const;
     std::pair<int, ONNXModel::device> getPerfConfig() const;
 };
    
@@ -150,6 +189,7 @@ public:
                 std::string path;
                 std::string type;  // embedding, rerank, generation
                 int fileSize;      // in MB
+                bool quantized = false; // load the int8 model generated by scripts/quantizeModel.py, only for embedding and rerank
             };
             std::vector<Model> models;
         } localModelManagement;
@@ -164,10 +204,11 @@ public:
             };
             std::vector<GenerationModel> generationModel;
             int historyLength;
+            int contextTokens = 4000; // token budget of retrieved content in one answer, optional in settings file
         } conversationSettings;
         struct PerformanceSettings
         {
-            int maxThreads = 0; // max threads for ONNX model, 0 means use all available threads
+            int maxThreads = 0; // cpu budget of the kernel (executor workers, ONNX threads get the budget minus one), 0 means use all available threads
             bool useCoreML = false;
             bool useCuda = false;
         } performanceSettings;
@@ -192,4 +233,5 @@ public:
     std::string getModelPath(const std::string &modelName) const;
     std::pair<int, ONNXModel::device> getPerfConfig() const;
     int getHistoryLength() const;
+    int getContextTokens() const;
 };
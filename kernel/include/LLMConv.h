@@ -1,12 +1,17 @@
 #pragma once
+#include <atomic>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <functional>
+#include <string_view>
 
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
+#include "HttpTransport.h"
+
 namespace
 {
     class CurlInitializer {
@@ -19,11 +24,13 @@ namespace
 
 /*
 This class handles http sessions to openai api.
+Requests are sent by the shared HttpTransport, so clients share one I/O thread and its connection pool.
+Async methods call onDone in the I/O thread, blocking methods wait for them and must not be called in callbacks.
 */
 class HttpClient
 {
 public:
-    using streamResponseParser = std::function<bool(const std::string&, std::string&)>; // function to parse stream response
+    using streamResponseParser = std::function<bool(std::string_view, std::string&)>; // function to parse data of a stream event, views are valid during the call
     using streamCallbackFunc = std::function<void(const std::string &)>; // function to handle stream response
 
     // store http code and error message
@@ -40,48 +47,48 @@ public:
         static std::string getErrorMessage(int http_code); // generate error_message
     };
 
+    using doneCallbackFunc = std::function<void(httpResult)>; // function to handle the result of an async request
+
 private:
-    CURL* curl;
-    curl_slist *headers;
+    std::string api_url;
+    std::shared_ptr<curl_slist> headers; // built once, shared by all requests of this client
 
     int max_retry = 0; // max retry count, default 0, no retry
     int connect_timeout = 10; // connect timeout, s, default 10s
     bool verbose = false; // verbose mode, default false
 
-    std::atomic<bool> stop = false; // stop flag, default false
-
-    // join returned data to a string
-    static size_t nonStresamCallBack(void *ptr, size_t size, size_t nmemb, void *in_buffer);
-
-    // wrap std::function to be used as a function ptr
-    // used in curlRequest()
-    struct CallbackWrapper;
-    friend struct CallbackWrapper;
-
-    // send request and handle error in uniform way
-    HttpClient::httpResult curlRequest(std::function<size_t(void *, size_t, size_t, void *)> callback, void *buffer, const std::string &request);
+    std::shared_ptr<std::atomic<bool>> stop = std::make_shared<std::atomic<bool>>(false); // stop flag, shared with requests in flight
 
     /*
-    handle stream response 
-    has a streamCallback function, can be used like:
-    ```
-    auto streamdata = streamData(&buffer, &complete_response, &callBack);
-    curlRequest(streamData::streamCallback, &streamdata)
-    ```
+    handle stream response (server-sent events)
+    received pieces are scanned in place, complete events are passed to parser as views of the piece or the buffer,
+    only the incomplete tail is kept, in a buffer which is compacted when its consumed part grows large.
     */
     struct streamData
     {
-        std::string *buffer;                   // for uncomplete events
+        std::string buffer;                    // for uncomplete events, valid bytes begin at offset
+        size_t offset = 0;
+        size_t scanned = 0;                    // bytes after offset already scanned for line ends
+        std::string data;                      // joined data of an event with several data lines
+        std::string content;                   // parsed content of an event, reused
         std::string *complete_response;        // for complete response
         streamResponseParser parser;           // for parsing stream response
         streamCallbackFunc *callback; // for callback func, if no callback, set to nullptr
 
-        streamData(std::string *buffer, std::string *complete_response, streamResponseParser parser, streamCallbackFunc *callback = nullptr) : buffer(buffer), complete_response(complete_response), parser(parser), callback(callback) {}
+        constexpr static size_t minCompactSize = 4096; // compact the buffer only if it wastes at least this many bytes
 
-        static size_t streamCallback(void *ptr, size_t size, size_t nmemb, void *streamdata);
+        streamData(std::string *complete_response, streamResponseParser parser = nullptr, streamCallbackFunc *callback = nullptr) : complete_response(complete_response), parser(parser), callback(callback) {}
     };
 
-    static void processSSE(streamData* streamdata);
+    static void processSSE(streamData *streamdata, std::string_view piece);
+    static void processEvent(streamData *streamdata, std::string_view event);
+
+    // state of a request and its retries
+    struct Call;
+
+    // send an attempt of call, retries are delayed by the transport instead of sleeping
+    static void sendAttempt(const std::shared_ptr<Call> &call);
+    static void finishAttempt(const std::shared_ptr<Call> &call, CURLcode code, long http_code);
 
 public:
     HttpClient(const std::string &api_key, const std::string &api_url);
@@ -95,6 +102,12 @@ public:
         this->verbose = verbose;
     }
 
+    // send request to api, onDone receives the full http body
+    void sendRequestAsync(const std::string &request_body, doneCallbackFunc onDone);
+    // send request to api and call parser to parse response and then callback function when a new response is received
+    // onDone receives the complete response(parsed by parser) when the stream is finished
+    void sendStreamRequestAsync(const std::string &request_body, streamResponseParser parser, streamCallbackFunc callback, doneCallbackFunc onDone);
+
     // send request to api 
     // return the response the full http body
     HttpClient::httpResult sendRequest(const std::string &request_body);
@@ -103,7 +116,7 @@ public:
     HttpClient::httpResult sendStreamRequest(const std::string &request_body, streamResponseParser parser, std::function<void(const std::string &)> callback = nullptr);
 
     // stop stream or retries and return http code 200
-    void stopConnection() { stop = true; }
+    void stopConnection();
 };
 
 /*
@@ -205,7 +218,8 @@ private:
     TokenUsage tokenUsage;
 
     // parse a chunk of stream response, will not set the token usage
-    bool parseStreamChunk(const std::string &chunk, std::string &content);
+    // only choices[0].delta.content is extracted, by a SAX handler which stops as soon as it is found
+    static bool parseStreamChunk(std::string_view chunk, std::string &content);
     // parse the full response, this will automatically set the token usage
     // if setDeltaUsage is true, it will set completion_tokens = new_prompt_tokens - old_prompt_tokens
     std::string parseFullResponse(const std::string &response, bool setDeltaUsage = false);
@@ -0,0 +1,165 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+/*
+A process-wide metrics registry, used to aggregate latency distributions and counters in production.
+Metrics are created on first use and live until the process exits, so references can be cached in static variables:
+    static auto &ftsLatency = Metrics::histogram("search.fts5");
+    Metrics::ScopedTimer timer(ftsLatency);
+All metric operations are lock-free, only creating a metric takes the registry mutex.
+*/
+namespace Metrics
+{
+    // monotonically increasing value
+    class Counter
+    {
+    private:
+        std::atomic<int64_t> value = 0;
+
+    public:
+        void add(int64_t n = 1)
+        {
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+        int64_t get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+        void reset()
+        {
+            value.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    // value which can go up and down, such as queue depth
+    class Gauge
+    {
+    private:
+        std::atomic<int64_t> value = 0;
+
+    public:
+        void set(int64_t v)
+        {
+            value.store(v, std::memory_order_relaxed);
+        }
+        void add(int64_t n)
+        {
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+        int64_t get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    /*
+    HDR-style histogram of durations in microseconds.
+    Values below 16 have their own bucket, larger values use 16 linear sub-buckets per power of two,
+    so the relative error of percentiles is within 1/16.
+    */
+    class Histogram
+    {
+    private:
+        constexpr static int subBucketBits = 4;
+        constexpr static int subBucketCount = 1 << subBucketBits;
+        constexpr static int maxExponent = 40; // about 12 days in microseconds, larger values are clamped
+        constexpr static int bucketCount = (maxExponent - subBucketBits + 2) * subBucketCount;
+
+        std::array<std::atomic<int64_t>, bucketCount> buckets{};
+        std::atomic<int64_t> count = 0;
+        std::atomic<int64_t> sum = 0;
+        std::atomic<int64_t> max = 0;
+
+        static int bucketIndex(int64_t value);
+        // middle value of the bucket, used as the value of a percentile
+        static int64_t bucketValue(int index);
+
+    public:
+        void record(int64_t microseconds);
+
+        void record(std::chrono::steady_clock::duration duration)
+        {
+            record(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+        }
+
+        // percentile in [0, 100], return value in microseconds
+        int64_t percentile(double p) const;
+
+        // count, mean, max and percentiles in milliseconds
+        nlohmann::json toJson() const;
+
+        // not atomic with concurrent record(), only used between phases of tools
+        void reset();
+    };
+
+    class Registry
+    {
+    private:
+        mutable std::mutex mutex;
+        std::map<std::string, std::unique_ptr<Counter>> counters;
+        std::map<std::string, std::unique_ptr<Gauge>> gauges;
+        std::map<std::string, std::unique_ptr<Histogram>> histograms;
+
+    public:
+        Counter &counter(const std::string &name);
+        Gauge &gauge(const std::string &name);
+        Histogram &histogram(const std::string &name);
+
+        // snapshot of all metrics: {"counters": {...}, "gauges": {...}, "histograms": {...}}
+        nlohmann::json toJson() const;
+
+        // clear counters and histograms, such as after warming up, gauges are kept as they reflect current state
+        void reset();
+    };
+
+    Registry &registry();
+
+    inline Counter &counter(const std::string &name)
+    {
+        return registry().counter(name);
+    }
+    inline Gauge &gauge(const std::string &name)
+    {
+        return registry().gauge(name);
+    }
+    inline Histogram &histogram(const std::string &name)
+    {
+        return registry().histogram(name);
+    }
+
+    // record the time from construction to stop() or destruction into a histogram
+    class ScopedTimer
+    {
+    private:
+        Histogram &target;
+        std::chrono::steady_clock::time_point startTime;
+        bool running = true;
+
+    public:
+        explicit ScopedTimer(Histogram &target) : target(target), startTime(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer()
+        {
+            stop();
+        }
+
+        ScopedTimer(const ScopedTimer &) = delete;
+        ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+        void stop()
+        {
+            if (!running)
+                return;
+            target.record(std::chrono::steady_clock::now() - startTime);
+            running = false;
+        }
+    };
+}
@@ -4,6 +4,10 @@
 #include <memory>
 #include <filesystem>
 #include <mutex>
+#include <array>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
 
 #include <onnxruntime_cxx_api.h>
 #include <sentencepiece_processor.h>
@@ -13,7 +17,7 @@ extern std::filesystem::path dataPath;
 /*
 This class is a base class of all ONNX models.
 Can't be instantiated directly.
-make sure one instance is only used by one thread. 
+instances sharing a same session can be used in multiple threads, Run() calls are scheduled by priority.
 */
 class ONNXModel
 {
@@ -23,12 +27,62 @@ public:
 
 
     static std::vector<device> getAvailableDevices();
+
+    // interactive: user is waiting for the result, such as query embedding and reranking
+    // background: indexing tasks, can be delayed
+    enum class priority{interactive, background};
+
+    constexpr static const char *modelFileName = "model.onnx";
+    constexpr static const char *quantizedModelFileName = "model_int8.onnx"; // dynamic int8 model, generated by scripts/quantizeModel.py
+
+    // target model path can be a model directory, or a `.onnx` file in the model directory
+    // return the model directory and the model file to load
+    static std::pair<std::filesystem::path, std::filesystem::path> resolveModelPath(const std::filesystem::path &targetModelPath);
+
+protected:
+    /*
+    Schedule Run() calls on a shared session.
+    ORT allows concurrent Run() on one session, so calls in different lanes will not wait for each other.
+    Background calls are limited to one at a time, and will not start while interactive calls are pending,
+    so a long indexing task only shares the intra-op threads with queries, never blocks them.
+    */
+    class RunScheduler
+    {
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        int running[2] = {0, 0}; // running calls of each lane, indexed by priority
+        int waiting[2] = {0, 0}; // waiting calls of each lane, indexed by priority
+        const bool concurrent; // if false, only one call can run at a time, for execution providers which are not thread-safe
+
+        constexpr static int maxRunning[2] = {2, 1}; // max concurrent calls of each lane
+
+    public:
+        RunScheduler(bool concurrent) : concurrent(concurrent) {}
+
+        void acquire(priority p);
+        void release(priority p);
+    };
+
+    // acquire a slot of the scheduler, release it when destructed
+    class RunGuard
+    {
+    private:
+        RunScheduler &scheduler;
+        priority p;
+    public:
+        RunGuard(RunScheduler &scheduler, priority p) : scheduler(scheduler), p(p) { scheduler.acquire(p); }
+        ~RunGuard() { scheduler.release(p); }
+        RunGuard(const RunGuard &) = delete;
+        RunGuard &operator=(const RunGuard &) = delete;
+    };
+
 private:
     static std::mutex mutex;    // mutex for all static variables
 
     // storage all instances' modelDirPath, let instances with same model use sheared session to save memory
     static std::unordered_map<std::filesystem::path, std::weak_ptr<Ort::Session>> instancesSessions;
-    static std::unordered_map<Ort::Session *, std::shared_ptr<std::mutex>> sessionMutexes; // mutex for each session, to make sure only one thread can run the session at a time
+    static std::unordered_map<Ort::Session *, std::shared_ptr<RunScheduler>> sessionSchedulers; // scheduler for each session, shared by all instances using the session
 
     static std::atomic<int> instanceCount;
     std::filesystem::path modelDirPath; // the path of the model directory
@@ -39,8 +93,33 @@ private:
     static std::shared_ptr<Ort::AllocatorWithDefaultOptions> allocator; // allocator
     static std::shared_ptr<Ort::MemoryInfo> memoryInfo; // memory info for tensor creation
 
+    /*
+    Per-thread buffers for inference, reused between calls to avoid allocations.
+    Capacity grows to the largest batch * length seen by the thread.
+    */
+    struct InferenceBuffer
+    {
+        std::vector<int64_t> inputIds;
+        std::vector<int64_t> attentionMask;
+        std::vector<int> tokenIds; // tokenizer output of a single text
+        std::unique_ptr<Ort::IoBinding> binding = nullptr; // io binding of the session
+    };
+
+    // get the buffer of current thread for this model
+    InferenceBuffer &getInferenceBuffer() const;
+
+    // bind inputIds and attentionMask in buffer as inputs, and output as the only output, then run the session
+    // output must have enough space for outputShape
+    void run(InferenceBuffer &buffer, const std::array<int64_t, 2> &inputShape, const std::string &outputName,
+             float *output, const std::vector<int64_t> &outputShape, priority p) const;
+
     std::shared_ptr<Ort::Session> session = nullptr; // ONNX session, include a model
-    std::shared_ptr<std::mutex> sessionMutex = nullptr; // mutex for this session
+    std::shared_ptr<RunScheduler> scheduler = nullptr; // scheduler for this session, every Run() must hold a RunGuard
+
+    // buffers of the threads which ran this model, kept by the instance so they are released with it,
+    // before the session their bindings belong to, one per executor worker or other thread which ran it
+    mutable std::mutex bufferMutex;
+    mutable std::unordered_map<std::thread::id, InferenceBuffer> buffers;
 
     // ONNXRuntime is a graph-based runtime, when running, need to specify the input and output names of the model
     std::vector<std::string> inputNames; // storage input names of the model
@@ -48,7 +127,8 @@ private:
 
     // instantiate the ONNX model, 
     // will find `model.onnx` & `model.onnx_data` in the modelDirPath, 
-    ONNXModel(std::filesystem::path targetModelDirPath, device dev = device::cpu, int maxThreads = 0);
+    // or load the given `.onnx` file directly, such as the quantized model
+    ONNXModel(std::filesystem::path targetModelDirPath, device dev = device::cpu);
 
 public:
     // initialize the ONNX environment for all ONNX models
@@ -65,7 +145,6 @@ public:
 This class are designed to handle embedding models.
 Derived from ONNXModel.
 BE CAREFUL: some implementation may differ between different embedding models
-make sure one instance is only used by one thread.
 */
 class EmbeddingModel : public ONNXModel
 {
@@ -75,31 +154,39 @@ private:
     constexpr static int defaultMaxLength = 512; // default max length of input text, if the model does not have max length, set to 512
     std::shared_ptr<sentencepiece::SentencePieceProcessor> tokenizer = nullptr; // tokenizer of embedding model, use sentencepiece
 
-    // tokenize input string to ids and attention mask
+    // tokenize input string to ids and attention mask, write them into buffer and return the shape
     // input string must be encoded in utf-8
     // asssume that the embedding model needs input sentences like <BOS>content<EOS> and <BOS> == <CLS>
-    std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> tokenize(const std::string &text) const;
+    std::array<int64_t, 2> tokenize(const std::string &text, InferenceBuffer &buffer) const;
 
     // tokenize batch of strings to ids and attention mask
-    std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> tokenize(const std::vector<std::string> &texts) const;
+    std::array<int64_t, 2> tokenize(const std::vector<std::string> &texts, InferenceBuffer &buffer) const;
 
 public:
     // instantiate the ONNX model,
     // will find `model.onnx` & `model.onnx_data` & `sentencepiece.bpe.model` in the modelDirPath,
     // modelDirPath should end with `/`
-    EmbeddingModel(std::filesystem::path targetModelDirPath, device dev = device::cpu, int maxThreads = 0);
+    EmbeddingModel(std::filesystem::path targetModelDirPath, device dev = device::cpu);
     ~EmbeddingModel() = default;
 
     // get embedding dimension
     inline int getDimension() const { return embeddingDimension; }
     inline int getMaxLength() const { return maxLength; }
 
+    // token ids of text without special tokens, such as for counting tokens of a prompt
+    std::vector<int> encode(const std::string &text) const;
+
     // generate embedding for a single string
     // input string must be encoded in utf-8
-    std::vector<float> embed(const std::string &text) const;
+    std::vector<float> embed(const std::string &text, priority p = priority::interactive) const;
 
     // generate embedding for a batch of strings
-    std::vector<std::vector<float>> embed(const std::vector<std::string> &texts) const;
+    std::vector<std::vector<float>> embed(const std::vector<std::string> &texts, priority p = priority::interactive) const;
+
+    // write embedding into output directly, output must have space for getDimension() floats
+    void embed(const std::string &text, float *output, priority p = priority::interactive) const;
+    // write embeddings into output directly, output must have space for texts.size() * getDimension() floats
+    void embed(const std::vector<std::string> &texts, float *output, priority p = priority::interactive) const;
 };
 
 /*
@@ -113,16 +200,25 @@ private:
     constexpr static int defaultMaxLength = 512; // default max length of input text, if the model does not have max length, set to 512
     std::shared_ptr<sentencepiece::SentencePieceProcessor> tokenizer = nullptr;
 
+    size_t scoreRank = 2; // rank of the score output, [batch] or [batch, 1]
+    std::vector<int64_t> scoreShape(int64_t batchSize) const
+    {
+        return scoreRank == 1 ? std::vector<int64_t>{batchSize} : std::vector<int64_t>{batchSize, 1};
+    }
+
     // assume that input sequence is like <BOS>query_content<EOS>doc_content<EOS> and <BOS> == <CLS>
-    std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> tokenize(const std::string& query, const std::string& content) const;
-    std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> tokenize(const std::string& query, const std::vector<std::string>& contents) const;
+    std::array<int64_t, 2> tokenize(const std::string& query, const std::string& content, InferenceBuffer &buffer) const;
+    std::array<int64_t, 2> tokenize(const std::string& query, const std::vector<std::string>& contents, InferenceBuffer &buffer) const;
 
 public:
-    RerankerModel(std::filesystem::path targetModelDirPath, device dev = device::cpu, int maxThreads = 0);
+    RerankerModel(std::filesystem::path targetModelDirPath, device dev = device::cpu);
 
     inline int getMaxLength() const { return maxLength; }
 
+    // token ids of text without special tokens, such as for counting tokens of a prompt
+    std::vector<int> encode(const std::string &text) const;
+
     // score all input contents with query
-    float rank(const std::string &query, const std::string &content) const;
-    std::vector<float> rank(const std::string &query, const std::vector<std::string> &contents) const;
+    float rank(const std::string &query, const std::string &content, priority p = priority::interactive) const;
+    std::vector<float> rank(const std::string &query, const std::vector<std::string> &contents, priority p = priority::interactive) const;
 };
\ No newline at end of file
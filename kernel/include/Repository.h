@@ -3,10 +3,12 @@
 #include <filesystem>
 #include <string>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <queue>
 
 #include "SqliteConnection.h"
+#include "SqliteMaintenance.h"
 #include "TextSearchTable.h"
 #include "ONNXModel.h"
 #include "DocPipe.h"
@@ -61,19 +63,49 @@ public:
         high // sorted and filtered by bm25 and vector similarity
     };
 
+    // partial results reported before the final result of search
+    enum class searchPhase
+    {
+        text, // only full text search results
+        fused // full text search and vector search results, before reranking
+    };
+    using PhaseCallback = std::function<void(searchPhase, std::vector<SearchResult> &)>;
+
 private:
+    /*
+    Set of objects used by search, published by the writer after embeddings, reranker or tables are changed.
+    A search copies the pointer once and uses the same set to the end, so configuring never swaps a table or model under it,
+    old objects are released by the last search using them, writers never wait for searches, see publishSnapshot().
+    Only the set is fixed, not the objects: VectorTables are shared with the writer, which adds and removes vectors
+    under their mutex, so a search can still wait on VectorTable's mutex while the background thread writes vectors.
+    */
+    struct Snapshot
+    {
+        std::shared_ptr<SqliteConnection> sqlite;
+        std::shared_ptr<TextSearchTable> textTable;
+        std::vector<std::shared_ptr<VectorTable>> vectorTables;
+        std::vector<std::shared_ptr<Embedding>> embeddings;
+        std::shared_ptr<RerankerModel> rerankerModel;
+    };
+
     std::string repoName;
     std::filesystem::path repoPath;
     std::filesystem::path dbPath;
 
     std::shared_ptr<SqliteConnection> sqlite;
+    std::shared_ptr<SqliteMaintenance> maintenance; // checkpoint, FTS5 merge and vacuum when idle, only used by background thread
     std::shared_ptr<TextSearchTable> textTable;
     std::vector<std::shared_ptr<VectorTable>> vectorTables;
     std::vector<std::shared_ptr<Embedding>> embeddings;
     std::shared_ptr<RerankerModel> rerankerModel = nullptr;
 
-    // for onnx runtime performance config
-    int maxThreads;
+    // members above are the state of writers (background thread and config methods), protected by mutexes below,
+    // snapshot is a copy of them for searches, only the pointer is guarded by snapshotMutex,
+    // std::atomic<std::shared_ptr> is not available in all standard libraries we build with
+    std::shared_ptr<const Snapshot> snapshot = std::make_shared<Snapshot>();
+    mutable std::mutex snapshotMutex;
+
+    // for onnx runtime performance config, threads are shared by all models, see Executor::onnxThreads()
     ONNXModel::device device;
 
     std::shared_ptr<Utils::WorkerThread> backgroundThread; // background thread for processing documents
@@ -109,7 +141,7 @@ private:
     void checkDoc(std::queue<DocPipe>& docqueue);
     // actually execute updating task, need callback function to report progress, no mutex lock.
     void refreshDoc(std::queue<DocPipe> &docqueue, Utils::LockGuard &lock, Utils::LockGuard &repoLock, std::function<bool()> stopFlag);
-    // remove invalid embedding_config and their chunks, no mutex lock.
+    // remove invalid embedding_config and chunks no valid embedding uses, no mutex lock.
     void removeInvalidEmbedding();
 
     // background thread for processing documents
@@ -118,13 +150,26 @@ private:
     int restartCount = 0;
     const static int maxRestartCount = 3;
 
+    std::shared_ptr<const Snapshot> loadSnapshot() const;
+    // publish current members as a new snapshot, vector tables not in it are written to disk before they are retired,
+    // so releasing them in a search thread only frees memory, call with writer locks held
+    void publishSnapshot();
+
+    // get content of search results and remove duplicated results and chunks not found, no mutex lock.
+    // call in the read transaction of the search.
+    static void fillContent(const Snapshot &state, std::vector<SearchResult> &results);
+    // sort and limit results, then get file path, lines and highlight, chunks not found are dropped, no mutex lock.
+    static void finishResults(const Snapshot &state, const TextSearchTable::Highlighter &highlighter, std::vector<SearchResult> &results, int limit);
+
     // to fix internal error, drop all tables and reconstruct
     // this method can only be called in background thread
     void reConstruct(bool needLock = false);
+    // drop documents, chunks, text search and vector tables, embedding configs are kept, no mutex lock.
+    void dropIndexTables();
 
 public:
     Repository(std::string repoName, std::filesystem::path repoPath, Utils::PriorityMutex &mutex, 
-               int maxThreads, ONNXModel::device device, // ONNX performance config
+               ONNXModel::device device, // ONNX performance config
                std::function<void(std::exception_ptr)> errorCallback,
                std::function<void(std::vector<std::string>)> docStateReporter = nullptr,
                std::function<void(std::string, double)> progressReporter = nullptr,
@@ -137,13 +182,23 @@ public:
     Repository(Repository &&) = delete;            // disable move constructor
     Repository &operator=(Repository &&) = delete; // disable move assignment operator
 
-    std::vector<SearchResult> search(const std::string &query, searchAccuracy acc, int limit = 10);
+    // if stopFlag returns true, the search is abandoned between stages and an empty result is returned
+    // if onPhase is set, it will be called with partial results before slower stages (embedding and reranking)
+    // if prefix is true, the last Latin word of query is matched as a prefix in full text search, for search-as-you-type
+    // no Repository mutex lock, searches run on the latest published snapshot and never wait for configuring,
+    // a vector search may wait on the mutex of its VectorTable while indexing writes vectors to it,
+    // sqlite reads of one search run in one read transaction, chunks deleted by indexing after the vector search are dropped
+    std::vector<SearchResult> search(const std::string &query, searchAccuracy acc, int limit = 10, std::function<bool()> stopFlag = nullptr, PhaseCallback onPhase = nullptr, bool prefix = false);
 
     // config embedding settings, if arg is empty, will read from sqlite table
     void configEmbedding(const EmbeddingConfigList &configs);
 
     void configReranker(const std::filesystem::path &modelPath);
 
+    // tokenizer of the reranker model, or the first embedding model if no reranker, nullptr if no model is configured
+    // used to count tokens of prompts
+    std::function<std::vector<int>(const std::string &)> getTokenizer();
+
     std::pair<std::string, std::string> getRepoNameAndPath() const
     {
         return {repoName, repoPath.string()};
@@ -1,8 +1,14 @@
 #pragma once
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <exception>
+#include <map>
 #include <memory>
+#include <queue>
 #include <string>
+#include <unordered_map>
 
 #include "Repository.h"
 #include "LLMConv.h"
@@ -41,6 +47,10 @@ private:
     void progressReporter(std::string path, double progress);
     void doneReporter(std::string path);
 
+    // appends conversation history files in background, shared by all conversations of this session
+    class HistoryWriter;
+    std::shared_ptr<HistoryWriter> historyWriter = nullptr;
+
     class AugmentedConversation;
     std::shared_ptr<AugmentedConversation> conversation = nullptr; // conversation instance
 
@@ -49,7 +59,29 @@ private:
     void send(nlohmann::json& json, Utils::CallbackManager::Callback callback);
     void execCallback(nlohmann::json &json, int64_t callbackId);
 
-    void handleMessage(Utils::MessageQueue::Message& message);
+    // a newer request of the same type cancels the older one by setting its token
+    using CancelToken = std::shared_ptr<std::atomic<bool>>;
+    std::mutex tokenMutex;
+    std::unordered_map<std::string, CancelToken> latestTokens; // request type -> token of the latest request
+    CancelToken renewToken(const std::string &type);
+
+    // requests which may take a long time are handled as executor tasks, so they will not block other messages
+    class RequestExecutor;
+    std::shared_ptr<RequestExecutor> requestExecutor = nullptr;
+    constexpr static int maxRunningRequests = 3;
+    static bool isConcurrentRequest(const std::string &type);
+    static bool isCancellableRequest(const std::string &type);
+
+    void handleMessage(Utils::MessageQueue::Message& message, CancelToken token = nullptr);
+    // reply a request which is not handled with CANCELLED status, for superseded searches and requests dropped on close
+    void replyCancelled(Utils::MessageQueue::Message &message, const std::string &reason);
+
+    static nlohmann::json searchResultsToJson(const std::vector<Repository::SearchResult> &results);
+
+    // for getChunksInfo, page size and fields can be set in message
+    constexpr static int defaultChunksInfoLimit = 500;
+    constexpr static int maxChunksInfoLimit = 5000;
+    constexpr static std::array<const char *, 7> chunksInfoFields = {"chunkId", "filePath", "content", "metadata", "beginLine", "endLine", "embeddingName"};
 
     void initializeSqlite();
 
@@ -65,6 +97,84 @@ public:
 
     // called by kernel server
     void sendMessage(const std::shared_ptr<Utils::MessageQueue::Message>& message);
+
+    const std::string &getRepoName() const { return repoName; }
+    const std::filesystem::path &getRepoPath() const { return repoPath; }
+};
+
+/*
+Handle requests of one session concurrently as interactive tasks of the kernel-wide Executor.
+At most maxRunning requests of a session are posted at once, the rest wait in the queue of the session,
+so one window can not take all workers.
+Pending requests are not run when it is destroyed, their cancel functions reply them instead, running tasks are waited.
+*/
+class Session::RequestExecutor
+{
+private:
+    struct Request
+    {
+        std::function<void()> run;
+        std::function<void()> cancel; // reply the request without running it
+    };
+
+    std::queue<Request> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool shutdownFlag = false;
+    int running = 0; // tasks posted to the executor and not finished
+    const int maxRunning;
+
+    // post the next task if a slot is free, need mutex locked
+    void schedule();
+    // call cancel function of a request which will not run, without mutex locked
+    static void cancelRequest(Request &request);
+
+public:
+    RequestExecutor(int maxRunning);
+    ~RequestExecutor();
+
+    RequestExecutor(const RequestExecutor &) = delete;
+    RequestExecutor &operator=(const RequestExecutor &) = delete;
+
+    // if it is shutting down, the request is cancelled at once
+    void submit(std::function<void()> task, std::function<void()> cancel);
+};
+
+/*
+Append lines to history files in a background thread.
+Lines appended within debounceInterval are merged into one write per file, so saving a turn never rewrites whole files.
+Pending lines are written when it is destroyed.
+*/
+class Session::HistoryWriter
+{
+private:
+    std::map<std::filesystem::path, std::string> pending; // file -> lines waiting to be appended
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable writtenCv;
+    bool flushRequested = false;
+    bool shutdownFlag = false;
+    uint64_t appendedCount = 0; // sequence of append(), used by flush() to wait for its lines
+    uint64_t writtenCount = 0;
+    std::shared_ptr<Utils::WorkerThread> thread;
+
+    constexpr static auto debounceInterval = std::chrono::milliseconds(500);
+
+    void writeLoop();
+    static void writeFiles(const std::map<std::filesystem::path, std::string> &files);
+
+public:
+    HistoryWriter(int64_t sessionId);
+    ~HistoryWriter();
+
+    HistoryWriter(const HistoryWriter &) = delete;
+    HistoryWriter &operator=(const HistoryWriter &) = delete;
+
+    // line should not contain '\n', json.dump() without indent is fine
+    void append(const std::filesystem::path &path, const std::string &line);
+
+    // block until all lines appended before are written, such as before reading a history file
+    void flush();
 };
 
 class Session::AugmentedConversation
@@ -83,6 +193,7 @@ private:
     std::shared_ptr<Utils::WorkerThread> conversationThread = nullptr;
 
     int maxHistoryLength = 0;
+    int maxContextTokens = 0; // token budget of retrieved content sent to the model in one answer
 
     void conversationProcess(std::function<bool()> stopFlag);
 
@@ -93,7 +204,7 @@ public:
     AugmentedConversation(std::filesystem::path historyDirPath, Session& session);
     ~AugmentedConversation();
     // open a new conversation
-    void openConversation(std::shared_ptr<LLMConv> conv, std::function<void(std::string, Type)> sendBack, std::string prompt, int64_t conversationId, int historyLength);
+    void openConversation(std::shared_ptr<LLMConv> conv, std::function<void(std::string, Type)> sendBack, std::string prompt, int64_t conversationId, int historyLength, int contextTokens);
     // stop conversation and destroy conversation thread
     void stopConversation();
 };
@@ -101,22 +212,29 @@ public:
 
 /*
 This class will save history to disk and call sendBack function to send message to frontend.
-It will manage two type of history files:
-- historyJson: save conversation history in a viewing format, to be rendered in frontend
-- historyMessagesJson: save conversation history in a raw format, including "role" and "content" fields, used directly in api.
+It will manage two type of history files, both in JSON Lines format and only appended by HistoryWriter:
+- conversation-<id>.jsonl: conversation history in a viewing format, to be rendered in frontend.
+  The first line is a header {"conversationId", "topic"}, followed by one line per turn.
+- conversation-<id>_full.jsonl: conversation history in a raw format, one {"role", "content"} line per message, used directly in api.
+  Only its tail is read, until maxHistoryLength is reached.
+Legacy conversation-<id>.json and conversation-<id>_full.json files are converted when the conversation is opened.
 */
 class Session::AugmentedConversation::HistoryManager
 {
 private:
-    nlohmann::json historyJson;
     nlohmann::json conversationJson;
     nlohmann::json tempJson;
     AugmentedConversation &parent;
     std::vector<LLMConv::Message> historyMessages;
+    size_t importedMessageCount = 0; // messages already in full history file, not appended again
 
     std::filesystem::path historyFilePath;
     std::filesystem::path fullHistoryFilePath; // save history messages
-    nlohmann::json historyMessagesJson;
+
+    void migrateLegacyHistory(const std::string &filePrefix);
+
+    // read lines from the end of file until callback returns false, empty lines are skipped
+    static void readLinesBackward(const std::filesystem::path &path, const std::function<bool(const std::string &)> &callback);
 
     // for sqlite
     LLMConv::TokenUsage tokenUsage;
@@ -75,6 +75,9 @@ public:
     // get the last insert id from the database
     int64_t getLastInsertId();
 
+    // rows changed by all statements of the connection of this thread since it was opened
+    int64_t getTotalChanges();
+
     // prepare a statement for execution
     Statement getStatement(const std::string &sql);
 
@@ -0,0 +1,61 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include <nlohmann/json.hpp>
+
+#include "SqliteConnection.h"
+#include "TextSearchTable.h"
+
+/*
+Idle-time maintenance of a repository database, run by the background thread of Repository when no document changed.
+1. PASSIVE WAL checkpoint, it never waits for searches reading the WAL. With journal_size_limit, the WAL file does not
+   keep the size reached by the largest reindex.
+2. FTS5 incremental merge of text search segments, a few pages each step.
+3. incremental_vacuum returns free pages left by deleted chunks to the file system, a few pages each step. Databases created
+   before auto_vacuum was enabled are skipped, a full VACUUM does not fit in the time budget of idle maintenance.
+Every step is short, the stop flag is checked between steps, so searches waiting for the lock are not blocked for long.
+It is not thread safe, only used by the background thread.
+*/
+class SqliteMaintenance
+{
+public:
+    struct Report
+    {
+        int64_t checkpointedBytes = 0; // WAL frames copied into the database by checkpoint, times page size
+        int mergeSteps = 0; // FTS5 merge steps which changed the index
+        int64_t freedBytes = 0; // bytes returned to the file system by vacuum
+        bool finished = false; // all work done, false if stopped or out of time budget
+
+        nlohmann::json toJson() const;
+    };
+
+private:
+    SqliteConnection &sqlite;
+
+    std::chrono::steady_clock::time_point lastRun{};
+    bool lastFinished = true;
+
+    constexpr static std::chrono::seconds interval{60}; // between two runs, unless the last one was not finished
+    constexpr static std::chrono::seconds retryInterval{5};
+    constexpr static std::chrono::milliseconds timeBudget{300}; // of one run
+    constexpr static int mergePages = 64; // pages merged by one FTS5 merge step
+    constexpr static int vacuumPages = 256; // pages freed by one incremental_vacuum step
+
+    int64_t pragmaValue(const std::string &pragma);
+
+    void checkpoint(Report &report);
+    // return false if stopped or out of time budget
+    bool merge(TextSearchTable &textTable, Report &report, const std::function<bool()> &outOfTime);
+    bool vacuum(Report &report, const std::function<bool()> &outOfTime);
+
+public:
+    SqliteMaintenance(SqliteConnection &sqlite);
+
+    // if it is time to run
+    bool due() const;
+
+    // run maintenance until done, time budget used up or stopFlag returns true
+    Report run(TextSearchTable &textTable, std::function<bool()> stopFlag);
+};
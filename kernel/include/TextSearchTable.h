@@ -1,4 +1,7 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <optional>
 #include <string>
 #include <vector>
 #include <shared_mutex>
@@ -11,13 +14,18 @@ This class manages a Sqlite FTS5 table for text search.
 This implementation will store full content and metadata in the database, may not be suitable for large documents.
 It is safe to use this class in multiple threads. 
 
-Manage a Sqlite FTS5 table with the following schema:
+Manage a Sqlite FTS5 table with the following schema, rowid is the chunk id:
 CREATE VIRTUAL TABLE IF NOT EXISTS tableName USING fts5(
     content, 
     metadata, 
-    chunkId UNINDEXED,
-    tokenize='jieba'
+    tokenize='jieba',
+    prefix='2 3'
 );
+The prefix indexes keep prefix queries of short Latin words (such as `ra*` while typing `rag`) from scanning all terms.
+FTS5 counts prefix lengths in characters and indexes every token, so each CJK word of 2 or more characters also adds
+up to two prefix entries, on CJK text the index grows by up to twice its term entries. These entries are never queried,
+buildMatchQuery() only matches a trailing Latin word as a prefix, but a tokenizer can not opt tokens out of prefix indexes.
+Tables of older versions store chunk id in an UNINDEXED column or have no prefix index, they are rebuilt in constructor.
 */
 class TextSearchTable
 {
@@ -29,6 +37,7 @@ public:
         int64_t chunkId; // chunk id, primary key
     };
 
+    // content is not read in search, use getContent() for the final results and Highlighter to mark keywords
     struct ResultChunk
     {
         static const std::string HIGHLIGHT_BEGINS;
@@ -37,17 +46,29 @@ public:
         double similarity; // similarity score, higher is similar, equals 1.0 - (1.0 / (1.0 - bm25Score))
 
         int64_t chunkId; // chunk id
-        std::string content; // content of the chunk with highlighted keywords
-        std::string metadata; // metadata of the chunk with highlighted keywords
     };
 
+    class Highlighter;
+
 private:
     SqliteConnection &sqlite; // store reference to SqliteConnection 
     std::string tableName;
 
     mutable std::shared_mutex mutex; // mutex for thread safety
 
+    std::atomic<int64_t> rowCount = 0; // approximate, only used to find common terms of a query
+
     static const int MIN_KEYWORD_LENGTH = 2; // minimum length of keyword to be highlighted
+    static const int MIN_PREFIX_LENGTH = 2; // shorter prefixes match too many terms, they are matched as whole words
+
+    static std::string createTableSql(const std::string &tableName);
+
+    // rebuild tables of older versions with chunk id as rowid and prefix indexes, no-op for new tables
+    void migrateTable();
+
+    // OR of unique keywords of query, stop words and terms in more than half of rows are removed if other terms remain,
+    // if prefix is true, the Latin word at the end of query is matched as a prefix
+    std::string buildMatchQuery(const std::string &query, bool prefix);
 
 public:
     TextSearchTable(SqliteConnection &sqlite, const std::string &tableName);
@@ -65,15 +86,47 @@ public:
     // delete a chunk from the table, if not exists, throw an exception
     void deleteChunk(int64_t chunkId);
 
-    // search for chunks in the table
-    std::vector<ResultChunk> search(const std::string &query, int limit = 10);
+    // search for top `limit` chunk ids ordered by bm25, without reading content,
+    // set prefix for search-as-you-type, so the word being typed at the end of query matches the words it begins
+    std::vector<ResultChunk> search(const std::string &query, int limit = 10, bool prefix = false);
 
-    // get a pair with content and metadata of a chunk by chunkId
-    std::pair<std::string, std::string> getContent(int64_t chunkId);
+    // get a pair with content and metadata of a chunk by chunkId, nullopt if the chunk does not exist (e.g. deleted after search)
+    std::optional<std::pair<std::string, std::string>> getContent(int64_t chunkId);
+
+    // one step of FTS5 incremental merge of index segments, about `pages` pages, return false if nothing to merge
+    bool merge(int pages);
 
     // drop table from sqlite
     static void dropTable(SqliteConnection &sqlite, const std::string &tableName);
+};
+
+/*
+Mark keywords of a query in texts with HIGHLIGHT_BEGINS and HIGHLIGHT_ENDS.
+Keywords are cut from the query once in constructor and compiled into an Aho-Corasick automaton,
+so highlighting a text is a single pass over it, whatever the number of keywords.
+Keywords contained in another keyword are removed, matching is case-insensitive for ASCII letters,
+overlapping matches are resolved by leftmost-longest.
+*/
+class TextSearchTable::Highlighter
+{
+private:
+    struct State
+    {
+        std::array<int, 256> next; // goto function completed with failure links, so matching never backtracks
+        int fail = 0;
+        int length = 0; // length of keyword ending at this state, 0 if none
+        int output = 0; // nearest state in failure chain (including itself) where a keyword ends, 0 if none
+    };
+    std::vector<State> states; // states[0] is root
+
+    static std::vector<std::string> extractKeywords(const std::string &query);
+    void addKeyword(const std::string &keyword);
+    void build();
+
+public:
+    explicit Highlighter(const std::string &query);
+
+    bool empty() const { return states.size() <= 1; }
 
-    // highlight keywords in the text
-    static std::string reHighlight(const std::string &text, const std::string &query);
+    std::string highlight(const std::string &text) const;
 };
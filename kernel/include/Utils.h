@@ -1,10 +1,13 @@
 #pragma once
+#include <atomic>
 #include <chrono>
+#include <concepts>
 #include <condition_variable>
 #include <exception>
 #include <filesystem>
 #include <string>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <fstream>
@@ -31,6 +34,9 @@ This file contains utility functions and classes for the project.
 
 /*
 A global logger.
+Records are pushed into a bounded lock-free ring buffer and written to disk by a background flusher thread,
+so callers never block on disk I/O.
+When the buffer is full, DEBUG and INFO records are dropped (and counted), WARNING and above wait for free space.
 */
 class Logger
 {
@@ -46,27 +52,95 @@ public:
     static const std::string levelToString(Level level);
 
 private:
+    struct Record
+    {
+        Level level;
+        std::chrono::system_clock::time_point time;
+        std::string message;
+    };
+
+    // slot of the ring buffer, sequence tells whether it is free for producers or ready for the flusher
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    constexpr static size_t bufferCapacity = 1 << 13; // must be power of 2
+    constexpr static auto flushInterval = std::chrono::milliseconds(100);
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<size_t> enqueuePos = 0;
+    alignas(64) size_t dequeuePos = 0; // only accessed by flusher thread
+    std::atomic<size_t> writtenPos = 0; // records before this position have been written
+    std::atomic<size_t> droppedCount = 0;
+
+    // multiple producers, return false if buffer is full
+    bool tryPush(Record &record);
+    // single consumer, only called by flusher thread
+    bool tryPop(Record &record);
+
+    std::thread flusherThread;
+    std::mutex flushMutex;
+    std::condition_variable flushCv; // wake up flusher
+    std::condition_variable writtenCv; // notify flush() callers
+    std::atomic<bool> flushRequested = false;
+    bool stopping = false;
+    std::atomic<bool> running = false;
+
+    void flusherLoop();
+    // pop all records and write them in one batch
+    void drain();
+
     Level logLevel = Level::INFO;
-    std::mutex mutex;
+    std::mutex mutex; // protect log file and console output
     std::filesystem::path logFilePath;
     std::ofstream logFile;
     bool toConsole = true;
     int maxLogFileCount;
 
+    void write(const std::string &text);
+
     void cleanOldLogFiles(std::filesystem::path logFileDir);
 
 public:
     Logger(const std::filesystem::path &logFileDir, bool toConsole, Level logLevel = Level::INFO, int maxLogFileCount = 20);
 
-    ~Logger() = default;
+    // write all pending records and stop flusher thread
+    ~Logger();
+
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    bool isEnabled(Level level) const
+    {
+        return level >= logLevel;
+    }
 
     void log(const std::string &message, Level level = Level::INFO);
 
+    // block until all records logged before this call have been written
+    void flush();
+
     void debug(const std::string &message);
     void info(const std::string &message);
     void warning(const std::string &message);
     void exception(const std::string &message);
     void fatal(const std::string &message);
+
+    // lazy version, message is only built if the level is enabled
+    template <std::invocable F>
+    void debug(F &&buildMessage)
+    {
+        if (isEnabled(Level::DEBUG))
+            log(buildMessage(), Level::DEBUG);
+    }
+    template <std::invocable F>
+    void info(F &&buildMessage)
+    {
+        if (isEnabled(Level::INFO))
+            log(buildMessage(), Level::INFO);
+    }
 };
 extern Logger logger;
 
@@ -108,7 +182,7 @@ Used for search and keyword extraction.
 */
 namespace jiebaTokenizer
 {
-    extern cppjieba::Jieba *jieba; 
+    extern std::atomic<cppjieba::Jieba *> jieba; // use get_jieba_ptr(), it is null until initialized
     extern std::mutex jiebaMutex;
 
     int jieba_tokenizer_create(void *sqlite3_api, const char **azArg, int nArg, Fts5Tokenizer **ppOut);
@@ -124,6 +198,9 @@ namespace jiebaTokenizer
     void cutForSearch(const std::string &text, std::vector<std::string> &words, bool needLower = true);
 
     void extractKeyword(const std::string &text, std::vector<std::string> &keywords, int topK = 5);
+
+    // words in the stop word dict of jieba, such as "的" and "the", loaded on first call
+    bool isStopWord(const std::string &word);
 }
 
 
@@ -174,7 +251,7 @@ namespace Utils
 
     nlohmann::json readJsonFile(const std::filesystem::path &path);
 
-    std::string getTimeStr();
+    std::string getTimeStr(std::chrono::system_clock::time_point time = std::chrono::system_clock::now());
 
     // a thread-safe callback manager
     class CallbackManager
@@ -209,7 +286,8 @@ namespace Utils
     public:
         Timer(std::string message, std::source_location beginLocation = std::source_location::current());
 
-        void stop(std::source_location endLocation = std::source_location::current());
+        // return the time cost in milliseconds
+        double stop(std::source_location endLocation = std::source_location::current());
 
         ~Timer();
     };
@@ -244,6 +322,8 @@ namespace Utils
 
         bool empty();
 
+        size_t size() const;
+
         // wake all waiting threads and pop() will exit with nullptr
         void shutdown();
     };
@@ -89,10 +89,18 @@ public:
 
     // write all changes to disk, this may delete vector from faiss index, make sure sqlite table has committed all changes before calling this function
     void write();
+    // forget unwritten changes, the destructor will not write to disk or sqlite, used before the table is dropped
+    void discardChanges();
+    // rebuild the faiss index from vectors committed in sqlite, after a transaction adding vectors is rolled back,
+    // vectors of rolled back rows are dropped, so their ids can be reused by new chunks, must be called outside transactions
+    void dropUncommittedVectors();
 
     // return ids which aren't in the faiss index, which means they will never appeare in the query result
     std::vector<idx_t> getInvalidIds() const;
 
+    // return ids of given ids which have no valid vector in the table, keep the order of given ids
+    std::vector<idx_t> getMissingIds(const std::vector<idx_t> &ids) const;
+
     // drop table and delete faiss index file
     static void dropTable(SqliteConnection &sqlite, const std::filesystem::path& path, const std::string &tableName);
 };
\ No newline at end of file
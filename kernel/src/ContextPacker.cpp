@@ -0,0 +1,193 @@
+#include "ContextPacker.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+
+namespace
+{
+    // jaccard similarity of sorted unique token ids
+    double similarity(const std::vector<int> &a, const std::vector<int> &b)
+    {
+        if (a.empty() || b.empty())
+            return 0.0;
+        size_t i = 0, j = 0, common = 0;
+        while (i < a.size() && j < b.size())
+        {
+            if (a[i] < b[j])
+                i++;
+            else if (a[i] > b[j])
+                j++;
+            else
+            {
+                common++;
+                i++;
+                j++;
+            }
+        }
+        return static_cast<double>(common) / (a.size() + b.size() - common);
+    }
+}
+
+ContextPacker::ContextPacker(Tokenizer tokenizer, double diversity) : tokenizer(tokenizer), diversity(std::clamp(diversity, 0.0, 1.0))
+{
+}
+
+std::vector<int> ContextPacker::tokenize(const std::string &text) const
+{
+    if (tokenizer)
+        return tokenizer(text);
+    std::vector<int> codePoints;
+    for (size_t i = 0; i < text.size();)
+    {
+        auto c = static_cast<unsigned char>(text[i]);
+        int length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+        int codePoint = c;
+        for (int k = 1; k < length && i + k < text.size(); k++)
+            codePoint = (codePoint << 6) | (static_cast<unsigned char>(text[i + k]) & 0x3F);
+        codePoints.push_back(codePoint);
+        i += length;
+    }
+    return codePoints;
+}
+
+int ContextPacker::countTokens(const std::string &text) const
+{
+    return static_cast<int>(tokenize(text).size());
+}
+
+std::string ContextPacker::format(const Block &block)
+{
+    return "[content]\n" + block.content + "\n" + "[metadata]\n" + block.metadata + "\n";
+}
+
+std::vector<ContextPacker::Block> ContextPacker::mergeChunks(const std::vector<Repository::SearchResult> &results)
+{
+    std::map<std::string, std::vector<const Repository::SearchResult *>> files; // filePath -> chunks
+    for (const auto &result : results)
+        files[result.filePath].push_back(&result);
+
+    std::vector<Block> blocks;
+    for (auto &[filePath, chunks] : files)
+    {
+        // larger chunk first if they begin at the same line, so contained chunks come after their container
+        std::sort(chunks.begin(), chunks.end(), [](const auto *a, const auto *b) {
+            if (a->beginLine != b->beginLine)
+                return a->beginLine < b->beginLine;
+            return a->endLine > b->endLine;
+        });
+        std::vector<Block> fileBlocks;
+        for (const auto *chunk : chunks)
+        {
+            if (!fileBlocks.empty())
+            {
+                auto &last = fileBlocks.back();
+                if (chunk->endLine <= last.endLine) // contained in last block
+                {
+                    last.score = std::max(last.score, chunk->score);
+                    last.chunkIds.push_back(chunk->chunkId);
+                    continue;
+                }
+                if (chunk->beginLine == last.endLine + 1) // adjacent
+                {
+                    last.content += "\n" + chunk->content;
+                    if (chunk->metadata != last.metadata)
+                        last.metadata += "\n" + chunk->metadata;
+                    last.endLine = chunk->endLine;
+                    last.score = std::max(last.score, chunk->score);
+                    last.chunkIds.push_back(chunk->chunkId);
+                    continue;
+                }
+            }
+            Block block;
+            block.content = chunk->content;
+            block.metadata = chunk->metadata;
+            block.filePath = filePath;
+            block.beginLine = chunk->beginLine;
+            block.endLine = chunk->endLine;
+            block.score = chunk->score;
+            block.chunkIds.push_back(chunk->chunkId);
+            fileBlocks.push_back(std::move(block));
+        }
+        for (auto &block : fileBlocks)
+            blocks.push_back(std::move(block));
+    }
+    return blocks;
+}
+
+void ContextPacker::truncate(Block &block, int tokenBudget) const
+{
+    while (block.tokenCount > tokenBudget && !block.content.empty())
+    {
+        // assume tokens are distributed evenly, cut a bit more to converge quickly
+        auto length = static_cast<size_t>(block.content.size() * 0.9 * tokenBudget / block.tokenCount);
+        length = std::min(length, block.content.size() - 1);
+        while (length > 0 && (static_cast<unsigned char>(block.content[length]) & 0xC0) == 0x80)
+            length--; // do not split a utf-8 character
+        block.content.resize(length);
+        block.tokenCount = countTokens(format(block));
+    }
+}
+
+std::vector<ContextPacker::Block> ContextPacker::pack(const std::vector<Repository::SearchResult> &results, int tokenBudget) const
+{
+    auto blocks = mergeChunks(results);
+    if (blocks.empty() || tokenBudget <= 0)
+        return {};
+
+    // normalize scores to [0, 1], scores of fused and reranked results are in different ranges
+    auto [minIt, maxIt] = std::minmax_element(blocks.begin(), blocks.end(), [](const Block &a, const Block &b) { return a.score < b.score; });
+    double minScore = minIt->score;
+    double scoreRange = maxIt->score - minScore;
+    std::vector<double> relevance;
+    std::vector<std::vector<int>> tokenSets; // sorted unique token ids of content, for similarity
+    for (auto &block : blocks)
+    {
+        relevance.push_back(scoreRange > 0 ? (block.score - minScore) / scoreRange : 1.0);
+        block.tokenCount = countTokens(format(block));
+        auto tokens = tokenize(block.content);
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+        tokenSets.push_back(std::move(tokens));
+    }
+
+    std::vector<Block> packed;
+    std::vector<size_t> selected;
+    std::vector<bool> used(blocks.size(), false);
+    int remaining = tokenBudget;
+    while (true)
+    {
+        int best = -1;
+        double bestValue = 0.0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (used[i] || blocks[i].tokenCount > remaining)
+                continue;
+            double maxSimilarity = 0.0;
+            for (auto j : selected)
+                maxSimilarity = std::max(maxSimilarity, similarity(tokenSets[i], tokenSets[j]));
+            double value = (1 - diversity) * relevance[i] - diversity * maxSimilarity;
+            if (best == -1 || value > bestValue)
+            {
+                best = static_cast<int>(i);
+                bestValue = value;
+            }
+        }
+        if (best == -1)
+            break;
+        used[best] = true;
+        selected.push_back(best);
+        remaining -= blocks[best].tokenCount;
+        packed.push_back(blocks[best]);
+    }
+
+    // even the smallest block does not fit, use the beginning of the most relevant one
+    if (packed.empty())
+    {
+        auto block = blocks[std::distance(relevance.begin(), std::max_element(relevance.begin(), relevance.end()))];
+        truncate(block, tokenBudget);
+        if (!block.content.empty())
+            packed.push_back(std::move(block));
+    }
+    return packed;
+}
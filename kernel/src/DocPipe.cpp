@@ -3,12 +3,15 @@
 #include <iostream>
 #include <filesystem>
 #include <chrono>
+#include <map>
+#include <unordered_map>
 #include <xxhash.h>
 
 #include "SqliteConnection.h"
 #include "VectorTable.h"
 #include "TextSearchTable.h"
 #include "Chunker.h"
+#include "Metrics.h"
 #include "Utils.h"
 
 //-------------------------------------DocPipe-------------------------------------//
@@ -315,40 +318,82 @@ void DocPipe::updateSqlite(std::string hash)
 void DocPipe::updateToTable(Progress &progress, std::function<bool(void)> stopFlag)
 {
     // 1. open file and read content to a string
+    static auto &readLatency = Metrics::histogram("docpipe.read");
+    Metrics::ScopedTimer readTimer(readLatency);
     auto content = readDoc();
+    readTimer.stop();
     progress.finishSubprogress(); // finish open file progress
     
-    // 2. for each embedding model, update the embedding table and vector table
+    // 2. group embeddings by chunk length, chunk once for each group
     if(embeddings.size() != vTable.size())
         throw Error{"Embedding model size and vector table size do not match: " + std::to_string(embeddings.size()) + " vs " + std::to_string(vTable.size()), Error::Type::Internal};
-    for(int i = 0; i < embeddings.size(); i++)
+    std::map<int, std::vector<size_t>> groups; // chunk length -> indexes of embeddings
+    for(size_t i = 0; i < embeddings.size(); i++)
     {
-        auto &embedding = embeddings[i]; // get embedding model
-        auto &vectortable = vTable[i]; // get vector table
-        updateOneEmbedding(content, embedding, vectortable, progress, stopFlag); // update embedding for this model
+        groups[embeddings[i]->chunkLength].push_back(i);
+    }
+    std::set<int> chunkLengths;
+    for(auto &[chunkLength, _] : groups)
+    {
+        chunkLengths.insert(chunkLength);
+    }
+    deleteUnusedChunks(chunkLengths);
+
+    // 3. for each chunk length, update chunks and text search table, then vector tables of its embeddings
+    for(auto &[chunkLength, group] : groups)
+    {
+        updateChunks(content, chunkLength, group, progress, stopFlag);
         if(stopFlag()) 
             return; 
-        progress.finishSubprogress(); // finish embedding progress
     }
 }
 
-// a slowly version, can be improved by adding batch process
-void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Embedding> &embedding, std::shared_ptr<VectorTable> &vectortable, Progress &progress, std::function<bool(void)> stopFlag)
+void DocPipe::deleteUnusedChunks(const std::set<int> &chunkLengths)
 {
-    // 1. split content to chunks
-    int chunkLength = embedding->inputLength;
-    if (embedding->inputLength > embedding->model->getMaxLength())
+    std::vector<int64_t> chunkIds;
+    auto stmt = sqlite.getStatement("SELECT chunk_id, chunk_length FROM chunks WHERE doc_id = ?;");
+    stmt.bind(1, docId);
+    while (stmt.step())
     {
-        chunkLength = embedding->model->getMaxLength();
-        logger.warning("[DocPipe] Embedding " + embedding->embeddingName + "'s input length is too long, use " + std::to_string(chunkLength) + " instead of " + std::to_string(embedding->inputLength));
+        if (!chunkLengths.contains(stmt.get<int>(1)))
+            chunkIds.push_back(stmt.get<int64_t>(0));
     }
+    if (chunkIds.empty())
+        return;
+
+    auto trans = sqlite.beginTransaction();
+    auto deleteStmt = sqlite.getStatement("DELETE FROM chunks WHERE chunk_id = ?;");
+    for (auto chunkId : chunkIds)
+    {
+        deleteStmt.bind(1, chunkId);
+        deleteStmt.step();
+        deleteStmt.reset();
+        tTable.deleteChunk(chunkId);
+    }
+    // vectors of these chunks are in vector tables of removed embeddings, which are dropped with their configs
+    trans.commit();
+}
+
+void DocPipe::updateChunks(const std::string &content, int chunkLength, const std::vector<size_t> &group, Progress &progress, std::function<bool(void)> stopFlag)
+{
+    static auto &chunkLatency = Metrics::histogram("docpipe.chunk");
+    static auto &diffLatency = Metrics::histogram("docpipe.diff");
+    static auto &embedLatency = Metrics::histogram("docpipe.embed");
+    static auto &writeLatency = Metrics::histogram("docpipe.write");
+    static auto &chunksAdded = Metrics::counter("docpipe.chunksAdded");
+    static auto &vectorsAdded = Metrics::counter("docpipe.vectorsAdded");
+
+    // 1. split content to chunks
     std::vector<Chunker::Chunk> newChunks;
+    Metrics::ScopedTimer chunkTimer(chunkLatency);
     Chunker chunker(docType, chunkLength); // create chunker
     newChunks = chunker(content, {{"FilePath", docFullPath.string()}}); 
+    chunkTimer.stop();
     progress.updateSubprocess(0.01); 
 
     // 2. get existing chunks
     // get existing chunks from sql chunks table
+    Metrics::ScopedTimer diffTimer(diffLatency);
     struct chunkRow
     {
         int64_t chunkId;
@@ -356,10 +401,10 @@ void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Emb
         std::string contentHash;
     };
     std::unordered_multimap<std::string, chunkRow> existingChunks; // construct hash map for existing chunks : hash -> chunkRow
-    auto sql = "SELECT chunk_id, chunk_index, content_hash FROM chunks WHERE doc_id = ? AND embedding_id = ?;";
+    auto sql = "SELECT chunk_id, chunk_index, content_hash FROM chunks WHERE doc_id = ? AND chunk_length = ?;";
     auto stmt = sqlite.getStatement(sql);
     stmt.bind(1, docId);
-    stmt.bind(2, embedding->embeddingId);
+    stmt.bind(2, chunkLength);
     while (stmt.step())
     {
         chunkRow row;
@@ -373,18 +418,22 @@ void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Emb
     // 3. compare new chunks with existing chunks, and update / add / delete chunks
     // traverse new chunks to add and update chunk in tables
     auto trans1 = sqlite.beginTransaction(); // begin transaction
+    std::vector<int64_t> chunkIds(newChunks.size(), -1); // chunk id of each new chunk, -1 if not added yet
+    std::vector<std::string> hashes(newChunks.size());
     std::queue<size_t> addChunkQueue; // only store index for add
-    std::queue<std::pair<size_t, int64_t>> updateChunkQueue; // store index and chunk id for update
+    std::queue<size_t> updateChunkQueue; // store index for update, its chunk id is in chunkIds
     for (int index = 1; index <= newChunks.size(); index++) // index begin with 1, defferent with NULL value of sqlite
     {
         auto& chunk = newChunks[index - 1]; // get new chunk
-        auto hash = Utils::calculateHash(chunk.content + chunk.metadata); // calculate hash for new chunk
+        auto& hash = hashes[index - 1];
+        hash = Utils::calculateHash(chunk.content + chunk.metadata); // calculate hash for new chunk
         auto it = existingChunks.find(hash);                 // find hash in existing chunks
         if (it != existingChunks.end())   // found, update chunk
         {
+            chunkIds[index - 1] = it->second.chunkId;
             if (it->second.chunkIndex != index) // deffrend index, update chunk index
             {
-                updateChunkQueue.push({index, it->second.chunkId}); // add chunk to update queue
+                updateChunkQueue.push(index); // add chunk to update queue
                 // set their index to NULL, avoid conflict with other chunks
                 auto sql = "UPDATE chunks SET chunk_index = NULL WHERE chunk_id = ?;"; // update sql statement
                 auto stmt = sqlite.getStatement(sql); // prepare statement
@@ -401,6 +450,7 @@ void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Emb
         }
     }
     // delete remaining chunks in existing chunks
+    std::vector<int64_t> deletedChunkIds;
     for(auto& [_, row] : existingChunks)
     {
         // delete chunk from chunks table
@@ -412,27 +462,31 @@ void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Emb
         if(stmt.changes() == 0) // check if deleted
             throw Error{"Failed to delete chunk from database: " + std::to_string(chunkid), Error::Type::Internal};
         
-        // delete vector from vector table
-        vectortable->removeVector(chunkid); // remove vector from vector table
-
         // delete text from text table
         tTable.deleteChunk(chunkid); // delete text from text table
+        deletedChunkIds.push_back(chunkid);
+    }
+    // delete vectors from vector tables of all embeddings sharing these chunks, some may be not embedded yet
+    for(auto i : group)
+    {
+        vTable[i]->removeVectorIfExists(deletedChunkIds);
     }
     progress.updateSubprocess(0.03);
     // update chunks
     while (!updateChunkQueue.empty())
     {
-        auto [index, chunkid] = updateChunkQueue.front(); // get chunk index
+        auto index = updateChunkQueue.front(); // get chunk index
         updateChunkQueue.pop();
         auto &chunk = newChunks[index - 1]; // get chunk from new chunks
+        auto chunkid = chunkIds[index - 1];
 
         // update chunks table
         auto sql = "UPDATE chunks SET chunk_index = ?, begin_line = ?, end_line = ? WHERE chunk_id = ?;";
         auto stmt = sqlite.getStatement(sql); // prepare statement
         stmt.bind(1, index);                  // bind new index
-        stmt.bind(2, chunkid);                // bind chunk id
-        stmt.bind(3, chunk.beginLine);        // bind begin line
-        stmt.bind(4, chunk.endLine);          // bind end line
+        stmt.bind(2, chunk.beginLine);        // bind begin line
+        stmt.bind(3, chunk.endLine);          // bind end line
+        stmt.bind(4, chunkid);                // bind chunk id
         stmt.step();                          // execute statement
         if (stmt.changes() == 0)              // check if updated
             throw Error{"Failed to update chunk in database: " + std::to_string(chunkid), Error::Type::Internal};
@@ -440,25 +494,21 @@ void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Emb
         // no need to update vector table and text table, no changes
     }
     progress.updateSubprocess(0.04); // update progress
-    trans1.commit(); // commit transaction, commit changes, because operation below may be terminate any time
-    // add chunks
-    auto trans2 = sqlite.beginTransaction(); // begin transaction for adding chunks
-    double addCount = addChunkQueue.size();
-    size_t chunkCount = 0;
+    // add chunks, text search table is updated here once for all embeddings of this chunk length
     while(!addChunkQueue.empty())
     {
         auto index = addChunkQueue.front(); // get chunk index
         addChunkQueue.pop(); // remove from queue
         auto& chunk = newChunks[index - 1]; // get chunk from new chunks
-        auto hash = Utils::calculateHash(chunk.content + chunk.metadata); // calculate hash for new chunk
 
         // add chunk to chunks table
-        auto sql = "INSERT INTO chunks (doc_id, embedding_id, chunk_index, content_hash, begin_line, end_line) VALUES (?, ?, ?, ?, ?, ?);";
+        Metrics::ScopedTimer writeTimer(writeLatency);
+        auto sql = "INSERT INTO chunks (doc_id, chunk_length, chunk_index, content_hash, begin_line, end_line) VALUES (?, ?, ?, ?, ?, ?);";
         auto stmt = sqlite.getStatement(sql); // prepare statement
         stmt.bind(1, docId); // bind doc id
-        stmt.bind(2, embedding->embeddingId); // bind embedding id
+        stmt.bind(2, chunkLength); // bind chunk length
         stmt.bind(3, index); // bind chunk index
-        stmt.bind(4, hash); // bind content hash
+        stmt.bind(4, hashes[index - 1]); // bind content hash
         stmt.bind(5, chunk.beginLine); // bind begin line
         stmt.bind(6, chunk.endLine); // bind end line
         stmt.step(); // execute statement
@@ -466,36 +516,109 @@ void DocPipe::updateOneEmbedding(const std::string &content, std::shared_ptr<Emb
             throw Error{"Failed to add chunk to database: " + std::to_string(docId), Error::Type::Internal};
 
         auto chunkid = sqlite.getLastInsertId(); // get chunk id
-
-        // add chunk to vector table
-        auto embedVector = embedding->model->embed(Utils::chunkTosequence(chunk.content, chunk.metadata)); // get vector from embedding
-        vectortable->addVector(chunkid, embedVector); // add vector to vector table
+        chunkIds[index - 1] = chunkid;
 
         // add chunk to text table
         tTable.addChunk({chunk.content, chunk.metadata, chunkid}); // add text to text table
+        writeTimer.stop();
+        chunksAdded.add();
+    }
+    trans1.commit(); // commit transaction, commit changes, because operation below may be terminate any time
+    diffTimer.stop();
 
-        progress.updateSubprocess(0.04 + (addCount - addChunkQueue.size()) * 0.95 / addCount); // update progress
-
-        // check stop flag
-        if(stopFlag()) // check if stop flag is set
+    // 4. embed chunks for each embedding, chunks embedded before (by a stopped run or unchanged chunks) are skipped
+    std::unordered_map<int64_t, size_t> chunkIndexes; // chunk id -> index in newChunks
+    for(size_t i = 0; i < chunkIds.size(); i++)
+    {
+        chunkIndexes[chunkIds[i]] = i;
+    }
+    for(auto i : group)
+    {
+        auto &embedding = embeddings[i];
+        auto &vectortable = vTable[i];
+        auto missingIds = vectortable->getMissingIds(chunkIds);
+
+        auto trans2 = sqlite.beginTransaction(); // begin transaction for adding vectors
+        double addCount = missingIds.size();
+        size_t vectorCount = 0;
+        std::vector<float> embedVector(embedding->model->getDimension()); // reused by every chunk, model writes into it directly
+        for(auto chunkid : missingIds)
         {
-            trans2.commit(); // commit part of chunks
-            return;
-        }
+            auto& chunk = newChunks[chunkIndexes[chunkid]];
+
+            // add chunk to vector table
+            Metrics::ScopedTimer embedTimer(embedLatency);
+            embedding->model->embed(Utils::chunkTosequence(chunk.content, chunk.metadata), embedVector.data(), ONNXModel::priority::background); // get vector from embedding
+            embedTimer.stop();
+            Metrics::ScopedTimer indexTimer(writeLatency);
+            vectortable->addVector(chunkid, embedVector); // add vector to vector table
+            indexTimer.stop();
+            vectorsAdded.add();
+            vectorCount++;
+
+            progress.updateSubprocess(0.04 + vectorCount * 0.95 / addCount); // update progress
+
+            // check stop flag
+            if(stopFlag()) // check if stop flag is set
+            {
+                trans2.commit(); // commit part of vectors
+                return;
+            }
 
-        if(chunkCount % 200 == 0) // save every 200 chunks
-        {
-            trans2.commit();
-            trans2 = sqlite.beginTransaction(); // begin transaction for adding chunks
+            if(vectorCount % 200 == 0) // save every 200 vectors
+            {
+                trans2.commit();
+                trans2 = sqlite.beginTransaction(); // begin transaction for adding vectors
+            }
         }
-        chunkCount++;
+        trans2.commit();
+        progress.finishSubprogress(); // finish embedding progress
     }
-    trans2.commit();
 
     return;
 }
 
 
+//---------------------------------GroupCommit---------------------------------//
+void DocPipe::GroupCommit::begin()
+{
+    if (transaction)
+        return;
+    transaction.emplace(sqlite.beginTransaction());
+    beginTime = std::chrono::steady_clock::now();
+    documentCount = 0;
+}
+
+bool DocPipe::GroupCommit::done()
+{
+    if (!transaction)
+        return false;
+    documentCount++;
+    if (documentCount < maxDocuments && std::chrono::steady_clock::now() - beginTime < maxDuration)
+        return false;
+    commit();
+    return true;
+}
+
+void DocPipe::GroupCommit::commit()
+{
+    if (!transaction)
+        return;
+    static auto &commitCount = Metrics::counter("docpipe.groupCommits");
+    static auto &documentsCommitted = Metrics::counter("docpipe.groupDocuments"); // divided by groupCommits for group size
+    static auto &commitLatency = Metrics::histogram("docpipe.commit");
+    commitCount.add();
+    documentsCommitted.add(documentCount);
+    Metrics::ScopedTimer commitTimer(commitLatency);
+    transaction->commit();
+    transaction.reset();
+}
+
+void DocPipe::GroupCommit::rollback()
+{
+    transaction.reset(); // rollback by its destructor if still active
+}
+
 //---------------------------------Progress---------------------------------//
 DocPipe::Progress::Progress(std::function<void(double)> callback, std::vector<std::pair<std::string, double>> subProgress) : callback(callback)
 {
@@ -0,0 +1,211 @@
+#include "Executor.h"
+
+#include <algorithm>
+#include <string>
+
+#include "Metrics.h"
+#include "Utils.h"
+
+namespace
+{
+    constexpr std::array<const char *, Executor::priorityCount> priorityNames = {"interactive", "background"};
+
+    // time from post() to the start of the task, for each priority class
+    Metrics::Histogram &waitLatency(int lane)
+    {
+        static std::array<Metrics::Histogram *, Executor::priorityCount> histograms = {
+            &Metrics::histogram("executor.wait.interactive"),
+            &Metrics::histogram("executor.wait.background")};
+        return *histograms[lane];
+    }
+}
+
+thread_local int Executor::currentWorker = -1;
+
+Executor::Executor(int budget) : budget(budget)
+{
+    // with a budget of 1, an extra worker is started, or a background task would keep interactive ones waiting
+    int count = std::max(budget, minWorkers);
+    maxRunning = {count, count - 1};
+    for (int i = 0; i < count; i++)
+        workers.push_back(std::make_unique<Worker>());
+    for (int i = 0; i < count; i++)
+        threads.emplace_back(&Executor::workLoop, this, i);
+    logger.info("[Executor] started with " + std::to_string(count) + " workers, cpu budget " + std::to_string(budget) + ".");
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdownFlag = true;
+    }
+    cv.notify_all();
+    for (auto &thread : threads)
+        thread.join(); // pending tasks are dropped, the process is exiting
+}
+
+bool Executor::configure(int cpuBudget)
+{
+    cpuBudget = std::max(cpuBudget, 0);
+    if (started)
+        return cpuBudget == configuredBudget;
+    configuredBudget = cpuBudget;
+    return true;
+}
+
+int Executor::cpuBudget()
+{
+    int configured = configuredBudget;
+    if (configured > 0)
+        return configured;
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+int Executor::onnxThreads()
+{
+    return std::max(1, cpuBudget() - 1);
+}
+
+Executor &Executor::instance()
+{
+    static Executor executor([]() {
+        started = true;
+        return cpuBudget();
+    }());
+    return executor;
+}
+
+void Executor::post(Priority p, Task task)
+{
+    static auto &postCount = Metrics::counter("executor.tasks");
+    postCount.add();
+
+    int lane = static_cast<int>(p);
+    Item item{std::move(task), std::chrono::steady_clock::now()};
+    if (currentWorker >= 0)
+    {
+        // posted by a running task, keep it on this worker, idle workers will steal it
+        auto &worker = *workers[currentWorker];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queues[lane].push_back(std::move(item));
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queues[lane].push_back(std::move(item));
+    }
+    signal();
+}
+
+void Executor::signal()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        epoch++;
+    }
+    cv.notify_one();
+}
+
+bool Executor::take(int index, Priority p, Item &item)
+{
+    int lane = static_cast<int>(p);
+    if (running[lane].fetch_add(1) >= maxRunning[lane])
+    {
+        running[lane].fetch_sub(1);
+        return false;
+    }
+    if (popOwn(index, p, item) || popGlobal(p, item) || steal(index, p, item))
+        return true;
+    running[lane].fetch_sub(1);
+    return false;
+}
+
+bool Executor::popOwn(int index, Priority p, Item &item)
+{
+    auto &worker = *workers[index];
+    auto &queue = worker.queues[static_cast<int>(p)];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (queue.empty())
+        return false;
+    item = std::move(queue.back()); // newest first, its data is likely still in cache
+    queue.pop_back();
+    return true;
+}
+
+bool Executor::popGlobal(Priority p, Item &item)
+{
+    auto &queue = queues[static_cast<int>(p)];
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queue.empty())
+        return false;
+    item = std::move(queue.front());
+    queue.pop_front();
+    return true;
+}
+
+bool Executor::steal(int index, Priority p, Item &item)
+{
+    static auto &stealCount = Metrics::counter("executor.steals");
+    for (int i = 1; i < workerCount(); i++)
+    {
+        auto &victim = *workers[(index + i) % workerCount()];
+        auto &queue = victim.queues[static_cast<int>(p)];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (queue.empty())
+            continue;
+        item = std::move(queue.front()); // oldest first, the owner works on the newest
+        queue.pop_front();
+        stealCount.add();
+        return true;
+    }
+    return false;
+}
+
+void Executor::workLoop(int index)
+{
+    currentWorker = index;
+    Utils::setThreadName("executor" + std::to_string(index));
+    while (true)
+    {
+        uint64_t seenEpoch;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (shutdownFlag)
+                return;
+            seenEpoch = epoch;
+        }
+
+        Item item;
+        int lane = -1;
+        for (int p = 0; p < priorityCount && lane < 0; p++)
+        {
+            if (take(index, static_cast<Priority>(p), item))
+                lane = p;
+        }
+        if (lane < 0)
+        {
+            // a task posted or finished after seenEpoch was read may be runnable now, so only sleep if nothing changed
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this, seenEpoch]() { return shutdownFlag || epoch != seenEpoch; });
+            continue;
+        }
+
+        waitLatency(lane).record(std::chrono::steady_clock::now() - item.postTime);
+        try
+        {
+            item.task();
+        }
+        catch (const std::exception &e)
+        {
+            logger.warning("[Executor] " + std::string(priorityNames[lane]) + " task error: " + e.what());
+        }
+        catch (...)
+        {
+            logger.warning("[Executor] " + std::string(priorityNames[lane]) + " task error: unknown exception");
+        }
+        item.task = nullptr; // release captures before the slot is released
+        running[lane].fetch_sub(1);
+        signal(); // tasks waiting for a running slot of this class can start now
+    }
+}
@@ -0,0 +1,236 @@
+#include "HttpTransport.h"
+
+#include <algorithm>
+
+#include "Metrics.h"
+#include "Utils.h"
+
+size_t HttpTransport::Transfer::writeCallback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    auto transfer = static_cast<Transfer *>(userdata);
+    size_t realsize = size * nmemb;
+    auto &request = transfer->request;
+    if (request.stopFlag && request.stopFlag())
+        return 0; // abort with CURLE_WRITE_ERROR
+    try
+    {
+        if (request.onData && !request.onData(std::string_view(ptr, realsize)))
+            return 0;
+    }
+    catch (...)
+    {
+        return 0; // exceptions must not pass through curl
+    }
+    return realsize;
+}
+
+HttpTransport::HttpTransport()
+{
+    multi = curl_multi_init();
+    share = curl_share_init();
+    if (!multi || !share)
+        throw Error{"Cannot initialize CURL multi handle", Error::Type::Network};
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    thread = std::thread(&HttpTransport::ioLoop, this);
+}
+
+HttpTransport::~HttpTransport()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdownFlag = true;
+    }
+    curl_multi_wakeup(multi);
+    thread.join();
+    // the process is exiting, unfinished requests are dropped without callbacks
+    for (auto &[easy, transfer] : running)
+    {
+        curl_multi_remove_handle(multi, easy);
+        curl_easy_cleanup(easy);
+    }
+    for (auto easy : idleHandles)
+        curl_easy_cleanup(easy);
+    curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
+}
+
+HttpTransport &HttpTransport::instance()
+{
+    static HttpTransport transport;
+    return transport;
+}
+
+void HttpTransport::send(Request request)
+{
+    auto transfer = std::make_unique<Transfer>();
+    transfer->request = std::move(request);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        incoming.push_back(std::move(transfer));
+    }
+    curl_multi_wakeup(multi);
+}
+
+void HttpTransport::wakeUp()
+{
+    curl_multi_wakeup(multi);
+}
+
+void HttpTransport::complete(Transfer &transfer, CURLcode code, long httpCode)
+{
+    try
+    {
+        if (transfer.request.onDone)
+            transfer.request.onDone(code, httpCode);
+    }
+    catch (const std::exception &e)
+    {
+        logger.warning("[HttpTransport] request callback error: " + std::string(e.what()));
+    }
+}
+
+void HttpTransport::startTransfer(std::unique_ptr<Transfer> transfer)
+{
+    CURL *easy = nullptr;
+    if (!idleHandles.empty())
+    {
+        easy = idleHandles.back();
+        idleHandles.pop_back();
+    }
+    else
+    {
+        easy = curl_easy_init();
+    }
+    if (!easy)
+    {
+        complete(*transfer, CURLE_FAILED_INIT, 0);
+        return;
+    }
+
+    auto &request = transfer->request;
+    curl_easy_setopt(easy, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, request.headers.get());
+    curl_easy_setopt(easy, CURLOPT_POST, 1L);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(request.body.size()));
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request.body.c_str());
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, request.connectTimeout);
+    curl_easy_setopt(easy, CURLOPT_VERBOSE, request.verbose ? 1L : 0L);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &Transfer::writeCallback);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+    curl_easy_setopt(easy, CURLOPT_SHARE, share);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L); // prefer multiplexing on a connection being set up to a new connection
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+
+    transfer->startTime = std::chrono::steady_clock::now();
+    if (curl_multi_add_handle(multi, easy) != CURLM_OK)
+    {
+        curl_easy_cleanup(easy);
+        complete(*transfer, CURLE_FAILED_INIT, 0);
+        return;
+    }
+    running[easy] = std::move(transfer);
+}
+
+void HttpTransport::finishTransfer(CURL *easy, CURLcode code)
+{
+    static auto &requestCount = Metrics::counter("http.requests");
+    static auto &connectionCount = Metrics::counter("http.newConnections");
+    static auto &totalLatency = Metrics::histogram("http.total");
+
+    auto it = running.find(easy);
+    if (it == running.end())
+        return;
+    auto transfer = std::move(it->second);
+    running.erase(it);
+
+    long httpCode = 0;
+    long newConnections = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &httpCode);
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &newConnections); // 0 if a cached connection was reused
+    requestCount.add();
+    connectionCount.add(newConnections);
+    totalLatency.record(std::chrono::steady_clock::now() - transfer->startTime);
+
+    curl_multi_remove_handle(multi, easy);
+    if (idleHandles.size() < maxIdleHandles)
+    {
+        curl_easy_reset(easy); // connections stay in the cache of multi handle
+        idleHandles.push_back(easy);
+    }
+    else
+    {
+        curl_easy_cleanup(easy);
+    }
+    complete(*transfer, code, httpCode);
+}
+
+void HttpTransport::ioLoop()
+{
+    Utils::setThreadName("httpTransport");
+    while (true)
+    {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (shutdownFlag)
+                break;
+            for (auto &transfer : incoming)
+            {
+                auto startTime = now + transfer->request.delay;
+                delayed.emplace(startTime, std::move(transfer));
+            }
+            incoming.clear();
+        }
+
+        // start due transfers, drop stopped ones without connecting
+        for (auto it = delayed.begin(); it != delayed.end();)
+        {
+            auto &request = it->second->request;
+            if (request.stopFlag && request.stopFlag())
+            {
+                complete(*it->second, CURLE_ABORTED_BY_CALLBACK, 0);
+                it = delayed.erase(it);
+            }
+            else if (it->first <= now)
+            {
+                startTransfer(std::move(it->second));
+                it = delayed.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        // a stopped transfer waiting for the first byte will not call writeCallback, abort it here
+        std::vector<CURL *> stopped;
+        for (const auto &[easy, transfer] : running)
+        {
+            if (transfer->request.stopFlag && transfer->request.stopFlag())
+                stopped.push_back(easy);
+        }
+        for (auto easy : stopped)
+            finishTransfer(easy, CURLE_ABORTED_BY_CALLBACK);
+
+        int runningCount = 0;
+        curl_multi_perform(multi, &runningCount);
+        int queued = 0;
+        while (auto message = curl_multi_info_read(multi, &queued))
+        {
+            if (message->msg == CURLMSG_DONE)
+                finishTransfer(message->easy_handle, message->data.result);
+        }
+
+        int timeoutMs = maxPollMs;
+        if (!delayed.empty())
+        {
+            auto untilNext = std::chrono::duration_cast<std::chrono::milliseconds>(delayed.begin()->first - std::chrono::steady_clock::now());
+            timeoutMs = static_cast<int>(std::clamp<int64_t>(untilNext.count(), 0, maxPollMs));
+        }
+        curl_multi_poll(multi, nullptr, 0, timeoutMs, nullptr); // returns early on socket activity or wakeUp()
+    }
+}
@@ -1,22 +1,101 @@
 #include "KernelServer.h"
+#include "Executor.h"
+#include "Metrics.h"
 #include "ONNXModel.h"
 #include "Repository.h"
 #include "Utils.h"
 
+#include <cstdlib>
 #include <exception>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <source_location>
 #include <string>
+#ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
+#endif
 
 //--------------------------KernelServer--------------------------//
+KernelServer::IpcFormat KernelServer::getIpcFormat()
+{
+    static const IpcFormat format = []() {
+        auto env = std::getenv("POCKETRAG_IPC_FORMAT");
+        if (env && std::string(env) == "msgpack")
+            return IpcFormat::msgpack;
+        return IpcFormat::json;
+    }();
+    return format;
+}
+
+void KernelServer::encodeMessage(const Json &json, std::string &out)
+{
+    if (getIpcFormat() == IpcFormat::json)
+    {
+        out += json.dump(); // dump() may throw on invalid utf-8, nothing is appended in that case
+        out += '\n';
+        return;
+    }
+    // reserve the length prefix, then serialize payload directly into out
+    auto headerPos = out.size();
+    out.append(4, '\0');
+    Json::to_msgpack(json, out);
+    uint32_t length = static_cast<uint32_t>(out.size() - headerPos - 4);
+    for (int i = 0; i < 4; i++)
+    {
+        out[headerPos + i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+    }
+}
+
+bool KernelServer::readMessage(std::string &input)
+{
+    input.clear();
+    if (getIpcFormat() == IpcFormat::json)
+    {
+        return static_cast<bool>(std::getline(std::cin, input));
+    }
+    unsigned char header[4];
+    if (!std::cin.read(reinterpret_cast<char *>(header), 4))
+    {
+        return false;
+    }
+    uint32_t length = header[0] | (header[1] << 8) | (header[2] << 16) | (static_cast<uint32_t>(header[3]) << 24);
+    input.resize(length);
+    if (!std::cin.read(input.data(), length))
+    {
+        input.clear();
+        return false;
+    }
+    return true;
+}
+
+auto KernelServer::decodeMessage(const std::string &input) -> Json
+{
+    if (getIpcFormat() == IpcFormat::json)
+    {
+        return Json::parse(input);
+    }
+    return Json::from_msgpack(input);
+}
+
 KernelServer::KernelServer(const std::filesystem::path &userDataPath) : userDataPath(std::filesystem::absolute(userDataPath))
 {
     initializeSqlite();
 
     settings = std::make_shared<Settings>(userDataPath, *this);
+
+    auto tracePath = std::getenv("POCKETRAG_SEARCH_TRACE");
+    if (tracePath && *tracePath)
+    {
+        searchTrace.open(tracePath, std::ios::app | std::ios::binary);
+        if (searchTrace.is_open())
+            logger.info("[KernelServer] Recording search trace to " + std::string(tracePath));
+        else
+            logger.warning("[KernelServer] Failed to open search trace file: " + std::string(tracePath));
+    }
 }
 
 void KernelServer::initializeSqlite()
@@ -65,9 +144,19 @@ KernelServer::~KernelServer()
 
 void KernelServer::run()
 {
+#ifdef _WIN32
+    if (getIpcFormat() == IpcFormat::msgpack)
+    {
+        // avoid CRLF translation of binary frames
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+    startMetricsDump();
     startMessageSender();
     startMessageReceiver();
     updateSettings();
+    startJiebaPreload(); // after settings are read, the executor starts with the configured cpu budget
     // sent message to frontend
     nlohmann::json initMessage;
     initMessage["sessionId"] = -1;
@@ -130,9 +219,36 @@ void KernelServer::transmitMessage(std::shared_ptr<Utils::MessageQueue::Message>
         sendBack(json);
         return;
     }
+    if (searchTrace.is_open() && !json["isReply"].get<bool>() && json["message"]["type"] == "search")
+    {
+        recordSearch(*sessions[sessionId], json);
+    }
     sessions[sessionId] -> sendMessage(message);
 }
 
+void KernelServer::recordSearch(const Session &session, const nlohmann::json &json)
+{
+    // only called by the receiver thread with sessionMutex held
+    try
+    {
+        nlohmann::json record;
+        record["time"] = Utils::getTimeStamp();
+        record["repoName"] = session.getRepoName();
+        record["repoPath"] = session.getRepoPath().string();
+        record["query"] = json["message"]["query"];
+        record["accuracy"] = json["message"]["accuracy"];
+        record["prefix"] = json["message"].value("prefix", false); // search-as-you-type, optional in the message
+        record["limit"] = getSearchLimit(); // limit is a setting, not a part of the message
+        searchTrace << record.dump() << '\n';
+        searchTrace.flush();
+    }
+    catch (const std::exception &e)
+    {
+        // the message will be checked and replied by the session
+        logger.warning("[KernelServer.recordSearch] Failed to record search message: " + std::string(e.what()));
+    }
+}
+
 void KernelServer::handleMessage(nlohmann::json &json, std::shared_ptr<Utils::Timer> msgTimer)
 {
     try
@@ -430,6 +546,12 @@ void KernelServer::handleMessage(nlohmann::json &json, std::shared_ptr<Utils::Ti
             json["status"]["code"] = "SUCCESS";
             json["status"]["message"] = "";
         }
+        else if(type == "getMetrics")
+        {
+            json["data"] = Metrics::registry().toJson();
+            json["status"]["code"] = "SUCCESS";
+            json["status"]["message"] = "";
+        }
         else
         {
             json["status"]["code"] = "INVALID_TYPE";
@@ -559,6 +681,72 @@ void KernelServer::openSession(int64_t windowId, const std::string &repoName, co
     logger.info("[KernelServer] Open session, sessionId " + std::to_string(sessionId) + ", windowId: " + std::to_string(windowId));
 }
 
+void KernelServer::startJiebaPreload()
+{
+    Executor::instance().post(Executor::Priority::background, []()
+    {
+        try
+        {
+            // parsing the text dictionaries is the most expensive part of the first fts5 operation,
+            // get_jieba_ptr() is guarded by jiebaMutex, so sessions will only wait for the remaining part
+            jiebaTokenizer::get_jieba_ptr();
+            logger.info("[KernelServer.jiebaPreload] jieba dictionary loaded.");
+        }
+        catch(const std::exception& e)
+        {
+            // not fatal, jieba will be loaded again on first use
+            logger.warning("[KernelServer.jiebaPreload] Failed to preload jieba dictionary: " + std::string(e.what()));
+        }
+    });
+}
+
+void KernelServer::startMetricsDump()
+{
+    metricsDumpThread = std::make_shared<Utils::WorkerThread>("metricsDump", [this](std::function<bool()> stopFlag, Utils::WorkerThread& parent)
+    {
+        std::mutex waitMutex;
+        while(!stopFlag())
+        {
+            {
+                std::unique_lock<std::mutex> lock(waitMutex);
+                parent.getNoticeCv().wait_for(lock, metricsDumpInterval, [&parent]() { return parent.hasNotice(); });
+            }
+            try
+            {
+                dumpMetrics();
+            }
+            catch(const std::exception& e)
+            {
+                // not fatal, metrics are still available by getMetrics message, try again next time
+                logger.warning("[KernelServer.metricsDump] Failed to dump metrics: " + std::string(e.what()));
+            }
+        }
+    },[](const std::exception& e)
+    {
+        logger.warning("[KernelServer.metricsDump] Metrics dump thread crashed: " + std::string(e.what()));
+    });
+    metricsDumpThread->start();
+}
+
+void KernelServer::dumpMetrics() const
+{
+    std::filesystem::create_directories(metricsPath.parent_path());
+    auto tmpPath = metricsPath;
+    tmpPath += ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::trunc);
+        if(!file.is_open())
+        {
+            throw Error{"Failed to open metrics file: " + tmpPath.string(), Error::Type::FileAccess};
+        }
+        nlohmann::json json = Metrics::registry().toJson();
+        json["time"] = Utils::getTimeStr();
+        file << json.dump(4);
+    }
+    // replace the old file at once, so readers never see a half-written file
+    std::filesystem::rename(tmpPath, metricsPath);
+}
+
 void KernelServer::startMessageSender()
 {
     // messageSenderThread = std::thread(&KernelServer::messageSender, this);
@@ -582,90 +770,135 @@ void KernelServer::startMessageSender()
 void KernelServer::messageSender(std::function<bool()> stopFlag)
 {
     logger.info("[KernelServer.messageSender] thread started.");
-    std::shared_ptr<Utils::MessageQueue::Message> message = nullptr;
+    std::string buffer{}; // serialized messages waiting to be written
+    std::vector<std::pair<std::shared_ptr<Utils::Timer>, std::string>> timers{}; // timer, message type
+    static auto &queueDepth = Metrics::gauge("ipc.sendQueue.depth");
+    static auto &sentCount = Metrics::counter("ipc.messagesSent");
+    static auto &writeLatency = Metrics::histogram("ipc.write");
     while(true)
     {
         auto parent = Utils::WorkerThread::getCurrentThread();
-        message = kernelMessageQueue->popWithCv(&parent->getNoticeCv(), [&stopFlag, &parent]() {
+        auto message = kernelMessageQueue->popWithCv(&parent->getNoticeCv(), [&stopFlag, &parent]() {
             return parent->hasNotice();
         });
         if(stopFlag())
         {
             break;
         }
-        if(!message || message->data.empty())
+        queueDepth.set(static_cast<int64_t>(kernelMessageQueue->size()) + (message ? 1 : 0));
+        // take all pending messages, and write them with one flush
+        while(message)
         {
-            continue;
-        }
-        {
-            std::lock_guard<std::mutex> lock(sessionMutex);
-            auto it = sessionIdToWindowId.find(message->sessionId);
-            if(it != sessionIdToWindowId.end())
+            if (message->timer)
             {
-                message->data["sessionId"] = it->second;
+                // operator[] would insert null into a message without "message" object, and value() throws on it
+                const auto &data = message->data;
+                auto type = data.contains("message") && data["message"].is_object() ? data["message"].value("type", "") : "";
+                timers.emplace_back(message->timer, type);
             }
-            else if(message->data.contains("sessionId"))
+            appendMessage(message, buffer);
+            sentCount.add();
+            if (buffer.size() >= maxBatchSize || kernelMessageQueue->empty())
             {
-                // if sessionId is not found, it means the message is from kernel server
-                // and should be sent to window
-                // no need to change sessionId
+                break;
             }
-            else
+            message = kernelMessageQueue->pop(); // only this thread pops, will not block
+        }
+        if(!buffer.empty())
+        {
+            Metrics::ScopedTimer writeTimer(writeLatency);
+            std::cout.write(buffer.data(), buffer.size());
+            std::cout.flush();
+            writeTimer.stop();
+            buffer.clear();
+            if (buffer.capacity() > maxBatchSize)
             {
-                message->data["sessionId"] = -1; // message from kernel server
+                buffer.shrink_to_fit(); // do not hold memory of a huge message
             }
         }
-        // try to serialize message to string
-        std::string messageStr{};
-        bool serializeSuccess = false;
+        for(auto &[timer, type] : timers)
+        {
+            // whole round trip of a request in kernel, from receiving to sending reply
+            auto duration = timer->stop();
+            Metrics::histogram("ipc.request." + type).record(static_cast<int64_t>(duration * 1000));
+        }
+        timers.clear();
+    }
+    logger.info("[KernelServer.messageSender] thread stopped.");
+}
+
+void KernelServer::appendMessage(const std::shared_ptr<Utils::MessageQueue::Message> &message, std::string &buffer)
+{
+    if(!message || message->data.empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sessionMutex);
+        auto it = sessionIdToWindowId.find(message->sessionId);
+        if(it != sessionIdToWindowId.end())
+        {
+            message->data["sessionId"] = it->second;
+        }
+        else if(message->data.contains("sessionId"))
+        {
+            // if sessionId is not found, it means the message is from kernel server
+            // and should be sent to window
+            // no need to change sessionId
+        }
+        else
+        {
+            message->data["sessionId"] = -1; // message from kernel server
+        }
+    }
+    // try to serialize message
+    auto originalSize = buffer.size();
+    try
+    {
+        encodeMessage(message->data, buffer);
+        if (getIpcFormat() == IpcFormat::json)
+        {
+            logger.debug([&]() { return "[KernelServer.messageSender] Send message: " + buffer.substr(originalSize, buffer.size() - originalSize - 1); });
+        }
+        else
+        {
+            logger.debug("[KernelServer.messageSender] Send message, size: " + std::to_string(buffer.size() - originalSize));
+        }
+    }
+    catch (const nlohmann::json::exception &e)
+    {
+        buffer.resize(originalSize); // drop partly serialized message
+        // failed, try to get message type
+        std::string messageType{};
         try
         {
-            messageStr = message->data.dump();
-            serializeSuccess = true;
+            messageType = message->data["message"]["type"].get<std::string>();
         }
-        catch (const nlohmann::json::exception &e)
+        catch (...)
         {
-            // failed, try to get message type
-            std::string messageType{};
-            try
-            {
-                messageType = message->data["message"]["type"].get<std::string>();
-            }
-            catch (...)
-            {
-                messageType = "unknown";
-            }
-            logger.warning("[KernelServer.messageSender] Failed to serialize message, message type: " + messageType + ", error: " + std::string(e.what()));
-
-            // try to send error message back
-            try
-            {
-                nlohmann::json errorJson;
-                errorJson["sessionId"] = message->data["sessionId"];
-                errorJson["toMain"] = message->data["toMain"];
-                errorJson["isReply"] = message->data["isReply"];
-                errorJson["callbackId"] = message->data["callbackId"];
-                errorJson["message"]["type"] = messageType;
-                errorJson["status"]["code"] = "UNKNOW_ERROR";
-                errorJson["status"]["message"] = "Failed to serialize message: " + std::string(e.what());
-                std::cout << errorJson.dump() << std::endl << std::flush;
-            }
-            catch (const nlohmann::json::exception &e)
-            {
-                logger.warning("[KernelServer.messageSender] Failed to send error message, parser error: " + std::string(e.what()));
-            }
+            messageType = "unknown";
         }
-        if (serializeSuccess && !messageStr.empty())
+        logger.warning("[KernelServer.messageSender] Failed to serialize message, message type: " + messageType + ", error: " + std::string(e.what()));
+
+        // try to send error message back
+        try
         {
-            std::cout << messageStr << std::endl << std::flush;
-            logger.debug("[KernelServer.messageSender] Send message: " + messageStr);
+            nlohmann::json errorJson;
+            errorJson["sessionId"] = message->data["sessionId"];
+            errorJson["toMain"] = message->data["toMain"];
+            errorJson["isReply"] = message->data["isReply"];
+            errorJson["callbackId"] = message->data["callbackId"];
+            errorJson["message"]["type"] = messageType;
+            errorJson["status"]["code"] = "UNKNOW_ERROR";
+            errorJson["status"]["message"] = "Failed to serialize message: " + std::string(e.what());
+            encodeMessage(errorJson, buffer);
         }
-        if (message->timer)
+        catch (const nlohmann::json::exception &e)
         {
-            message->timer->stop();
+            buffer.resize(originalSize);
+            logger.warning("[KernelServer.messageSender] Failed to send error message, parser error: " + std::string(e.what()));
         }
     }
-    logger.info("[KernelServer.messageSender] thread stopped.");
 }
 
 void KernelServer::startMessageReceiver()
@@ -695,7 +928,15 @@ void KernelServer::messageReceiver(std::function<bool()> stopFlag)
     std::string input = "";
     while (true)
     {
-        std::getline(std::cin, input);
+        if (!readMessage(input))
+        {
+            // stdin is closed or a frame is truncated, nothing more can be read, shut down as stopAll does
+            logger.warning("[KernelServer.messageReceiver] stdin closed or message truncated, stopping kernel.");
+            stopAllFlag = true;
+            Utils::WorkerThread::getCurrentThread()->stop();
+            mainThreadCondition.notify_all();
+            break;
+        }
         if(stopFlag())
         {
             break;
@@ -704,7 +945,14 @@ void KernelServer::messageReceiver(std::function<bool()> stopFlag)
         {
             continue;
         }
-        logger.debug("[KernelServer.messageReceiver] Received message: " + input);
+        if (getIpcFormat() == IpcFormat::json)
+        {
+            logger.debug([&]() { return "[KernelServer.messageReceiver] Received message: " + input; });
+        }
+        else
+        {
+            logger.debug("[KernelServer.messageReceiver] Received message, size: " + std::to_string(input.size()));
+        }
         nlohmann::json inputJson;
         int64_t windowId;
         bool toMain;
@@ -712,7 +960,7 @@ void KernelServer::messageReceiver(std::function<bool()> stopFlag)
         bool isReply;
         try
         {
-            inputJson = nlohmann::json::parse(input);
+            inputJson = decodeMessage(input);
             windowId = inputJson["sessionId"].get<int64_t>();
             toMain = inputJson["toMain"].get<bool>();
             messageType = inputJson["message"]["type"].get<std::string>();
@@ -764,6 +1012,11 @@ void KernelServer::messageReceiver(std::function<bool()> stopFlag)
 void KernelServer::updateSettings()
 {
     settings->saveSettings();
+    // workers and ONNX threads are created once, they are sized by the settings of the first call
+    if (!Executor::configure(settings->getPerfConfig().first))
+    {
+        logger.info("[KernelServer] Max threads changed, it will take effect after restart.");
+    }
     // update sqlite
     auto trans = sqliteConnection->beginTransaction();
     std::vector<std::string> deletedGModels;
@@ -940,6 +1193,11 @@ int KernelServer::getHistoryLength() const
     return settings->getHistoryLength();
 }
 
+int KernelServer::getContextTokens() const
+{
+    return settings->getContextTokens();
+}
+
 std::pair<int, ONNXModel::device> KernelServer::getPerfConfig() const
 {
     return settings->getPerfConfig();
@@ -987,6 +1245,8 @@ auto KernelServer::Settings::readSettings(std::filesystem::path path) const -> S
             localModel.path = model["path"].get<std::string>();
             localModel.type = model["type"].get<std::string>();
             localModel.fileSize = model["fileSize"].get<int>();
+            if (model.contains("quantized")) // optional, default to false
+                localModel.quantized = model["quantized"].get<bool>();
             tempCache.localModelManagement.models.push_back(localModel);
         }
         // parse conversationSettings
@@ -1000,6 +1260,8 @@ auto KernelServer::Settings::readSettings(std::filesystem::path path) const -> S
             tempCache.conversationSettings.generationModel.push_back(generationModel);
         }
         tempCache.conversationSettings.historyLength = settingsJson["conversationSettings"]["historyLength"].get<int>();
+        if (settingsJson["conversationSettings"].contains("contextTokens")) // optional, default to 4000
+            tempCache.conversationSettings.contextTokens = settingsJson["conversationSettings"]["contextTokens"].get<int>();
         // parse performance settings
         SettingsCache::PerformanceSettings perfsettings;
         perfsettings.maxThreads = settingsJson["performance"]["maxThreads"].get<int>();
@@ -1025,6 +1287,18 @@ auto KernelServer::Settings::readSettings(std::filesystem::path path) const -> S
         {
             throw Error{"Model path does not exist: " + model.path, Error::Type::Input};
         }
+        if(model.quantized)
+        {
+            if(model.type != "embedding" && model.type != "rerank")
+            {
+                throw Error{"Only embedding and rerank models can be quantized: " + model.name, Error::Type::Input};
+            }
+            auto quantizedPath = std::filesystem::path(model.path) / ONNXModel::quantizedModelFileName;
+            if(!std::filesystem::exists(quantizedPath))
+            {
+                throw Error{"Quantized model does not exist: " + quantizedPath.string() + ", please generate it by scripts/quantizeModel.py", Error::Type::Input};
+            }
+        }
         modelNames.insert(model.name);
     }
 
@@ -1076,6 +1350,10 @@ auto KernelServer::Settings::readSettings(std::filesystem::path path) const -> S
     {
         throw Error{"Invalid history length: " + std::to_string(tempCache.conversationSettings.historyLength), Error::Type::Input};
     }
+    if(tempCache.conversationSettings.contextTokens <= 0)
+    {
+        throw Error{"Invalid context tokens: " + std::to_string(tempCache.conversationSettings.contextTokens), Error::Type::Input};
+    }
 
     // check performanceSettings
     int systemThreads = std::thread::hardware_concurrency();
@@ -1143,6 +1421,9 @@ std::string KernelServer::Settings::getModelPath(const std::string &modelName) c
     {
         if (model.name == modelName)
         {
+            // a different file means a different embedding config, vectors will be regenerated when switching
+            if (model.quantized)
+                return (std::filesystem::path(model.path) / ONNXModel::quantizedModelFileName).string();
             return model.path;
         }
     }
@@ -1163,3 +1444,8 @@ int KernelServer::Settings::getHistoryLength() const
 {
     return settingsCache.conversationSettings.historyLength;
 }
+
+int KernelServer::Settings::getContextTokens() const
+{
+    return settingsCache.conversationSettings.contextTokens;
+}
@@ -2,8 +2,9 @@
 
 #include <string>
 #include <vector>
-#include <thread>
 #include <chrono>
+#include <cmath>
+#include <future>
 
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
@@ -48,194 +49,272 @@ std::string HttpClient::httpResult::getErrorMessage(int http_code) // generate e
     return "Unknown Error";
 }
 
-size_t HttpClient::nonStresamCallBack(void *ptr, size_t size, size_t nmemb, void *in_buffer)
+struct HttpClient::Call
 {
-    auto buffer = static_cast<std::string *>(in_buffer);
-    size_t realsize = size * nmemb;
-    buffer->append((char *)ptr, realsize);
-    return realsize;
-}
+    HttpTransport::Request request; // template of attempts
+    int max_retry = 0;
+    int retried = 0;
+    std::shared_ptr<std::atomic<bool>> stop;
 
-struct HttpClient::CallbackWrapper
-{
-    std::function<size_t(void *, size_t, size_t, void *)> func;
-    HttpClient* client;
-    void *originalBuffer;
+    bool isStream = false;
+    std::string response; // full http body, or complete response parsed by parser for stream requests
+    streamCallbackFunc callback;
+    streamData stream{&response};
+    std::string parserError; // set if parser or callback throws, the request is aborted
 
-    // static callback function, can be called by function ptr
-    static size_t curlBridgeCallback(void *ptr, size_t size, size_t nmemb, void *userdata)
-    {
-        auto wrapper = static_cast<CallbackWrapper *>(userdata);
-        auto returnSize =  wrapper->func(ptr, size, nmemb, wrapper->originalBuffer); // call the original callback function
-        if(wrapper->client->stop)
-            return 0;
-        return returnSize;
-    }
+    doneCallbackFunc onDone;
 };
 
-HttpClient::httpResult HttpClient::curlRequest(std::function<size_t(void *, size_t, size_t, void *)> callback, void *buffer, const std::string &request)
+void HttpClient::sendAttempt(const std::shared_ptr<Call> &call)
 {
-    // set request body
-    curl_easy_setopt(curl, CURLOPT_POST, 1L); // set http method to POST
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.c_str());
-
-    // set waitting time
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, connect_timeout); // connect timeout 10 seconds
-
-    // set callback
-    std::shared_ptr<HttpClient::CallbackWrapper> wrapper = std::make_shared<CallbackWrapper>(CallbackWrapper{callback, this, buffer});
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &CallbackWrapper::curlBridgeCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, wrapper.get());
-
-    int retried = 0;
-    long http_code = 0;
-    while(retried <= max_retry)
-    {
-        // send request
-        CURLcode res = curl_easy_perform(curl);
-        if (res == CURLE_WRITE_ERROR) // interupt by user
+    auto request = call->request;
+    if (call->retried > 0)
+        request.delay = std::chrono::milliseconds(std::min(2000, (int)std::pow(2, call->retried) * 250)); // wait for a while before retrying
+    // the call is kept alive by the callbacks until the attempt is done
+    request.onData = [call](std::string_view data) -> bool {
+        if (!call->isStream)
         {
-            return {200, "User interrupt", retried, ""}; // return the error message
+            call->response.append(data);
+            return true;
         }
-        if (res != CURLE_OK)
-            return{0, "CURL error: " + std::string(curl_easy_strerror(res)), retried, ""}; // return the error message
-        
-        // handle http status code
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        if (http_code == 200)
-            break; // success, break the loop
-        if(!httpResult::needRetry(http_code))
-            break;
-        retried++;
-        if(retried <= max_retry)
+        try
         {
-            int wait_time = std::min(2000, (int)std::pow(2, retried) * 250);
-            std::this_thread::sleep_for(std::chrono::milliseconds(wait_time)); // wait for a while before retrying
+            processSSE(&call->stream, data); // extract complete events
+            return true;
         }
-    }
-    return {static_cast<int>(http_code), httpResult::getErrorMessage(http_code), retried, ""}; // return the http code and error message
+        catch (const std::exception &e)
+        {
+            call->parserError = e.what();
+            return false;
+        }
+    };
+    request.stopFlag = [stop = call->stop]() { return stop->load(); };
+    request.onDone = [call](CURLcode code, long http_code) { finishAttempt(call, code, http_code); };
+    HttpTransport::instance().send(std::move(request));
 }
 
-size_t HttpClient::streamData::streamCallback(void *ptr, size_t size, size_t nmemb, void *streamdata)
+void HttpClient::finishAttempt(const std::shared_ptr<Call> &call, CURLcode code, long http_code)
 {
-    size_t realsize = size * nmemb;
-
-    auto data = static_cast<HttpClient::streamData *>(streamdata);
-    std::string *buffer = data->buffer;                       // for incomplete events
-
-    // append new data to buffer
-    buffer->append(static_cast<char *>(ptr), realsize);
-
-    processSSE(data); // process the buffer to extract events
+    httpResult result{static_cast<int>(http_code), "", call->retried, ""};
+    if (!call->parserError.empty())
+    {
+        result.http_code = 599; // set http code to 599
+        result.error_message = "parser error: " + call->parserError;
+    }
+    else if (call->stop->load() && (code == CURLE_WRITE_ERROR || code == CURLE_ABORTED_BY_CALLBACK)) // interupt by user
+    {
+        result.http_code = 200;
+        result.error_message = "User interrupt";
+    }
+    else if (code != CURLE_OK)
+    {
+        result.http_code = 0;
+        result.error_message = "CURL error: " + std::string(curl_easy_strerror(code));
+    }
+    else if (http_code != 200 && httpResult::needRetry(http_code) && call->retried < call->max_retry)
+    {
+        call->retried++;
+        call->stream.buffer.clear();
+        call->stream.offset = 0;
+        call->stream.scanned = 0;
+        call->response.clear(); // body of the failed attempt
+        sendAttempt(call);
+        return;
+    }
+    else
+    {
+        result.error_message = httpResult::getErrorMessage(http_code);
+    }
 
-    return realsize;
+    result.response = std::move(call->response); // set response to result
+    logger.debug([&]() {
+        return std::string("[HttpClient] Received response\n") + "http_code: " + std::to_string(result.http_code) +
+               "\nerror message: " + result.error_message + "\nretried: " + std::to_string(result.retry_count) +
+               "\nresponse: " + result.response;
+    });
+    call->onDone(std::move(result));
 }
 
-void HttpClient::processSSE(streamData* streamdata)
+void HttpClient::processSSE(streamData *streamdata, std::string_view piece)
 {
-    std::string *buffer = streamdata->buffer;                       // for incomplete events
-    std::string *complete_response = streamdata->complete_response; // for complete response
-    streamResponseParser parser = streamdata->parser;               // for parsing stream response
-    LLMConv::streamCallbackFunc *callback = streamdata->callback;   // callback function
-
-    // parse buffer, buffer may have several complete events and incomplete events
-    size_t pos = 0;
-    size_t event_start = 0;
-    while ((pos = buffer->find("\n\n", event_start)) != std::string::npos)
+    // parse the piece in place if no incomplete event is kept, the usual case as servers flush whole events
+    std::string_view input;
+    size_t scanFrom = 0;
+    bool inPlace = streamdata->offset == streamdata->buffer.size();
+    if (inPlace)
     {
-        // extract the event from buffer
-        std::string event = buffer->substr(event_start, pos - event_start + 2);
-        event_start = pos + 2;
+        streamdata->buffer.clear();
+        streamdata->offset = 0;
+        input = piece;
+    }
+    else
+    {
+        streamdata->buffer.append(piece);
+        input = std::string_view(streamdata->buffer).substr(streamdata->offset);
+        scanFrom = streamdata->scanned; // lines of the kept tail are not scanned again
+    }
 
-        // find the start of the event
-        if (event.find("data: ") == 0)
+    // an event ends with an empty line, lines end with "\n" or "\r\n"
+    size_t eventStart = 0;
+    size_t lineStart = scanFrom;
+    size_t lineEnd;
+    while ((lineEnd = input.find('\n', lineStart)) != std::string_view::npos)
+    {
+        auto line = input.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+        if (line.empty() || line == "\r")
         {
-            std::string data_str = event.substr(6); // skip "data: " prefix
-            if (data_str.length() >= 2)
-                data_str = data_str.substr(0, data_str.length() - 2); // remove "\n\n" at the end
-
-            if (data_str == "[DONE]") // check for end signal
-                continue;
+            processEvent(streamdata, input.substr(eventStart, lineStart - eventStart));
+            eventStart = lineStart;
+        }
+    }
 
-            // parse json
-            std::string content;
-            parser(data_str, content);// parse the json string
-            complete_response->append(content); // append the content to complete response
+    // keep the incomplete event
+    streamdata->scanned = lineStart - eventStart;
+    if (inPlace)
+    {
+        streamdata->buffer.assign(input.substr(eventStart));
+        return;
+    }
+    streamdata->offset += eventStart;
+    if (streamdata->offset == streamdata->buffer.size())
+    {
+        streamdata->buffer.clear();
+        streamdata->offset = 0;
+    }
+    else if (streamdata->offset >= streamData::minCompactSize && streamdata->offset * 2 >= streamdata->buffer.size())
+    {
+        streamdata->buffer.erase(0, streamdata->offset); // moves less than the consumed part, so amortized linear
+        streamdata->offset = 0;
+    }
+}
 
-            // callback
-            if (callback && !content.empty())
-                (*callback)(content); // call the callback function
+void HttpClient::processEvent(streamData *streamdata, std::string_view event)
+{
+    // join data lines, other fields (event, id, retry) and comments are ignored
+    std::string_view data;
+    bool hasData = false;
+    bool joined = false; // data is copied to streamdata->data only if the event has several data lines
+    size_t lineStart = 0;
+    size_t lineEnd;
+    while ((lineEnd = event.find('\n', lineStart)) != std::string_view::npos)
+    {
+        auto line = event.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (!line.starts_with("data:"))
+            continue;
+        auto value = line.substr(5);
+        if (value.starts_with(' '))
+            value.remove_prefix(1);
+        if (!hasData)
+        {
+            data = value;
+            hasData = true;
+            continue;
         }
+        if (!joined)
+        {
+            streamdata->data.assign(data);
+            joined = true;
+        }
+        streamdata->data += '\n';
+        streamdata->data.append(value);
     }
-
-    // keep the remaining data in buffer
-    if (event_start < buffer->length())
-        *buffer = buffer->substr(event_start);
-    else
-        buffer->clear();
+    if (!hasData)
+        return;
+    if (joined)
+        data = streamdata->data;
+
+    if (data == "[DONE]") // check for end signal
+        return;
+
+    // parse json
+    auto &content = streamdata->content;
+    content.clear();
+    streamdata->parser(data, content); // parse the json string
+    streamdata->complete_response->append(content); // append the content to complete response
+
+    // callback
+    if (streamdata->callback && !content.empty())
+        (*streamdata->callback)(content); // call the callback function
 }
 
-HttpClient::HttpClient(const std::string &api_key, const std::string &api_url)
+HttpClient::HttpClient(const std::string &api_key, const std::string &api_url) : api_url(api_url)
 {
-    // init curl handle
-    curl = curl_easy_init();
-    if(!curl)
-        throw std::runtime_error("Cannot initialize CURL");
-    // init http header
-    headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    // init http header once, requests of this client share it
+    curl_slist *list = nullptr;
+    list = curl_slist_append(list, "Content-Type: application/json");
     std::string auth_header = "Authorization: Bearer " + api_key;
-    headers = curl_slist_append(headers, auth_header.c_str());
-    // set url and header to curl
-    curl_easy_setopt(curl, CURLOPT_URL, api_url.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, verbose); 
+    list = curl_slist_append(list, auth_header.c_str());
+    if(!list)
+        throw std::runtime_error("Cannot initialize CURL headers");
+    headers.reset(list, curl_slist_free_all);
 }
 
 HttpClient::~HttpClient()
 {
-    if(headers) curl_slist_free_all(headers);
-    if(curl) curl_easy_cleanup(curl);
+    *stop = true; // requests in flight keep their own state, abort them as nobody waits for them
 }
 
-HttpClient::httpResult HttpClient::sendRequest(const std::string &request_body)
+void HttpClient::stopConnection()
 {
-    stop = false;
-    std::string response_buffer; // buffer for response
-    logger.debug("[HttpClient] Sending request: " + request_body);
-    auto result = curlRequest(nonStresamCallBack, &response_buffer, request_body); // send request and handle error in uniform way
-    result.response = response_buffer; // set response to result
-    logger.debug(std::string("[HttpClient] Received response\n") + "http_code: " + std::to_string(result.http_code) +
-                 "\nerror message: " + result.error_message + "\nretried: " + std::to_string(result.retry_count) +
-                 "\nresponse: " + result.response);
-    return result;
+    *stop = true;
+    HttpTransport::instance().wakeUp();
 }
 
-HttpClient::httpResult HttpClient::sendStreamRequest(const std::string &request_body, streamResponseParser parser, std::function<void(const std::string &)> callback)
+void HttpClient::sendRequestAsync(const std::string &request_body, doneCallbackFunc onDone)
 {
-    stop = false;
-    std::string buffer;            // buffer for incomplete events
-    std::string complete_response; // buffer for complete response
-    auto callback_func = callback ? &callback : nullptr; // callback function
-    auto streamdata = streamData(&buffer, &complete_response, parser, callback_func);
-    logger.debug("[HttpClient] Sending request: " + request_body);
+    *stop = false;
+    logger.debug([&]() { return "[HttpClient] Sending request: " + request_body; });
+    auto call = std::make_shared<Call>();
+    call->request.url = api_url;
+    call->request.headers = headers;
+    call->request.body = request_body;
+    call->request.connectTimeout = connect_timeout;
+    call->request.verbose = verbose;
+    call->max_retry = max_retry;
+    call->stop = stop;
+    call->onDone = std::move(onDone);
+    sendAttempt(call);
+}
 
-    httpResult result;
-    try
-    {
-        result = curlRequest(streamData::streamCallback, &streamdata, request_body); // send request and handle error in uniform way
-    }
-    catch (const std::exception &e)
-    {
-        result.http_code = 599; // set http code to 599
-        result.error_message = "parser error: " + std::string(e.what());
-    }
+void HttpClient::sendStreamRequestAsync(const std::string &request_body, streamResponseParser parser, streamCallbackFunc callback, doneCallbackFunc onDone)
+{
+    *stop = false;
+    logger.debug([&]() { return "[HttpClient] Sending request: " + request_body; });
+    auto call = std::make_shared<Call>();
+    call->request.url = api_url;
+    call->request.headers = headers;
+    call->request.body = request_body;
+    call->request.connectTimeout = connect_timeout;
+    call->request.verbose = verbose;
+    call->max_retry = max_retry;
+    call->stop = stop;
+    call->isStream = true;
+    call->callback = std::move(callback);
+    call->stream.parser = std::move(parser);
+    call->stream.callback = call->callback ? &call->callback : nullptr;
+    call->onDone = std::move(onDone);
+    sendAttempt(call);
+}
 
-    result.response = complete_response; // set response to result
-    logger.debug(std::string("[HttpClient] Received response\n") + "http_code: " + std::to_string(result.http_code) +
-                 "\nerror message: " + result.error_message + "\nretried: " + std::to_string(result.retry_count) +
-                 "\nresponse: " + result.response);
-    return result;
+HttpClient::httpResult HttpClient::sendRequest(const std::string &request_body)
+{
+    // the promise is shared with the I/O thread, it may still be in set_value() when get() returns
+    auto promise = std::make_shared<std::promise<httpResult>>();
+    auto future = promise->get_future();
+    sendRequestAsync(request_body, [promise](httpResult result) { promise->set_value(std::move(result)); });
+    return future.get();
+}
+
+HttpClient::httpResult HttpClient::sendStreamRequest(const std::string &request_body, streamResponseParser parser, std::function<void(const std::string &)> callback)
+{
+    auto promise = std::make_shared<std::promise<httpResult>>();
+    auto future = promise->get_future();
+    sendStreamRequestAsync(request_body, parser, callback, [promise](httpResult result) { promise->set_value(std::move(result)); });
+    return future.get();
 }
 
 //---------------------------LLMConv---------------------------//
@@ -318,27 +397,110 @@ int LLMConv::getIntConfig(const Config &config, const std::string &key, int defa
 }
 
 //--------------------------OpenAIConv-------------------------//
-bool OpenAIConv::parseStreamChunk(const std::string &chunk, std::string &content)
+namespace
 {
-    try
+    /*
+    SAX handler to get choices[0].delta.content of a stream chunk without building a DOM,
+    parsing stops as soon as the content is found, which is usually before the rest of the event.
+    */
+    class DeltaContentHandler : public nlohmann::json_sax<nlohmann::json>
     {
-        nlohmann::json json = nlohmann::json::parse(chunk);
-
-        if (json.contains("choices") &&
-            json["choices"].size() > 0 &&
-            json["choices"][0].contains("delta") &&
-            json["choices"][0]["delta"].contains("content"))
+    private:
+        struct Frame
         {
+            bool isArray;
+            int index = -1;      // index of the current element, for arrays
+            bool onPath = false; // the current key or element is on the path to the content
+        };
+        std::vector<Frame> stack;
+        std::string &content;
+
+        // path: {"choices": [{"delta": {"content": ...}}]}
+        bool atContent() const
+        {
+            return stack.size() == 4 && stack[0].onPath && stack[1].onPath && stack[2].onPath && stack[3].onPath;
+        }
+        void beginValue()
+        {
+            if (!stack.empty() && stack.back().isArray)
+            {
+                auto &frame = stack.back();
+                frame.index++;
+                frame.onPath = stack.size() == 2 && frame.index == 0;
+            }
+        }
+        bool scalar()
+        {
+            beginValue();
+            return !atContent(); // content of other type, stop and treat as no content
+        }
+
+    public:
+        bool found = false;
+        std::string error;
+
+        explicit DeltaContentHandler(std::string &content) : content(content) {}
 
-            content = json["choices"][0]["delta"]["content"];
+        bool null() override { return scalar(); }
+        bool boolean(bool) override { return scalar(); }
+        bool number_integer(number_integer_t) override { return scalar(); }
+        bool number_unsigned(number_unsigned_t) override { return scalar(); }
+        bool number_float(number_float_t, const string_t &) override { return scalar(); }
+        bool binary(binary_t &) override { return scalar(); }
+        bool string(string_t &val) override
+        {
+            beginValue();
+            if (!atContent())
+                return true;
+            content = std::move(val);
+            found = true;
+            return false;
+        }
+        bool start_object(std::size_t) override
+        {
+            beginValue();
+            stack.push_back({false});
             return true;
         }
-        return false; // no content found in the chunk
-    }
-    catch (const std::exception &e)
+        bool key(string_t &val) override
+        {
+            auto depth = stack.size();
+            stack.back().onPath = (depth == 1 && val == "choices") || (depth == 3 && val == "delta") || (depth == 4 && val == "content");
+            return true;
+        }
+        bool end_object() override
+        {
+            stack.pop_back();
+            return true;
+        }
+        bool start_array(std::size_t) override
+        {
+            beginValue();
+            stack.push_back({true});
+            return true;
+        }
+        bool end_array() override
+        {
+            stack.pop_back();
+            return true;
+        }
+        bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &e) override
+        {
+            error = e.what();
+            return false;
+        }
+    };
+}
+
+bool OpenAIConv::parseStreamChunk(std::string_view chunk, std::string &content)
+{
+    DeltaContentHandler handler(content);
+    nlohmann::json::sax_parse(chunk.begin(), chunk.end(), &handler);
+    if (!handler.error.empty())
     {
-        throw Error{"Json parse error, received: " + chunk + "\n    Nested error: " + std::string(e.what())};
+        throw Error{"Json parse error, received: " + std::string(chunk) + "\n    Nested error: " + handler.error};
     }
+    return handler.found; // false if no content found in the chunk, or content is null
 }
 
 std::string OpenAIConv::parseFullResponse(const std::string &response, bool setDeltaUsage)
@@ -505,7 +667,7 @@ std::string OpenAIConv::getStreamResponse(streamCallbackFunc callBack)
 
     // send request
     auto result = httpClient->sendStreamRequest(request.dump(), 
-        [this](const std::string& chunk, std::string& content){
+        [](std::string_view chunk, std::string& content){
             return parseStreamChunk(chunk, content);
         }, callBack); // send request and handle error in uniform way
     std::string response = handleHttpResult(result); // handle http result and return the response
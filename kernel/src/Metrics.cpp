@@ -0,0 +1,140 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+//--------------------------Histogram--------------------------//
+int Metrics::Histogram::bucketIndex(int64_t value)
+{
+    if (value < subBucketCount)
+        return static_cast<int>(std::max<int64_t>(value, 0));
+    int exponent = std::bit_width(static_cast<uint64_t>(value)) - 1;
+    if (exponent > maxExponent)
+        return bucketCount - 1;
+    int subBucket = static_cast<int>((value >> (exponent - subBucketBits)) & (subBucketCount - 1));
+    return (exponent - subBucketBits + 1) * subBucketCount + subBucket;
+}
+
+int64_t Metrics::Histogram::bucketValue(int index)
+{
+    if (index < subBucketCount)
+        return index;
+    int exponent = index / subBucketCount + subBucketBits - 1;
+    int subBucket = index % subBucketCount;
+    int64_t width = int64_t{1} << (exponent - subBucketBits);
+    int64_t lower = static_cast<int64_t>(subBucketCount + subBucket) << (exponent - subBucketBits);
+    return lower + width / 2;
+}
+
+void Metrics::Histogram::record(int64_t microseconds)
+{
+    microseconds = std::max<int64_t>(microseconds, 0);
+    buckets[bucketIndex(microseconds)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(microseconds, std::memory_order_relaxed);
+    auto currentMax = max.load(std::memory_order_relaxed);
+    while (microseconds > currentMax && !max.compare_exchange_weak(currentMax, microseconds, std::memory_order_relaxed))
+    {
+    }
+}
+
+int64_t Metrics::Histogram::percentile(double p) const
+{
+    auto total = count.load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    auto rank = static_cast<int64_t>(std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * total));
+    rank = std::max<int64_t>(rank, 1);
+    int64_t seen = 0;
+    for (int i = 0; i < bucketCount; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(bucketValue(i), max.load(std::memory_order_relaxed));
+    }
+    return max.load(std::memory_order_relaxed);
+}
+
+nlohmann::json Metrics::Histogram::toJson() const
+{
+    auto toMs = [](int64_t us) { return us / 1000.0; };
+    auto total = count.load(std::memory_order_relaxed);
+    nlohmann::json json;
+    json["count"] = total;
+    json["meanMs"] = total == 0 ? 0.0 : toMs(sum.load(std::memory_order_relaxed)) / total;
+    json["maxMs"] = toMs(max.load(std::memory_order_relaxed));
+    json["p50Ms"] = toMs(percentile(50));
+    json["p90Ms"] = toMs(percentile(90));
+    json["p95Ms"] = toMs(percentile(95));
+    json["p99Ms"] = toMs(percentile(99));
+    return json;
+}
+
+void Metrics::Histogram::reset()
+{
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+//--------------------------Registry--------------------------//
+Metrics::Counter &Metrics::Registry::counter(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &ptr = counters[name];
+    if (!ptr)
+        ptr = std::make_unique<Counter>();
+    return *ptr;
+}
+
+Metrics::Gauge &Metrics::Registry::gauge(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &ptr = gauges[name];
+    if (!ptr)
+        ptr = std::make_unique<Gauge>();
+    return *ptr;
+}
+
+Metrics::Histogram &Metrics::Registry::histogram(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &ptr = histograms[name];
+    if (!ptr)
+        ptr = std::make_unique<Histogram>();
+    return *ptr;
+}
+
+nlohmann::json Metrics::Registry::toJson() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    nlohmann::json json;
+    json["counters"] = nlohmann::json::object();
+    json["gauges"] = nlohmann::json::object();
+    json["histograms"] = nlohmann::json::object();
+    for (const auto &[name, counter] : counters)
+        json["counters"][name] = counter->get();
+    for (const auto &[name, gauge] : gauges)
+        json["gauges"][name] = gauge->get();
+    for (const auto &[name, histogram] : histograms)
+        json["histograms"][name] = histogram->toJson();
+    return json;
+}
+
+void Metrics::Registry::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[name, counter] : counters)
+        counter->reset();
+    for (auto &[name, histogram] : histograms)
+        histogram->reset();
+}
+
+Metrics::Registry &Metrics::registry()
+{
+    static Registry instance; // constructed before any metric reference is cached, so it outlives them
+    return instance;
+}
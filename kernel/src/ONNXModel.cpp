@@ -8,9 +8,12 @@
 #include <unordered_map>
 #include <filesystem>
 #include <algorithm>
+#include <numeric>
 
 #include <onnxruntime_cxx_api.h>
 
+#include "Executor.h"
+#include "Metrics.h"
 #include "Utils.h"
 
 /*
@@ -60,7 +63,7 @@ std::shared_ptr<Ort::MemoryInfo> ONNXModel::memoryInfo;
 std::mutex ONNXModel::mutex;
 std::unordered_map<std::filesystem::path, std::weak_ptr<Ort::Session>> ONNXModel::instancesSessions;
 
-std::unordered_map<Ort::Session *, std::shared_ptr<std::mutex>> ONNXModel::sessionMutexes;
+std::unordered_map<Ort::Session *, std::shared_ptr<ONNXModel::RunScheduler>> ONNXModel::sessionSchedulers;
 
 std::atomic<int> ONNXModel::instanceCount = 0;
 
@@ -93,7 +96,13 @@ std::vector<ONNXModel::device> ONNXModel::getAvailableDevices()
 
 void ONNXModel::initialize()
 {
-    env.reset(new Ort::Env(ORT_LOGGING_LEVEL_WARNING, "ONNXModelEnv")); // ONNX runtime will log warnings and errors
+    // one intra-op pool for all sessions, sized by what is left of the cpu budget of the kernel,
+    // per-session pools would start a full pool for every embedding and reranker model
+    Ort::ThreadingOptions threadingOptions;
+    threadingOptions.SetGlobalIntraOpNumThreads(Executor::onnxThreads());
+    threadingOptions.SetGlobalInterOpNumThreads(1);
+    threadingOptions.SetGlobalSpinControl(0); // concurrent runs would waste cpu on spinning threads
+    env.reset(new Ort::Env(threadingOptions, ORT_LOGGING_LEVEL_WARNING, "ONNXModelEnv")); // ONNX runtime will log warnings and errors
     allocator.reset(new Ort::AllocatorWithDefaultOptions()); // default allocator
     memoryInfo.reset(new Ort::MemoryInfo(Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault))); // default memory info in cpu
 }
@@ -102,12 +111,47 @@ void ONNXModel::release()
 {
     std::lock_guard<std::mutex> lock(ONNXModel::mutex); // lock the mutex
     ONNXModel::instancesSessions.clear(); // clear all sessions
-    ONNXModel::sessionMutexes.clear(); // clear all session mutexes
+    ONNXModel::sessionSchedulers.clear(); // clear all session schedulers
     ONNXModel::env.reset(); // release env
     ONNXModel::allocator.reset(); // release allocator
     ONNXModel::memoryInfo.reset(); // release memory info
 }
 
+void ONNXModel::RunScheduler::acquire(priority p)
+{
+    int lane = static_cast<int>(p);
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting[lane]++;
+    cv.wait(lock, [this, p, lane]() {
+        if (!concurrent && running[0] + running[1] > 0)
+            return false;
+        if (running[lane] >= maxRunning[lane])
+            return false;
+        // background calls give way to interactive calls
+        if (p == priority::background && (running[0] > 0 || waiting[0] > 0))
+            return false;
+        return true;
+    });
+    waiting[lane]--;
+    running[lane]++;
+}
+
+void ONNXModel::RunScheduler::release(priority p)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running[static_cast<int>(p)]--;
+    }
+    cv.notify_all();
+}
+
+std::pair<std::filesystem::path, std::filesystem::path> ONNXModel::resolveModelPath(const std::filesystem::path &targetModelPath)
+{
+    if (targetModelPath.extension() == ".onnx")
+        return {targetModelPath.parent_path(), targetModelPath};
+    return {targetModelPath, targetModelPath / modelFileName};
+}
+
 bool ONNXModel::checkCapability(device dev)
 {
     auto provider = Ort::GetAvailableProviders();
@@ -155,7 +199,7 @@ bool ONNXModel::checkCapability(device dev)
     }
 }
 
-ONNXModel::ONNXModel(std::filesystem::path targetModelDirPath, device dev, int maxThreads): 
+ONNXModel::ONNXModel(std::filesystem::path targetModelDirPath, device dev): 
     modelDirPath(targetModelDirPath)
 {
     if(instanceCount == 0)
@@ -228,26 +272,21 @@ ONNXModel::ONNXModel(std::filesystem::path targetModelDirPath, device dev, int m
                 sessionOptions.EnableCpuMemArena();
                 sessionOptions.EnableMemPattern();
 
-                sessionOptions.SetExecutionMode(ExecutionMode::ORT_PARALLEL);
+                // transformer graphs are almost sequential, parallel execution mode only adds an inter-op pool
+                // competing with intra-op threads
+                sessionOptions.SetExecutionMode(ExecutionMode::ORT_SEQUENTIAL);
                 logger.info("Create model " + targetModelDirPath.string() + " with CPU execution.");
             }
 
-            // set max threads for any device
-            int hardwareThreads = std::thread::hardware_concurrency();
-            if(maxThreads == 0) 
-            {
-                sessionOptions.SetIntraOpNumThreads(hardwareThreads);
-                sessionOptions.SetInterOpNumThreads(hardwareThreads);
-            }
-            else
-            {
-                sessionOptions.SetIntraOpNumThreads(maxThreads);
-                sessionOptions.SetInterOpNumThreads(maxThreads);
-            }
+            // use the global pools of env for any device
+            // all Run() calls of all sessions share the intra-op pool, the scheduler bounds how many of them run at once
+            sessionOptions.DisablePerSessionThreads();
             
             
             // open session
-            auto modelPath = targetModelDirPath / "model.onnx";
+            auto modelPath = resolveModelPath(targetModelDirPath).second;
+            if (modelPath.filename() == quantizedModelFileName && dev != device::cpu)
+                logger.warning("Quantized model " + modelPath.string() + " is designed for CPU, may be slow on " + device_to_string(dev) + ".");
             if (!std::filesystem::exists(modelPath))
                 throw Error{"Model file not found at " + modelPath.string(), Error::Type::FileAccess};
             auto modelPathwString = Utils::string_to_wstring(modelPath.string());
@@ -261,25 +300,15 @@ ONNXModel::ONNXModel(std::filesystem::path targetModelDirPath, device dev, int m
             
             // store the session in the map
             instancesSessions[targetModelDirPath] = session; // store the session in the map
+
+            // CoreML execution provider is not guaranteed to be thread-safe, run one call at a time
+            sessionSchedulers[session.get()] = std::make_shared<RunScheduler>(!hasConfiged || dev != device::coreML);
         }
-        // get session mutex
-        if (isExist)
-        {
-            auto it = sessionMutexes.find(session.get());
-            if (it != sessionMutexes.end())
-            {
-                sessionMutex = it->second; // use the existing mutex
-            }
-        }
-        else
-        {
-            sessionMutex = std::make_shared<std::mutex>(); // create a new mutex
-            sessionMutexes[session.get()] = sessionMutex;  // store the mutex in the map
-        }
+        // get session scheduler
+        scheduler = sessionSchedulers[session.get()];
     }
     // update input and output names
     {
-        std::lock_guard<std::mutex> lock(*sessionMutex);
         size_t numInputs = session->GetInputCount();
         size_t numOutputs = session->GetOutputCount();
         inputNames.resize(numInputs);
@@ -299,6 +328,7 @@ ONNXModel::ONNXModel(std::filesystem::path targetModelDirPath, device dev, int m
 
 ONNXModel::~ONNXModel()
 {
+    buffers.clear(); // io bindings must be released before the session
     // remove from instancesSessions map if session is not used anymore
     {
         std::lock_guard<std::mutex> lock(mutex); // lock the mutex
@@ -312,15 +342,15 @@ ONNXModel::~ONNXModel()
             {
                 instancesSessions.erase(it); // remove from map
             }
-            // remove from sessionMutexes map
-            auto it2 = sessionMutexes.find(session.get());
-            if(it2 != sessionMutexes.end())
+            // remove from sessionSchedulers map
+            auto it2 = sessionSchedulers.find(session.get());
+            if(it2 != sessionSchedulers.end())
             {
-                sessionMutexes.erase(it2); // remove from map
+                sessionSchedulers.erase(it2); // remove from map
             }
         }
         session.reset(); // release session
-        sessionMutex.reset(); // release mutex
+        scheduler.reset(); // release scheduler
     }
     instanceCount--;
     if(instanceCount == 0)
@@ -329,12 +359,60 @@ ONNXModel::~ONNXModel()
     }
 }
 
+ONNXModel::InferenceBuffer &ONNXModel::getInferenceBuffer() const
+{
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    auto &buffer = buffers[std::this_thread::get_id()]; // elements of unordered_map are not moved by later inserts
+    if (!buffer.binding) // first use in this thread
+    {
+        buffer.binding = std::make_unique<Ort::IoBinding>(*session);
+    }
+    return buffer;
+}
+
+void ONNXModel::run(InferenceBuffer &buffer, const std::array<int64_t, 2> &inputShape, const std::string &outputName,
+                    float *output, const std::vector<int64_t> &outputShape, priority p) const
+{
+    // tensors only wrap the buffers, no data is copied
+    auto inputSize = inputShape[0] * inputShape[1];
+    auto outputSize = std::accumulate(outputShape.begin(), outputShape.end(), int64_t{1}, std::multiplies<int64_t>());
+    Ort::Value inputIds = Ort::Value::CreateTensor<int64_t>(*memoryInfo, buffer.inputIds.data(), inputSize, inputShape.data(), inputShape.size());
+    Ort::Value attentionMask = Ort::Value::CreateTensor<int64_t>(*memoryInfo, buffer.attentionMask.data(), inputSize, inputShape.data(), inputShape.size());
+    Ort::Value outputTensor = Ort::Value::CreateTensor<float>(*memoryInfo, output, outputSize, outputShape.data(), outputShape.size());
+
+    // assume that the first input is input_ids and the second is attention_mask
+    auto &binding = *buffer.binding;
+    binding.BindInput(inputNames[0].c_str(), inputIds);
+    binding.BindInput(inputNames[1].c_str(), attentionMask);
+    binding.BindOutput(outputName.c_str(), outputTensor); // only bound output will be computed, result is written to output directly
+
+    {
+        static auto &interactiveWait = Metrics::histogram("onnx.wait.interactive");
+        static auto &backgroundWait = Metrics::histogram("onnx.wait.background");
+        static auto &interactiveRun = Metrics::histogram("onnx.run.interactive");
+        static auto &backgroundRun = Metrics::histogram("onnx.run.background");
+        bool interactive = p == priority::interactive;
+        Metrics::ScopedTimer waitTimer(interactive ? interactiveWait : backgroundWait);
+        RunGuard guard(*scheduler, p); // wait for a slot of its lane
+        waitTimer.stop();
+        Metrics::ScopedTimer runTimer(interactive ? interactiveRun : backgroundRun);
+        session->Run(Ort::RunOptions{nullptr}, binding);
+    }
+
+    // do not keep pointers to caller memory
+    binding.ClearBoundInputs();
+    binding.ClearBoundOutputs();
+}
+
 // ------------------------ EmbeddingModel ------------------------ //
-EmbeddingModel::EmbeddingModel(std::filesystem::path targetModelDirPath, device dev, int maxThreads) : ONNXModel(targetModelDirPath, dev, maxThreads)
+EmbeddingModel::EmbeddingModel(std::filesystem::path targetModelDirPath, device dev) : ONNXModel(targetModelDirPath, dev)
 {
+    // tokenizer and config are always in the model directory, even if a quantized model file is specified
+    auto modelDirPath = resolveModelPath(targetModelDirPath).first;
+
     // load tokenizer
     tokenizer = std::make_unique<sentencepiece::SentencePieceProcessor>();
-    std::string modelPath = (targetModelDirPath / "sentencepiece.bpe.model").string();
+    std::string modelPath = (modelDirPath / "sentencepiece.bpe.model").string();
     auto status = tokenizer->Load(modelPath.c_str());
     if (!status.ok())
     {
@@ -344,13 +422,12 @@ EmbeddingModel::EmbeddingModel(std::filesystem::path targetModelDirPath, device
     // get embedding dimension from model
     // asume the second output is the embedding output
     {
-        std::lock_guard<std::mutex> lock(*sessionMutex); // lock the mutex
         Ort::TypeInfo typeInfo = session->GetOutputTypeInfo(1);
         embeddingDimension = typeInfo.GetTensorTypeAndShapeInfo().GetShape().back(); // get the last dimension of the output shape
     }
 
     //get max input length
-    auto configPath = targetModelDirPath / "config.json";
+    auto configPath = modelDirPath / "config.json";
     if(std::filesystem::exists(configPath))
     {
         auto config = Utils::readJsonFile(configPath);
@@ -366,40 +443,39 @@ EmbeddingModel::EmbeddingModel(std::filesystem::path targetModelDirPath, device
     }
 }
 
-std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> EmbeddingModel::tokenize(const std::string &text) const
+std::array<int64_t, 2> EmbeddingModel::tokenize(const std::string &text, InferenceBuffer &buffer) const
 {
     if(text.empty())
         throw Error{"Input text is empty.", Error::Type::Internal};
     
     // tokenize text to ids
-    std::vector<int> tempTokenIds;
+    auto &tempTokenIds = buffer.tokenIds;
     tokenizer->Encode(text, &tempTokenIds); // tokenize text to ids
 
     // get max length
     int length = tempTokenIds.size() + 2; // +2 for [BOS] and [EOS]
     if (length > maxLength)
     {
-        std::cout << "Warning: the input text is too long, will be truncated to " << std::to_string(maxLength) << " ." << std::endl;
+        logger.warning("[ONNXModel] the input text is too long, will be truncated to " + std::to_string(maxLength) + " .");
         length = maxLength;
     }
 
     // move token ids to tokenIds and add [BOS] and [EOS] tokens
-    std::vector<int64_t> tokenIds(length, tokenizer->pad_id());
+    auto &tokenIds = buffer.inputIds;
+    tokenIds.assign(length, tokenizer->pad_id());
     auto copySize = std::min(static_cast<int>(tempTokenIds.size()), length - 2);
     std::copy(tempTokenIds.begin(), tempTokenIds.begin() + copySize, tokenIds.begin() + 1);
     tokenIds[0] = tokenizer->bos_id(); // [BOS] token id
     tokenIds[length - 1] = tokenizer->eos_id(); // [EOS] token id
     // generate attention mask
-    std::vector<int64_t> attentionMask(length, 1); // all tokens are valid tokens
-    // generate shape
-    std::vector<int64_t> shape = {1, length}; // 1 * max length
+    buffer.attentionMask.assign(length, 1); // all tokens are valid tokens
 
-    return {std::move(tokenIds), std::move(attentionMask), std::move(shape)}; // return token ids and attention mask and shape
+    return {1, length}; // 1 * max length
 }
 
 // this implement may be slow
 // untested version
-std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> EmbeddingModel::tokenize(const std::vector<std::string> &texts) const
+std::array<int64_t, 2> EmbeddingModel::tokenize(const std::vector<std::string> &texts, InferenceBuffer &buffer) const
 {
     if(texts.empty())
         throw Error{"Input texts are empty.", Error::Type::Internal};
@@ -417,13 +493,15 @@ std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> Emb
 
     if(length > maxLength)
     {
-        std::cout << "Warning: the input text is too long, will be truncated to " << std::to_string(maxLength) << " ." << std::endl;
+        logger.warning("[ONNXModel] the input text is too long, will be truncated to " + std::to_string(maxLength) + " .");
         length = maxLength;
     }
 
     // move token ids to tokenIds and add [BOS] and [EOS] tokens, and generate attention mask
-    std::vector<int64_t> tokenIds(length * tempTokenIds.size(), tokenizer->pad_id()); // all tokens are padding tokens
-    std::vector<int64_t> attentionMask(length * tempTokenIds.size(), 0); // all tokens are padding tokens
+    auto &tokenIds = buffer.inputIds;
+    auto &attentionMask = buffer.attentionMask;
+    tokenIds.assign(length * tempTokenIds.size(), tokenizer->pad_id()); // all tokens are padding tokens
+    attentionMask.assign(length * tempTokenIds.size(), 0); // all tokens are padding tokens
     for(int i = 0; i < tempTokenIds.size(); i++)
     {
         auto copySize = std::min(static_cast<int>(tempTokenIds[i].size()), length - 2);
@@ -435,95 +513,75 @@ std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> Emb
         std::fill(attentionMask.begin() + i * length,
                   attentionMask.begin() + i * length + length, 1); // set attention mask to 1 for real tokens
     }
-    // generate shape
-    std::vector<int64_t> shape = {static_cast<int64_t>(tempTokenIds.size()), static_cast<int64_t>(length)}; // batch size * max length
 
-    return {std::move(tokenIds), std::move(attentionMask),std::move(shape)}; // return token ids and attention mask
+    return {static_cast<int64_t>(tempTokenIds.size()), static_cast<int64_t>(length)}; // batch size * max length
 }
 
-// asume thai the first input is input_ids and the second is attention_mask
-std::vector<float> EmbeddingModel::embed(const std::string &text) const
+// asume that the first input is input_ids and the second is attention_mask
+// assume that the second output is the embedding output, only compute the embedding output to save time
+void EmbeddingModel::embed(const std::string &text, float *output, priority p) const
 {
-    // tokenize input text
-    auto [input_ids_vector, input_attention_mask_vector, shape] = tokenize(text);
-
-    // convert to Ort tensor
-    // ort tensor only save pointer to data, make sure the data has not been deallocated
-    Ort::Value input_ids = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_ids_vector.data(), input_ids_vector.size(), shape.data(), shape.size());
-    Ort::Value input_attention_mask = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_attention_mask_vector.data(), input_attention_mask_vector.size(), shape.data(), shape.size());
-
-    // prepare input tensors
-    std::vector<Ort::Value> input_tensors;
-    input_tensors.push_back(std::move(input_ids));
-    input_tensors.push_back(std::move(input_attention_mask));
-
-    // prepare input names and output names
-    std::vector<const char *> inputNamesPtr = {inputNames[0].c_str(), inputNames[1].c_str()}; // assume that the first input is input_ids and the second is attention_mask
-    std::vector<const char *> outputNamesPtr = {outputNames[1].c_str()}; // assume that the second output is the embedding output, only compute the embedding output to save time
+    auto &buffer = getInferenceBuffer();
+    auto shape = tokenize(text, buffer);
+    run(buffer, shape, outputNames[1], output, {1, embeddingDimension}, p);
+}
 
-    // run inference
-    std::vector<Ort::Value> output_tensors;
-    {
-        std::lock_guard<std::mutex> lock(*sessionMutex); // lock the mutex
-        output_tensors = session->Run(Ort::RunOptions{nullptr}, inputNamesPtr.data(), input_tensors.data(), input_tensors.size(), outputNamesPtr.data(), outputNamesPtr.size());
-    }
+void EmbeddingModel::embed(const std::vector<std::string> &texts, float *output, priority p) const
+{
+    auto &buffer = getInferenceBuffer();
+    auto shape = tokenize(texts, buffer);
+    run(buffer, shape, outputNames[1], output, {shape[0], embeddingDimension}, p);
+}
 
-    auto embeddingVectorPtr = output_tensors[0].GetTensorMutableData<float>(); // get the output tensor data
-    std::vector<float> embeddingVector(embeddingVectorPtr, embeddingVectorPtr + embeddingDimension); // copy the output tensor data to a vector
+std::vector<int> EmbeddingModel::encode(const std::string &text) const
+{
+    std::vector<int> tokenIds;
+    tokenizer->Encode(text, &tokenIds);
+    return tokenIds;
+}
 
+std::vector<float> EmbeddingModel::embed(const std::string &text, priority p) const
+{
+    std::vector<float> embeddingVector(embeddingDimension);
+    embed(text, embeddingVector.data(), p);
     return embeddingVector; // return the embedding vector
 }
 
-std::vector<std::vector<float>> EmbeddingModel::embed(const std::vector<std::string> &texts) const
+std::vector<std::vector<float>> EmbeddingModel::embed(const std::vector<std::string> &texts, priority p) const
 {
-    // tokenize input texts
-    auto [input_id_vectors, input_attention_mask_vectors, shape] = tokenize(texts);
-
-    // convert to Ort tensor
-    Ort::Value input_ids = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_id_vectors.data(), input_id_vectors.size(), shape.data(), shape.size());
-    Ort::Value input_attention_mask = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_attention_mask_vectors.data(), input_attention_mask_vectors.size(), shape.data(), shape.size());
+    std::vector<float> output(texts.size() * embeddingDimension);
+    embed(texts, output.data(), p);
 
-    // prepare input tensors
-    std::vector<Ort::Value> input_tensors;
-    input_tensors.push_back(std::move(input_ids));
-    input_tensors.push_back(std::move(input_attention_mask));
-
-    // prepare input names and output names
-    std::vector<const char *> inputNamesPtr = {inputNames[0].c_str(), inputNames[1].c_str()}; // assume that the first input is input_ids and the second is attention_mask
-    std::vector<const char *> outputNamesPtr = {outputNames[1].c_str()}; // assume that the second output is the embedding output, only compute the embedding output to save time
-
-    // run inference
-    std::vector<Ort::Value> output_tensors;
-    {
-        std::lock_guard<std::mutex> lock(*sessionMutex); // lock the mutex
-        output_tensors = session->Run(Ort::RunOptions{nullptr}, inputNamesPtr.data(), input_tensors.data(), input_tensors.size(), outputNamesPtr.data(), outputNamesPtr.size());
-    }
-
-    auto embeddingVectorPtr = output_tensors[0].GetTensorMutableData<float>(); // get the output tensor data
     std::vector<std::vector<float>> embeddingVectors; // create a vector of vectors to store the embedding vectors
+    embeddingVectors.reserve(texts.size());
     for(size_t i = 0; i < texts.size(); i++)
     {
-        std::vector<float> embeddingVector(embeddingVectorPtr + i * embeddingDimension, embeddingVectorPtr + (i + 1) * embeddingDimension); // copy the output tensor data to a vector
-        embeddingVectors.push_back(std::move(embeddingVector)); // add the embedding vector to the vector of vectors
+        embeddingVectors.emplace_back(output.begin() + i * embeddingDimension, output.begin() + (i + 1) * embeddingDimension);
     }
 
     return embeddingVectors; // return the vector of embedding vectors
 }
 
 //------------------------- RerankerModel -------------------------//
-RerankerModel::RerankerModel(std::filesystem::path targetModelDirPath, device dev, int maxThreads) : ONNXModel(targetModelDirPath, dev, maxThreads)
+RerankerModel::RerankerModel(std::filesystem::path targetModelDirPath, device dev) : ONNXModel(targetModelDirPath, dev)
 {
+    // tokenizer and config are always in the model directory, even if a quantized model file is specified
+    auto modelDirPath = resolveModelPath(targetModelDirPath).first;
+
     // load tokenizer
     tokenizer = std::make_unique<sentencepiece::SentencePieceProcessor>();
-    std::string modelPath = (targetModelDirPath / "sentencepiece.bpe.model").string();
+    std::string modelPath = (modelDirPath / "sentencepiece.bpe.model").string();
     auto status = tokenizer->Load(modelPath.c_str());
     if (!status.ok())
     {
         throw Error{"Failed to load tokenizer model at " + modelPath, Error::Type::FileAccess};
     }
 
+    // some models output scores in shape [batch], others in [batch, 1]
+    scoreRank = session->GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo().GetDimensionsCount();
+
     // get max input length
-    auto configPath = targetModelDirPath / "config.json";
+    auto configPath = modelDirPath / "config.json";
     if (std::filesystem::exists(configPath))
     {
         auto config = Utils::readJsonFile(configPath);
@@ -539,7 +597,7 @@ RerankerModel::RerankerModel(std::filesystem::path targetModelDirPath, device de
     }
 }
 
-std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> RerankerModel::tokenize(const std::string &query, const std::string &content) const
+std::array<int64_t, 2> RerankerModel::tokenize(const std::string &query, const std::string &content, InferenceBuffer &buffer) const
 {
     if(query.empty() || content.empty())
         throw Error{"Input query or content is empty.", Error::Type::Internal};
@@ -547,18 +605,19 @@ std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> Rer
     // tokenize text to ids
     std::vector<int> queryTokenIds;
     tokenizer->Encode(query, &queryTokenIds);
-    std::vector<int> contentTokenIds;
+    auto &contentTokenIds = buffer.tokenIds;
     tokenizer->Encode(content, &contentTokenIds);
 
     // get length
     int64_t length = queryTokenIds.size() + contentTokenIds.size() + 3; // +3 for [BOS] and [EOS]*2
     if(length > maxLength)
     {
-        std::cout << "Warning: the input text is too long, will be truncated to " << std::to_string(maxLength) << " ." << std::endl;
+        logger.warning("[ONNXModel] the input text is too long, will be truncated to " + std::to_string(maxLength) + " .");
         length = maxLength;
     }
 
-    std::vector<int64_t> inputIds(length, tokenizer->pad_id());
+    auto &inputIds = buffer.inputIds;
+    inputIds.assign(length, tokenizer->pad_id());
     std::copy(queryTokenIds.begin(), queryTokenIds.end(), inputIds.begin() + 1);
     auto copySize = std::min(contentTokenIds.size(), static_cast<size_t>(length - queryTokenIds.size() - 3));
     std::copy(contentTokenIds.begin(), contentTokenIds.begin() + copySize, inputIds.begin() + queryTokenIds.size() + 2);
@@ -566,12 +625,11 @@ std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> Rer
     inputIds[queryTokenIds.size() + 1] = tokenizer->eos_id();
     inputIds[length - 1] = tokenizer->eos_id();
 
-    std::vector<int64_t> attentionMask(length, 1);
-    std::vector<int64_t> shape = {1, length}; 
-    return {std::move(inputIds), std::move(attentionMask), std::move(shape)};
+    buffer.attentionMask.assign(length, 1);
+    return {1, length};
 }
 
-std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> RerankerModel::tokenize(const std::string &query, const std::vector<std::string> &contents) const
+std::array<int64_t, 2> RerankerModel::tokenize(const std::string &query, const std::vector<std::string> &contents, InferenceBuffer &buffer) const
 {
     if (query.empty() || contents.empty())
         throw Error{"Input query or contents are empty.", Error::Type::Internal};
@@ -590,12 +648,14 @@ std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> Rer
 
     if (length > maxLength)
     {
-        std::cout << "Warning: the input text is too long, will be truncated to " << std::to_string(maxLength) << " ." << std::endl;
+        logger.warning("[ONNXModel] the input text is too long, will be truncated to " + std::to_string(maxLength) + " .");
         length = maxLength;
     }
 
-    std::vector<int64_t> inputIds(length * contents.size(), tokenizer->pad_id());
-    std::vector<int64_t> attentionMask(length * contents.size(), 0);
+    auto &inputIds = buffer.inputIds;
+    auto &attentionMask = buffer.attentionMask;
+    inputIds.assign(length * contents.size(), tokenizer->pad_id());
+    attentionMask.assign(length * contents.size(), 0);
     for(int i = 0; i < contents.size(); i++)
     {
         std::copy(queryToken.begin(), 
@@ -610,65 +670,39 @@ std::tuple<std::vector<int64_t>, std::vector<int64_t>, std::vector<int64_t>> Rer
         inputIds[i * length + length - 1] = tokenizer->eos_id();
         std::fill(attentionMask.begin() + i * length, attentionMask.begin() + (i + 1) * length, 1);
     }
-    std::vector<int64_t> shape = {static_cast<int64_t>(contents.size()), static_cast<int64_t>(length)}; // batch size * max length
 
-    return {std::move(inputIds), std::move(attentionMask), std::move(shape)}; // return token ids and attention mask
+    return {static_cast<int64_t>(contents.size()), static_cast<int64_t>(length)}; // batch size * max length
 }
 
-float RerankerModel::rank(const std::string &query, const std::string &content) const
+std::vector<int> RerankerModel::encode(const std::string &text) const
 {
-    // tokenize input texts
-    auto [input_ids_vector, input_attention_mask_vector, shape] = tokenize(query, content);
-
-    // convert to Ort tensor
-    Ort::Value input_ids = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_ids_vector.data(), input_ids_vector.size(), shape.data(), shape.size());
-    Ort::Value input_attention_mask = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_attention_mask_vector.data(), input_attention_mask_vector.size(), shape.data(), shape.size());
-
-    // prepare input tensors
-    std::vector<Ort::Value> input_tensors;
-    input_tensors.push_back(std::move(input_ids));
-    input_tensors.push_back(std::move(input_attention_mask));
-
-    // prepare input names and output names
-    std::vector<const char *> inputNamesPtr = {inputNames[0].c_str(), inputNames[1].c_str()}; // assume that the first input is input_ids and the second is attention_mask
-    std::vector<const char *> outputNamesPtr = {outputNames[0].c_str()}; // assume that the first output is the score output
+    std::vector<int> tokenIds;
+    tokenizer->Encode(text, &tokenIds);
+    return tokenIds;
+}
 
-    // run inference
-    std::vector<Ort::Value> output_tensors;
-    {
-        std::lock_guard<std::mutex> lock(*sessionMutex); // lock the mutex
-        output_tensors = session->Run(Ort::RunOptions{nullptr}, inputNamesPtr.data(), input_tensors.data(), input_tensors.size(), outputNamesPtr.data(), outputNamesPtr.size());
-    }
+// assume that the first input is input_ids and the second is attention_mask
+// assume that the first output is the score output
+float RerankerModel::rank(const std::string &query, const std::string &content, priority p) const
+{
+    auto &buffer = getInferenceBuffer();
+    auto shape = tokenize(query, content, buffer);
 
-    auto scoreVectorPtr = output_tensors[0].GetTensorMutableData<float>(); // get the output tensor data
-    return Utils::sigmoid(scoreVectorPtr[0]); // return the score
+    float score = 0.0f;
+    run(buffer, shape, outputNames[0], &score, scoreShape(1), p);
+    return Utils::sigmoid(score); // return the score
 }
 
-std::vector<float> RerankerModel::rank(const std::string &query, const std::vector<std::string> &contents) const
+std::vector<float> RerankerModel::rank(const std::string &query, const std::vector<std::string> &contents, priority p) const
 {
-    auto [input_ids_vector, input_attention_mask_vector, shape] = tokenize(query, contents);
-
-    // convert to Ort tensor
-    Ort::Value input_ids = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_ids_vector.data(), input_ids_vector.size(), shape.data(), shape.size());
-    Ort::Value input_attention_mask = Ort::Value::CreateTensor<int64_t>(*memoryInfo, input_attention_mask_vector.data(), input_attention_mask_vector.size(), shape.data(), shape.size());
-    // prepare input tensors
-    std::vector<Ort::Value> input_tensors;
-    input_tensors.push_back(std::move(input_ids));
-    input_tensors.push_back(std::move(input_attention_mask));
-    // prepare input names and output names
-    std::vector<const char *> inputNamesPtr = {inputNames[0].c_str(), inputNames[1].c_str()}; // assume that the first input is input_ids and the second is attention_mask
-    std::vector<const char *> outputNamesPtr = {outputNames[0].c_str()}; // assume that the first output is the score output
-    // run inference
-    std::vector<Ort::Value> output_tensors;
-    {
-        std::lock_guard<std::mutex> lock(*sessionMutex); // lock the mutex
-        output_tensors = session->Run(Ort::RunOptions{nullptr}, inputNamesPtr.data(), input_tensors.data(), input_tensors.size(), outputNamesPtr.data(), outputNamesPtr.size());
-    }
-    auto scoreVectorPtr = output_tensors[0].GetTensorMutableData<float>(); // get the output tensor data
-    std::vector<float> scores; // create a vector to store the scores
-    for(size_t i = 0; i < contents.size(); i++)
+    auto &buffer = getInferenceBuffer();
+    auto shape = tokenize(query, contents, buffer);
+
+    std::vector<float> scores(contents.size()); // model writes logits here directly
+    run(buffer, shape, outputNames[0], scores.data(), scoreShape(shape[0]), p);
+    for (auto &score : scores)
     {
-        scores.push_back(Utils::sigmoid(scoreVectorPtr[i])); // copy the output tensor data to a vector
+        score = Utils::sigmoid(score);
     }
     return scores; // return the scores
 }
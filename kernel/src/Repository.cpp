@@ -1,5 +1,7 @@
 #include "Repository.h"
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <thread>
 #include <vector>
@@ -11,15 +13,16 @@
 #include "ONNXModel.h"
 #include "DocPipe.h"
 #include "Utils.h"
+#include "Metrics.h"
 
 Repository::Repository(std::string repoName, std::filesystem::path repoPath, Utils::PriorityMutex &sqliteMutex,
-                       int maxThreads, ONNXModel::device device, // ONNX performance config
+                       ONNXModel::device device, // ONNX performance config
                        std::function<void(std::exception_ptr)> errorCallback,
                        std::function<void(std::vector<std::string>)> docStateReporter,
                        std::function<void(std::string, double)> progressReporter,
                        std::function<void(std::string)> doneReporter)
     : repoName(repoName), repoPath(repoPath), docStateReporter(docStateReporter), progressReporter(progressReporter),
-      doneReporter(doneReporter), sqliteMutex(sqliteMutex), device(device), maxThreads(maxThreads),
+      doneReporter(doneReporter), sqliteMutex(sqliteMutex), device(device),
       errorCallback(errorCallback)
 {
     // initialize sqliteDB
@@ -27,6 +30,7 @@ Repository::Repository(std::string repoName, std::filesystem::path repoPath, Uti
 
     // open text search table
     textTable = std::make_shared<TextSearchTable>(*sqlite, "text_search");
+    publishSnapshot();
 
     startBackgroundProcess();
 }
@@ -35,12 +39,30 @@ void Repository::initializeSqlite(bool needLock)
 {
     dbPath = repoPath / ".PocketRAG" / "db";
     sqlite = std::make_shared<SqliteConnection>(dbPath.string(), repoName);
+    maintenance = std::make_shared<SqliteMaintenance>(*sqlite);
     std::shared_ptr<Utils::LockGuard> sqliteLockPtr;
     if(needLock)
     {
         sqliteLockPtr = std::make_shared<Utils::LockGuard>(sqliteMutex, true, true);
     }
 
+    // chunks of older versions belong to one embedding, so the same text is stored and indexed once per embedding,
+    // rebuild the index from documents, embedding configs are kept
+    bool hasEmbeddingId = false;
+    auto chunkColumnStmt = sqlite->getStatement("PRAGMA table_info(chunks);");
+    while (chunkColumnStmt.step())
+    {
+        if (chunkColumnStmt.get<std::string>(1) == "embedding_id")
+        {
+            hasEmbeddingId = true;
+        }
+    }
+    if (hasEmbeddingId)
+    {
+        logger.info("[Repository.initializeSqlite] chunks of repository " + repoName + " are per embedding, rebuilding index.");
+        dropIndexTables();
+    }
+
     // create documents table
     sqlite->execute(
         "CREATE TABLE IF NOT EXISTS documents("
@@ -64,20 +86,34 @@ void Repository::initializeSqlite(bool needLock)
         "valid BOOLEAN DEFAULT 1" // for soft delete
         ");");
 
-    // create chunks table
+    // chunk length of each embedding, set when the model is loaded, added to tables of older versions
+    bool hasChunkLength = false;
+    auto configColumnStmt = sqlite->getStatement("PRAGMA table_info(embedding_config);");
+    while (configColumnStmt.step())
+    {
+        if (configColumnStmt.get<std::string>(1) == "chunk_length")
+        {
+            hasChunkLength = true;
+        }
+    }
+    if (!hasChunkLength)
+    {
+        sqlite->execute("ALTER TABLE embedding_config ADD COLUMN chunk_length INTEGER;");
+    }
+
+    // create chunks table, a document is chunked once for each chunk length, shared by embeddings with that length
     sqlite->execute(
         "CREATE TABLE IF NOT EXISTS chunks("
         "chunk_id INTEGER PRIMARY KEY AUTOINCREMENT, "
         "doc_id INTEGER NOT NULL, "
-        "embedding_id INTEGER NOT NULL, "
+        "chunk_length INTEGER NOT NULL, "
         "chunk_index INTEGER, "
         "content_hash TEXT NOT NULL, "
         "begin_line INTEGER, "
         "end_line INTEGER, "
         ""
-        "UNIQUE(doc_id, embedding_id, chunk_index), " // constraints
-        "FOREIGN KEY(doc_id) REFERENCES documents(id) ON DELETE CASCADE, "
-        "FOREIGN KEY(embedding_id) REFERENCES embedding_config(id) ON DELETE CASCADE"
+        "UNIQUE(doc_id, chunk_length, chunk_index), " // constraints, also index of chunks of a document
+        "FOREIGN KEY(doc_id) REFERENCES documents(id) ON DELETE CASCADE"
         ");"
     );
 
@@ -85,9 +121,6 @@ void Repository::initializeSqlite(bool needLock)
     sqlite->execute(
         "CREATE INDEX IF NOT EXISTS idx_chunks_doc_id ON chunks(doc_id);"
     );
-    sqlite->execute(
-        "CREATE INDEX IF NOT EXISTS idx_chunks_embedding_id ON chunks(embedding_id);"
-    );
 
     // add index for documents table
     sqlite->execute(
@@ -154,6 +187,7 @@ void Repository::updateEmbeddings(const EmbeddingConfigList &configs, bool needL
     std::vector<std::shared_ptr<VectorTable>> tempVectorTables;
     std::vector<std::shared_ptr<Embedding>> tempEmbeddings;
     stmt = sqlite->getStatement("SELECT id, config_name, model_path, input_length FROM embedding_config WHERE valid = 1;");
+    auto chunkLengthStmt = sqlite->getStatement("UPDATE embedding_config SET chunk_length = ? WHERE id = ?;");
     while (stmt.step())
     {
         int id = stmt.get<int>(0);
@@ -162,10 +196,20 @@ void Repository::updateEmbeddings(const EmbeddingConfigList &configs, bool needL
         int inputLength = stmt.get<int>(3);
 
         // create embedding model
-        auto embeddingModel = std::make_shared<EmbeddingModel>(modelPath, device, maxThreads);
+        auto embeddingModel = std::make_shared<EmbeddingModel>(modelPath, device);
         int dimension = embeddingModel->getDimension();
-        auto embedding = std::make_shared<Embedding>(id, name, dimension, inputLength, embeddingModel);
+        int chunkLength = inputLength;
+        if (inputLength > embeddingModel->getMaxLength())
+        {
+            chunkLength = embeddingModel->getMaxLength();
+            logger.warning("[Repository.updateEmbeddings] Embedding " + name + "'s input length is too long, use " + std::to_string(chunkLength) + " instead of " + std::to_string(inputLength));
+        }
+        auto embedding = std::make_shared<Embedding>(id, name, dimension, inputLength, embeddingModel, chunkLength);
         tempEmbeddings.push_back(embedding);
+        chunkLengthStmt.bind(1, chunkLength);
+        chunkLengthStmt.bind(2, id);
+        chunkLengthStmt.step();
+        chunkLengthStmt.reset();
 
         // create vector table for this embedding model
         std::string tableName = "vector_" + std::to_string(id);
@@ -182,6 +226,38 @@ void Repository::updateEmbeddings(const EmbeddingConfigList &configs, bool needL
     }
 
     trans.commit();
+    publishSnapshot(); // after commit, searches never see tables of uncommitted configs
+}
+
+auto Repository::loadSnapshot() const -> std::shared_ptr<const Snapshot>
+{
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    return snapshot;
+}
+
+void Repository::publishSnapshot()
+{
+    auto state = std::make_shared<Snapshot>();
+    state->sqlite = sqlite;
+    state->textTable = textTable;
+    state->vectorTables = vectorTables;
+    state->embeddings = embeddings;
+    state->rerankerModel = rerankerModel;
+
+    std::shared_ptr<const Snapshot> old = state;
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        snapshot.swap(old);
+    }
+    // running searches may still hold the old snapshot, the last one releases it without waiting here,
+    // write retired vector tables now, so their destructors only free memory in whatever thread they run
+    for (auto &vectorTable : old->vectorTables)
+    {
+        if (std::find(state->vectorTables.begin(), state->vectorTables.end(), vectorTable) == state->vectorTables.end())
+        {
+            vectorTable->write();
+        }
+    }
 }
 
 Repository::~Repository()
@@ -235,6 +311,7 @@ void Repository::backgroundProcess(std::function<bool()> retFlag)
 
         std::queue<DocPipe> docqueue; // create a new doc queue for each iteration
         checkDoc(docqueue); // check for changed documents
+        bool idle = docqueue.empty();
         // though refreshDoc will change vector tables and text table, but this changes will not affect to search result, so no need to use writelock(unique_lock)
         refreshDoc(docqueue, sqlitelock, repoLock, retFlag); // process the documents in the queue
         // logically, there is no other thread use these invalid embedding configs, only need to avoid changes in embedding_config table, so use shared_lock
@@ -252,6 +329,23 @@ void Repository::backgroundProcess(std::function<bool()> retFlag)
         {
             vectorTable->write();
         }
+
+        // maintenance only runs when no document changed, so it never slows down indexing
+        sqlitelock.yield();
+        repoLock.yield();
+        if (!idle || !maintenance->due() || sqlitelock.needRelease() || repoLock.needRelease() || retFlag())
+        {
+            continue;
+        }
+        maintenance->run(*textTable, [&sqlitelock, &repoLock, &retFlag]() -> bool {
+            if (sqlitelock.needRelease() || repoLock.needRelease())
+            {
+                return true;
+            }
+            sqlitelock.yield(); // let searches in between steps
+            repoLock.yield();
+            return retFlag();
+        });
     }
     logger.info("[Repository.backgroundProcess] Repository " + repoName + "'s background process stopped.");
 }
@@ -358,44 +452,98 @@ void Repository::refreshDoc(std::queue<DocPipe> &docqueue, Utils::LockGuard &sql
 {
     // process each document in the queue
     bool changed = !docqueue.empty(); // check if there are documents to process
-    while(!docqueue.empty())
+    // commit many small documents together, priority readers can still read committed data while yielding,
+    // but the group must be committed before returning to release the lock to other writers
+    DocPipe::GroupCommit group(*sqlite);
+    std::vector<std::string> uncommittedDocs; // done but not committed, reported after commit
+    auto commitGroup = [this, &group, &uncommittedDocs]() {
+        group.commit();
+        if(doneReporter)
+        {
+            for(const auto &path : uncommittedDocs)
+                doneReporter(path); // report the document is done
+        }
+        uncommittedDocs.clear();
+    };
+    auto rollbackGroup = [this, &group]() {
+        group.rollback(); // nothing to do if the group is committed
+        // faiss in memory still has vectors of the rolled back rows, their chunk ids will be reused by new chunks
+        for (auto &vectorTable : vectorTables)
+        {
+            vectorTable->dropUncommittedVectors();
+        }
+    };
+    try
     {
-        sqliteLock.yield();
-        repoLock.yield();
-        auto docPipe = std::move(docqueue.front()); // get the front document
-        docqueue.pop(); // remove it from the queue
-
-        auto path = docPipe.getRelPath(); // get the path of the document
-        docPipe.process(
-            [&path, this](double progress) { // process the document
-                if (this->progressReporter)
+        while(!docqueue.empty())
+        {
+            sqliteLock.yield();
+            repoLock.yield();
+            auto docPipe = std::move(docqueue.front()); // get the front document
+            docqueue.pop(); // remove it from the queue
+
+            auto path = docPipe.getRelPath(); // get the path of the document
+            group.begin();
+            std::exception_ptr error = nullptr;
+            {
+                // a savepoint for this document in the group, if it fails, documents done before it are kept
+                auto docTransaction = sqlite->beginTransaction();
+                try
                 {
-                    this->progressReporter(path, progress);
+                    docPipe.process(
+                        [&path, this](double progress) { // process the document
+                            if (this->progressReporter)
+                            {
+                                this->progressReporter(path, progress);
+                            }
+                        },
+                        [this, &sqliteLock, &repoLock, &retFlag]() -> bool {
+                            if (sqliteLock.needRelease() || repoLock.needRelease())
+                            {
+                                return true;
+                            }
+                            sqliteLock.yield();
+                            repoLock.yield();
+                            return retFlag();
+                        }); // pass the stop flag to the process function
+                    docTransaction.commit();
                 }
-            },
-            [this, &sqliteLock, &repoLock, &retFlag]() -> bool {
-                if (sqliteLock.needRelease() || repoLock.needRelease())
+                catch (...)
                 {
-                    return true;
+                    error = std::current_exception();
                 }
-                sqliteLock.yield();
-                repoLock.yield();
-                return retFlag();
-            }); // pass the stop flag to the process function
+            } // the savepoint of a failed document is rolled back here
+            if (error)
+            {
+                commitGroup(); // documents done before the failed one are kept
+                std::rethrow_exception(error);
+            }
 
-        if(retFlag())
-        {
-            return;
-        }
-        sqliteLock.yield();
-        repoLock.yield();
-        if (sqliteLock.needRelease() || repoLock.needRelease())
-        {
-            return;
-        }
+            if(retFlag())
+            {
+                commitGroup(); // the stopped document is not marked as done, it will be processed again
+                return;
+            }
+            sqliteLock.yield();
+            repoLock.yield();
+            if (sqliteLock.needRelease() || repoLock.needRelease())
+            {
+                commitGroup(); // the document may be stopped, it is not reported as done
+                return;
+            }
 
-        if(doneReporter)
-            doneReporter(path); // report the document is done
+            uncommittedDocs.push_back(path);
+            if(group.done())
+            {
+                commitGroup();
+            }
+        }
+        commitGroup();
+    }
+    catch (...)
+    {
+        rollbackGroup();
+        throw;
     }
 }
 
@@ -406,33 +554,14 @@ void Repository::removeInvalidEmbedding()
     std::vector<std::string> invalidVectorTables;
     {
         auto selectStmt = sqlite->getStatement("SELECT id FROM embedding_config WHERE valid = 0;");
-        auto chunkStmt = sqlite->getStatement("SELECT chunk_id FROM chunks WHERE embedding_id = ?;");
-        auto deleteChunksStmt = sqlite->getStatement("DELETE FROM chunks WHERE chunk_id = ?;");
         auto deleteEmbeddingStmt = sqlite->getStatement("DELETE FROM embedding_config WHERE id = ?;");
+        std::vector<int> embeddingIds;
         while (selectStmt.step())
         {
-            auto embeddingId = selectStmt.get<int>(0);
-
-            // get invalid chunk ids
-            chunkStmt.bind(1, embeddingId);
-            std::vector<int64_t> chunkIds;
-            while (chunkStmt.step())
-            {
-                chunkIds.push_back(chunkStmt.get<int64_t>(0)); 
-            }
-            chunkStmt.reset();
-
-            // delete invalid chunks
-            for (auto chunkId : chunkIds)
-            {
-                // delete from text table
-                textTable->deleteChunk(chunkId); 
-                // delete from chunks table
-                deleteChunksStmt.bind(1, chunkId);
-                deleteChunksStmt.step(); 
-                deleteChunksStmt.reset();
-            }
-
+            embeddingIds.push_back(selectStmt.get<int>(0));
+        }
+        for (auto embeddingId : embeddingIds)
+        {
             // delete embedding_config 
             deleteEmbeddingStmt.bind(1, embeddingId);
             deleteEmbeddingStmt.step(); 
@@ -441,6 +570,28 @@ void Repository::removeInvalidEmbedding()
             invalidVectorTables.push_back("vector_" + std::to_string(embeddingId)); 
         }
     }
+    // chunks are shared by embeddings with the same chunk length, only delete chunks no valid embedding uses
+    if (!invalidVectorTables.empty())
+    {
+        auto chunkStmt = sqlite->getStatement(
+            "SELECT chunk_id FROM chunks WHERE chunk_length NOT IN "
+            "(SELECT chunk_length FROM embedding_config WHERE valid = 1 AND chunk_length IS NOT NULL);");
+        std::vector<int64_t> chunkIds;
+        while (chunkStmt.step())
+        {
+            chunkIds.push_back(chunkStmt.get<int64_t>(0)); 
+        }
+        auto deleteChunksStmt = sqlite->getStatement("DELETE FROM chunks WHERE chunk_id = ?;");
+        for (auto chunkId : chunkIds)
+        {
+            // delete from text table
+            textTable->deleteChunk(chunkId); 
+            // delete from chunks table
+            deleteChunksStmt.bind(1, chunkId);
+            deleteChunksStmt.step(); 
+            deleteChunksStmt.reset();
+        }
+    }
     // delete from vector tables
     for(const auto& tableName : invalidVectorTables)
     {
@@ -449,44 +600,87 @@ void Repository::removeInvalidEmbedding()
     trans.commit();
 }
 
-auto Repository::search(const std::string &query, searchAccuracy acc, int limit) -> std::vector<SearchResult>
+auto Repository::search(const std::string &query, searchAccuracy acc, int limit, std::function<bool()> stopFlag, PhaseCallback onPhase, bool prefix) -> std::vector<SearchResult>
 {
-    Utils::LockGuard lock(sqliteMutex, true, false); // lock for reading embedding models and vector tables
-    Utils::LockGuard repoLock(repoMutex, true, false); // lock for vector tables and embeddings
+    auto stopped = [&stopFlag]() { return stopFlag && stopFlag(); };
+
+    static auto &searchCount = Metrics::counter("search.requests");
+    static auto &totalLatency = Metrics::histogram("search.total");
+    static auto &fts5Latency = Metrics::histogram("search.fts5");
+    static auto &embedLatency = Metrics::histogram("search.embed");
+    static auto &faissLatency = Metrics::histogram("search.faiss");
+    static auto &fetchLatency = Metrics::histogram("search.fetch");
+    static auto &rerankLatency = Metrics::histogram("search.rerank");
+    searchCount.add();
+    Metrics::ScopedTimer totalTimer(totalLatency);
+
+    // no Repository lock, the snapshot keeps these tables and models alive until this search returns,
+    // vector tables are still written by the background thread, see Snapshot
+    auto state = loadSnapshot();
+    const auto &embeddings = state->embeddings;
+    const auto &vectorTables = state->vectorTables;
+    const auto &rerankerModel = state->rerankerModel;
 
     int vectorLimit = limit * 2;
     int fts5Limit = limit * 2 * embeddings.size();
 
     std::vector<SearchResult> allResults; // for all results
 
-    if(query.empty())
+    if(query.empty() || !state->textTable || stopped()) // no text table while reconstructing
     {
         return allResults;
     }
+    TextSearchTable::Highlighter highlighter(query); // keywords are cut once for all phases
+    // all reads of this search see one WAL snapshot, so a commit of the background thread in between cannot remove its chunks,
+    // the read transaction is ended by its destructor on return
+    auto readTransaction = state->sqlite->beginTransaction();
 
     // search in text search table
-    auto textResults = textTable->search(query, fts5Limit);
+    Metrics::ScopedTimer fts5Timer(fts5Latency);
+    auto textResults = state->textTable->search(query, fts5Limit, prefix);
+    fts5Timer.stop();
     std::unordered_map<int64_t, SearchResult> textSearchResultMap; // map to store results, chunkid -> Result
     for(const auto& textResult : textResults)
     {
         SearchResult res;
         res.chunkId = textResult.chunkId;
         res.score = textResult.similarity;
-        res.highlightedContent = textResult.content;
-        res.highlightedMetadata = textResult.metadata;
-        textSearchResultMap[res.chunkId] = res; // store result in map
+        textSearchResultMap[res.chunkId] = res; // store result in map, content is filled for the final results only
+    }
+
+    // report text search results first, they are much faster than embedding and reranking
+    if(onPhase && !textSearchResultMap.empty())
+    {
+        std::vector<SearchResult> textPhaseResults;
+        for(const auto &[chunkId, textResult] : textSearchResultMap)
+        {
+            auto res = textResult;
+            res.score = combineScore(textResult.score, 0.0);
+            textPhaseResults.push_back(res);
+        }
+        fillContent(*state, textPhaseResults);
+        finishResults(*state, highlighter, textPhaseResults, limit);
+        onPhase(searchPhase::text, textPhaseResults);
     }
 
     // search for each embedding
     for(int i = 0; i < embeddings.size(); i++)
     {
+        if(stopped())
+        {
+            return {};
+        }
         auto& embedding = embeddings[i];
         auto& vectorTable = vectorTables[i];
 
         // get embedding for the query
+        Metrics::ScopedTimer embedTimer(embedLatency);
         auto queryVector = embedding->model->embed(query);
+        embedTimer.stop();
         // query the most similar vectors
+        Metrics::ScopedTimer faissTimer(faissLatency);
         auto vectorResults = vectorTable->search(queryVector, vectorLimit);
+        faissTimer.stop();
         // add to results
         for(int j = 0; j < vectorResults.first.size(); j++)
         {
@@ -500,10 +694,9 @@ auto Repository::search(const std::string &query, searchAccuracy acc, int limit)
             }
             else // found
             {
-                res.highlightedContent = textSearchResultMap[res.chunkId].highlightedContent;
-                res.highlightedMetadata = textSearchResultMap[res.chunkId].highlightedMetadata;
                 res.score = combineScore(textSearchResultMap[res.chunkId].score, res.score);
                 textSearchResultMap.erase(res.chunkId);
+                allResults.push_back(res);
             }
         }
     }
@@ -512,7 +705,6 @@ auto Repository::search(const std::string &query, searchAccuracy acc, int limit)
         SearchResult res;
         res.chunkId = textResult.first;
         res.score = combineScore(textResult.second.score, 0.0);
-        res.highlightedContent = textResult.second.highlightedContent;
         allResults.push_back(res);
     }
     if(allResults.empty())
@@ -520,30 +712,72 @@ auto Repository::search(const std::string &query, searchAccuracy acc, int limit)
         return allResults; // no results
     }
 
-    // get content and metadata for each result
-    std::vector<std::string> contents;
-    for (auto &result : allResults)
+    auto uniqueResults = std::move(allResults);
+    Metrics::ScopedTimer fetchTimer(fetchLatency);
+    fillContent(*state, uniqueResults);
+    fetchTimer.stop();
+
+    if(stopped())
+    {
+        return {};
+    }
+
+    // rerank
+    if(acc == searchAccuracy::high && rerankerModel)
     {
-        auto [content, metadata] = textTable->getContent(result.chunkId);
-        if (!content.empty() || !metadata.empty())
+        if(onPhase)
         {
-            result.content = content;
-            result.metadata = metadata;
-            result.highlightedContent = content;
-            result.highlightedMetadata = metadata;
-            contents.push_back(Utils::chunkTosequence(content, metadata));
+            auto fusedResults = uniqueResults;
+            finishResults(*state, highlighter, fusedResults, limit);
+            onPhase(searchPhase::fused, fusedResults);
+            if(stopped())
+            {
+                return {};
+            }
         }
-        else
+        std::vector<std::string> contents;
+        for(const auto &result : uniqueResults)
         {
-            throw Error{"Chunk not found in text_search table, chunk_id: " + std::to_string(result.chunkId),
-                        Error::Type::Database};
+            contents.push_back(Utils::chunkTosequence(result.content, result.metadata));
+        }
+        Metrics::ScopedTimer rerankTimer(rerankLatency);
+        auto scores = rerankerModel->rank(query, contents);
+        rerankTimer.stop();
+        for(int i = 0; i < uniqueResults.size(); i++)
+        {
+            uniqueResults[i].score = scores[i];
         }
     }
 
-    // remove duplicates
+    finishResults(*state, highlighter, uniqueResults, limit);
+    return uniqueResults;
+}
+
+void Repository::fillContent(const Snapshot &state, std::vector<SearchResult> &results)
+{
+    // get content and metadata for each result
+    for (auto &result : results)
+    {
+        auto chunk = state.textTable->getContent(result.chunkId);
+        if (!chunk)
+        {
+            continue; // vector index may still hold a chunk deleted from sqlite, it is removed from results below
+        }
+        auto &[content, metadata] = *chunk;
+        result.content = content;
+        result.metadata = metadata;
+        result.highlightedContent = content;
+        result.highlightedMetadata = metadata;
+    }
+
+    // remove duplicates and chunks not found
     std::vector<SearchResult> uniqueResults;
-    for (const auto &result : allResults)
+    for (const auto &result : results)
     {
+        if (result.content.empty() && result.metadata.empty())
+        {
+            continue;
+        }
         bool found = false;
         for (auto &uniqueResult : uniqueResults)
         {
@@ -566,68 +800,44 @@ auto Repository::search(const std::string &query, searchAccuracy acc, int limit)
             uniqueResults.push_back(result);
         }
     }
+    results = std::move(uniqueResults);
+}
 
-    // rerank
-    if(acc == searchAccuracy::high && rerankerModel)
-    {
-        auto scores = rerankerModel->rank(query, contents);
-        for(int i = 0; i < uniqueResults.size(); i++)
-        {
-            uniqueResults[i].score = scores[i];
-        }
-    }
-
+void Repository::finishResults(const Snapshot &state, const TextSearchTable::Highlighter &highlighter, std::vector<SearchResult> &results, int limit)
+{
     // sort results by score and limit to top N
-    std::sort(uniqueResults.begin(), uniqueResults.end(), [](const SearchResult &a, const SearchResult &b) {
+    std::sort(results.begin(), results.end(), [](const SearchResult &a, const SearchResult &b) {
         return a.score > b.score;
     });
-    if (uniqueResults.size() > limit)
-    {
-        uniqueResults.resize(limit);
-    }
 
-    // get filepath from database
-    auto stmt = sqlite->getStatement("SELECT doc_path FROM documents WHERE id = (SELECT doc_id FROM chunks WHERE chunk_id = ?);");
-    for (auto &result : uniqueResults)
+    // get filepath, begin and end line from database for top N, skip chunks whose document is not in the database
+    std::vector<SearchResult> topResults;
+    auto stmt = state.sqlite->getStatement("SELECT documents.doc_path, chunks.begin_line, chunks.end_line FROM chunks "
+                                           "JOIN documents ON documents.id = chunks.doc_id WHERE chunks.chunk_id = ?;");
+    for (auto &result : results)
     {
+        if (topResults.size() >= limit)
+        {
+            break;
+        }
         stmt.bind(1, result.chunkId);
         if (stmt.step())
         {
             result.filePath = stmt.get<std::string>(0);
-        }
-        else
-        {
-            throw Error{"Chunk not found in documents table, chunk_id: " + std::to_string(result.chunkId), Error::Type::Database};
-
+            result.beginLine = stmt.get<int>(1);
+            result.endLine = stmt.get<int>(2);
+            topResults.push_back(std::move(result));
         }
         stmt.reset();
     }
+    results = std::move(topResults);
 
-    // get begin and end line from database
-    auto lineStmt = sqlite->getStatement("SELECT begin_line, end_line FROM chunks WHERE chunk_id = ?;");
-    for (auto &result : uniqueResults)
-    {
-        lineStmt.bind(1, result.chunkId);
-        if (lineStmt.step())
-        {
-            result.beginLine = lineStmt.get<int>(0);
-            result.endLine = lineStmt.get<int>(1);
-        }
-        else
-        {
-            throw Error{"Chunk not found in chunks table, chunk_id: " + std::to_string(result.chunkId), Error::Type::Database};
-        }
-        lineStmt.reset();
-    }
-
-    // mark keywords again
-    for(auto &result : uniqueResults)
+    // mark keywords
+    for(auto &result : results)
     {
-        result.highlightedContent = TextSearchTable::reHighlight(result.highlightedContent, query);
-        result.highlightedMetadata = TextSearchTable::reHighlight(result.highlightedMetadata, query);
+        result.highlightedContent = highlighter.highlight(result.highlightedContent);
+        result.highlightedMetadata = highlighter.highlight(result.highlightedMetadata);
     }
-
-    return uniqueResults;
 }
 
 void Repository::configEmbedding(const EmbeddingConfigList &configs)
@@ -644,15 +854,43 @@ void Repository::configReranker(const std::filesystem::path &modelPath)
     logger.debug("[Repository.configReranker] begin to config reranker model");
     Utils::LockGuard lock(repoMutex, true, true);
     if(!modelPath.empty())
-        rerankerModel = std::make_shared<RerankerModel>(modelPath, device, maxThreads);
+        rerankerModel = std::make_shared<RerankerModel>(modelPath, device);
+    publishSnapshot();
     logger.debug("[Repository.configReranker] reranker model config done");
 }
 
+std::function<std::vector<int>(const std::string &)> Repository::getTokenizer()
+{
+    auto state = loadSnapshot();
+    // keep the model alive in the returned function, it may be replaced by configReranker or configEmbedding later
+    if(state->rerankerModel)
+        return [model = state->rerankerModel](const std::string &text) { return model->encode(text); };
+    if(!state->embeddings.empty())
+        return [model = state->embeddings[0]->model](const std::string &text) { return model->encode(text); };
+    return nullptr;
+}
+
 void Repository::reConstruct(bool needLock)
 {
+    for (auto &vectorTable : vectorTables)
+    {
+        vectorTable->discardChanges(); // tables are dropped below, searches holding them must not write them back
+    }
     vectorTables.clear();
     textTable.reset();
+    publishSnapshot(); // searches return nothing until updateEmbeddings publishes the rebuilt tables
 
+    dropIndexTables();
+    integrity = true;
+
+    initializeSqlite(needLock);
+    // open text search table
+    textTable = std::make_shared<TextSearchTable>(*sqlite, "text_search");
+    updateEmbeddings({}, needLock);
+}
+
+void Repository::dropIndexTables()
+{
     auto trans = sqlite->beginTransaction();
 
     // drop sql tables
@@ -676,10 +914,4 @@ void Repository::reConstruct(bool needLock)
     }
     // remain embedding configs table
     trans.commit();
-    integrity = true;
-
-    initializeSqlite(needLock);
-    // open text search table
-    textTable = std::make_shared<TextSearchTable>(*sqlite, "text_search");
-    updateEmbeddings({}, needLock);
 }
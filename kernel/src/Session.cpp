@@ -1,12 +1,18 @@
 #include "Session.h"
+#include "ContextPacker.h"
+#include "Executor.h"
 #include "KernelServer.h"
 #include "LLMConv.h"
+#include "Metrics.h"
 #include "Repository.h"
 #include "Utils.h"
 #include <exception>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <algorithm>
+#include <set>
+#include <unordered_map>
 #include <nlohmann/json_fwd.hpp>
 
 //--------------------------Session--------------------------//
@@ -61,12 +67,17 @@ void Session::doneReporter(std::string path)
 // lazy initialization
 Session::Session(int64_t sessionId, std::string repoName, std::filesystem::path repoPath, KernelServer &kernelServer) : sessionId(sessionId), kernelServer(kernelServer), repoName(repoName), repoPath(repoPath)
 {
+    historyWriter = std::make_shared<HistoryWriter>(sessionId);
     conversation = std::make_shared<AugmentedConversation>(repoPath / ".PocketRAG" / "conversation", *this);
     lastprintTime.store(std::chrono::steady_clock::now());
 }
 
 Session::~Session()
-{}
+{
+    requestExecutor = nullptr; // wait for running requests before members are destroyed
+    conversation = nullptr;    // the running conversation appends its history when quitting
+    historyWriter = nullptr;   // write pending history
+}
 
 void Session::sendBack(nlohmann::json &json, std::shared_ptr<Utils::Timer> msgTimer)
 {
@@ -75,6 +86,14 @@ void Session::sendBack(nlohmann::json &json, std::shared_ptr<Utils::Timer> msgTi
     kernelServer.sendMessage(message);
 }
 
+void Session::replyCancelled(Utils::MessageQueue::Message &message, const std::string &reason)
+{
+    auto &json = message.data;
+    json["status"]["code"] = "CANCELLED";
+    json["status"]["message"] = reason;
+    sendBack(json, message.timer);
+}
+
 void Session::send(nlohmann::json& json, Utils::CallbackManager::Callback callback)
 {
     auto callbackId = callbackManager->registerCallback(callback);
@@ -104,8 +123,8 @@ void Session::run(std::function<bool()> stopFlag, Utils::WorkerThread &parent)
         sessionMessageQueue->shutdown();
         Utils::WorkerThread::getCurrentThread()->notify();
     };
-    auto [maxThreads, device] = kernelServer.getPerfConfig();
-    repository = std::make_shared<Repository>(repoName, repoPath, mutex, maxThreads, device, errorCallback, docStateReporter_wrap, progressReporter_wrap, doneReporter_wrap);
+    auto device = kernelServer.getPerfConfig().second; // max threads is applied to the whole kernel by Executor
+    repository = std::make_shared<Repository>(repoName, repoPath, mutex, device, errorCallback, docStateReporter_wrap, progressReporter_wrap, doneReporter_wrap);
     config();
     // initialize sqlite
     auto dbPath = repoPath / ".PocketRAG" / "db";
@@ -121,6 +140,7 @@ void Session::run(std::function<bool()> stopFlag, Utils::WorkerThread &parent)
     send(json, nullptr);
     timer.stop();
     // handle messages
+    requestExecutor = std::make_shared<RequestExecutor>(maxRunningRequests);
     logger.info("[Session] Session " + std::to_string(sessionId) + "(repoName:" + repoName + ") started.");
     std::shared_ptr<Utils::MessageQueue::Message> message = nullptr;
     while (true)
@@ -146,14 +166,71 @@ void Session::run(std::function<bool()> stopFlag, Utils::WorkerThread &parent)
         }
         if(message)
         {
-            handleMessage(*message);
+            auto &data = message->data;
+            bool isReply = data.contains("isReply") && data["isReply"].is_boolean() && data["isReply"].get<bool>();
+            std::string type = (data.contains("message") && data["message"].contains("type") && data["message"]["type"].is_string()) ? data["message"]["type"].get<std::string>() : "";
+            if(!isReply && isConcurrentRequest(type))
+            {
+                // token is created in arrival order, so a queued older request is also cancelled
+                auto token = isCancellableRequest(type) ? renewToken(type) : nullptr;
+                requestExecutor->submit([this, message, token]() { handleMessage(*message, token); },
+                    [this, message]() { replyCancelled(*message, "Request is cancelled because the session is closing"); });
+            }
+            else
+            {
+                handleMessage(*message);
+            }
             message = nullptr;
         }
     }
+    requestExecutor = nullptr;
     logger.info("[Session] Session " + std::to_string(sessionId) + "(repoName:" + repoName + ") quitted.");
 }
 
-void Session::handleMessage(Utils::MessageQueue::Message &message)
+auto Session::renewToken(const std::string &type) -> CancelToken
+{
+    auto token = std::make_shared<std::atomic<bool>>(false);
+    std::lock_guard<std::mutex> lock(tokenMutex);
+    auto &latest = latestTokens[type];
+    if(latest)
+    {
+        latest->store(true);
+    }
+    latest = token;
+    return token;
+}
+
+nlohmann::json Session::searchResultsToJson(const std::vector<Repository::SearchResult> &results)
+{
+    auto resultsJson = nlohmann::json::array();
+    for (auto &result : results) 
+    {
+        nlohmann::json resultJson;
+        resultJson["score"] = result.score;
+        resultJson["content"] = result.content;
+        resultJson["metadata"] = result.metadata;
+        resultJson["filePath"] = result.filePath;
+        resultJson["beginLine"] = result.beginLine;
+        resultJson["endLine"] = result.endLine;
+        resultJson["highlightedContent"] = result.highlightedContent;
+        resultJson["highlightedMetadata"] = result.highlightedMetadata;
+        resultsJson.push_back(resultJson);
+    }
+    return resultsJson;
+}
+
+bool Session::isConcurrentRequest(const std::string &type)
+{
+    // conversation and config messages are handled in order in session thread, they are fast and order sensitive
+    return type == "search" || type == "getChunksInfo" || type == "getApiUsage";
+}
+
+bool Session::isCancellableRequest(const std::string &type)
+{
+    return type == "search";
+}
+
+void Session::handleMessage(Utils::MessageQueue::Message &message, CancelToken token)
 {
     auto& json = message.data;
     auto js = json.dump(); // for debug
@@ -172,23 +249,37 @@ void Session::handleMessage(Utils::MessageQueue::Message &message)
             auto limit = kernelServer.getSearchLimit();
             auto acc = message.data["message"]["accuracy"].get<bool>();
             auto accuracy = acc ? Repository::searchAccuracy::high : Repository::searchAccuracy::low;
-            auto results = repository->search(query, accuracy, limit);
-            auto resultsJson = nlohmann::json::array();
-            for (auto &result : results) 
+            bool prefix = message.data["message"].contains("prefix") && message.data["message"]["prefix"].get<bool>();
+            auto cancelled = [token]() { return token && token->load(); };
+            // incremental search sends partial results with the same callbackId before the final result
+            Repository::PhaseCallback onPhase = nullptr;
+            if(message.data["message"].contains("incremental") && message.data["message"]["incremental"].get<bool>())
             {
-                nlohmann::json resultJson;
-                resultJson["score"] = result.score;
-                resultJson["content"] = result.content;
-                resultJson["metadata"] = result.metadata;
-                resultJson["filePath"] = result.filePath;
-                resultJson["beginLine"] = result.beginLine;
-                resultJson["endLine"] = result.endLine;
-                resultJson["highlightedContent"] = result.highlightedContent;
-                resultJson["highlightedMetadata"] = result.highlightedMetadata;
-                resultsJson.push_back(resultJson);
+                onPhase = [this, &json, &cancelled](Repository::searchPhase phase, std::vector<Repository::SearchResult> &results) {
+                    if(cancelled())
+                    {
+                        return;
+                    }
+                    nlohmann::json partialJson = json;
+                    partialJson["data"] = nlohmann::json::object();
+                    partialJson["data"]["results"] = searchResultsToJson(results);
+                    partialJson["data"]["type"] = "partial";
+                    partialJson["data"]["phase"] = phase == Repository::searchPhase::text ? "text" : "fused";
+                    partialJson["status"]["code"] = "SUCCESS";
+                    partialJson["status"]["message"] = "";
+                    sendBack(partialJson);
+                };
+            }
+            auto results = repository->search(query, accuracy, limit, cancelled, onPhase, prefix);
+            if(cancelled())
+            {
+                static auto &cancelledCount = Metrics::counter("search.cancelled");
+                cancelledCount.add();
+                replyCancelled(message, "Search is cancelled by a newer search: " + query);
+                return;
             }
             json["data"] = nlohmann::json::object();
-            json["data"]["results"] = resultsJson;
+            json["data"]["results"] = searchResultsToJson(results);
             json["data"]["type"] = "result";
             json["status"]["code"] = "SUCCESS";
             json["status"]["message"] = "";
@@ -262,7 +353,7 @@ void Session::handleMessage(Utils::MessageQueue::Message &message)
             };
             try
             {
-                conversation->openConversation(kernelServer.getLLMConv(modelName), sendBack, query, conversationId, kernelServer.getHistoryLength());
+                conversation->openConversation(kernelServer.getLLMConv(modelName), sendBack, query, conversationId, kernelServer.getHistoryLength(), kernelServer.getContextTokens());
                 json["status"]["code"] = "SUCCESS";
                 json["status"]["message"] = "";
             }
@@ -309,26 +400,84 @@ void Session::handleMessage(Utils::MessageQueue::Message &message)
         }
         else if(type == "getChunksInfo")
         {
+            // keyset pagination on chunk_id, only one page is materialized at a time
+            auto &request = json["message"];
+            int64_t afterChunkId = request.contains("afterChunkId") ? request["afterChunkId"].get<int64_t>() : -1;
+            int limit = request.contains("limit") ? request["limit"].get<int>() : defaultChunksInfoLimit;
+            limit = std::clamp(limit, 1, maxChunksInfoLimit);
+            std::set<std::string> fields(chunksInfoFields.begin(), chunksInfoFields.end());
+            if(request.contains("fields"))
+            {
+                fields.clear();
+                for(auto &field : request["fields"])
+                {
+                    auto name = field.get<std::string>();
+                    if(std::find(chunksInfoFields.begin(), chunksInfoFields.end(), name) == chunksInfoFields.end())
+                        throw Error{"Unknown field of getChunksInfo: " + name, Error::Type::Input};
+                    fields.insert(name);
+                }
+            }
+            bool needContent = fields.contains("content") || fields.contains("metadata");
+
             Utils::LockGuard lock(mutex, true, false);
+            // fetch one more row to know if there are more pages
             auto stmt = sqlite->getStatement(
-                "SELECT c.chunk_id, c.begin_line, c.end_line, d.doc_path, e.config_name, t.content, t.metadata "
-                "FROM chunks c, text_search t, documents d, embedding_config e "
-                "WHERE c.chunk_id = t.chunkId AND c.doc_id = d.id AND c.embedding_id = e.id;"
+                "SELECT c.chunk_id, c.begin_line, c.end_line, d.doc_path, "
+                "COALESCE((SELECT GROUP_CONCAT(e.config_name, ', ') FROM embedding_config e " // a chunk is shared by embeddings with the same chunk length
+                "WHERE e.valid = 1 AND e.chunk_length = c.chunk_length), '') "
+                "FROM chunks c JOIN documents d ON c.doc_id = d.id "
+                "WHERE c.chunk_id > ? ORDER BY c.chunk_id LIMIT ?;"
             );
+            stmt.bind(1, afterChunkId);
+            stmt.bind(2, limit + 1);
             nlohmann::json chunksInfoJson = nlohmann::json::array();
+            std::unordered_map<int64_t, size_t> chunkIndex; // chunk id -> index in chunksInfoJson
+            bool hasMore = false;
+            int64_t lastChunkId = afterChunkId;
             while (stmt.step())
             {
-                nlohmann::json chunkInfo;
-                chunkInfo["chunkId"] = stmt.get<int64_t>(0);
-                chunkInfo["beginLine"] = stmt.get<int>(1);
-                chunkInfo["endLine"] = stmt.get<int>(2);
-                chunkInfo["filePath"] = stmt.get<std::string>(3);
-                chunkInfo["embeddingName"] = stmt.get<std::string>(4);
-                chunkInfo["content"] = stmt.get<std::string>(5);
-                chunkInfo["metadata"] = stmt.get<std::string>(6);
-                chunksInfoJson.push_back(chunkInfo);
+                if(chunksInfoJson.size() == static_cast<size_t>(limit))
+                {
+                    hasMore = true;
+                    break;
+                }
+                nlohmann::json chunkInfo = nlohmann::json::object();
+                lastChunkId = stmt.get<int64_t>(0);
+                if(fields.contains("chunkId"))
+                    chunkInfo["chunkId"] = lastChunkId;
+                if(fields.contains("beginLine"))
+                    chunkInfo["beginLine"] = stmt.get<int>(1);
+                if(fields.contains("endLine"))
+                    chunkInfo["endLine"] = stmt.get<int>(2);
+                if(fields.contains("filePath"))
+                    chunkInfo["filePath"] = stmt.get<std::string>(3);
+                if(fields.contains("embeddingName"))
+                    chunkInfo["embeddingName"] = stmt.get<std::string>(4);
+                chunkIndex[lastChunkId] = chunksInfoJson.size();
+                chunksInfoJson.push_back(std::move(chunkInfo));
             }
-            json["data"]["chunkInfo"] = chunksInfoJson;
+            // get content of this page in one range scan on rowid (chunk id), the same keyset as chunks,
+            // skipped if only metadata of chunks is requested
+            if(needContent && !chunkIndex.empty())
+            {
+                auto contentStmt = sqlite->getStatement("SELECT rowid, content, metadata FROM text_search WHERE rowid > ? AND rowid <= ? ORDER BY rowid;");
+                contentStmt.bind(1, afterChunkId);
+                contentStmt.bind(2, lastChunkId);
+                while(contentStmt.step())
+                {
+                    auto it = chunkIndex.find(contentStmt.get<int64_t>(0));
+                    if(it == chunkIndex.end())
+                        continue;
+                    auto &chunkInfo = chunksInfoJson[it->second];
+                    if(fields.contains("content"))
+                        chunkInfo["content"] = contentStmt.get<std::string>(1);
+                    if(fields.contains("metadata"))
+                        chunkInfo["metadata"] = contentStmt.get<std::string>(2);
+                }
+            }
+            json["data"]["chunkInfo"] = std::move(chunksInfoJson);
+            json["data"]["nextChunkId"] = lastChunkId;
+            json["data"]["hasMore"] = hasMore;
             json["status"]["code"] = "SUCCESS";
             json["status"]["message"] = "";
         }
@@ -344,6 +493,11 @@ void Session::handleMessage(Utils::MessageQueue::Message &message)
         json["status"]["message"] =
             "Invalid message format, parser error: " + std::string(e.what());
     } 
+    catch (const Error &e)
+    {
+        json["status"]["code"] = e.getType() == Error::Type::Input ? "WRONG_PARAM" : "UNKNOWN_ERROR";
+        json["status"]["message"] = e.what();
+    }
     catch (std::exception &e) 
     {
         json["status"]["code"] = "UNKNOWN_ERROR";
@@ -426,6 +580,175 @@ void Session::sendMessage(const std::shared_ptr<Utils::MessageQueue::Message>& m
     sessionMessageQueue->push(message);
 }
 
+//--------------------------RequestExecutor--------------------------//
+// pending requests of all sessions
+static Metrics::Gauge &requestQueueDepth = Metrics::gauge("session.requestQueue.depth");
+
+Session::RequestExecutor::RequestExecutor(int maxRunning) : maxRunning(maxRunning)
+{
+}
+
+Session::RequestExecutor::~RequestExecutor()
+{
+    std::queue<Request> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdownFlag = true;
+        requestQueueDepth.add(-static_cast<int64_t>(tasks.size()));
+        pending.swap(tasks);
+    }
+    // the frontend waits for a reply of every request, so pending ones are answered as cancelled
+    for(; !pending.empty(); pending.pop())
+    {
+        cancelRequest(pending.front());
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]() { return running == 0; });
+}
+
+void Session::RequestExecutor::cancelRequest(Request &request)
+{
+    try
+    {
+        request.cancel();
+    }
+    catch(const std::exception &e)
+    {
+        logger.warning("[Session.RequestExecutor] cancel error: " + std::string(e.what()));
+    }
+}
+
+void Session::RequestExecutor::submit(std::function<void()> task, std::function<void()> cancel)
+{
+    Request request{std::move(task), std::move(cancel)};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!shutdownFlag)
+        {
+            tasks.push(std::move(request));
+            requestQueueDepth.add(1);
+            schedule();
+            return;
+        }
+    }
+    cancelRequest(request);
+}
+
+void Session::RequestExecutor::schedule()
+{
+    while(!shutdownFlag && running < maxRunning && !tasks.empty())
+    {
+        auto task = std::move(tasks.front().run);
+        tasks.pop();
+        requestQueueDepth.add(-1);
+        running++;
+        Executor::instance().post(Executor::Priority::interactive, [this, task = std::move(task)]() {
+            try
+            {
+                task(); // handleMessage catches all exceptions and replies with error status
+            }
+            catch(const std::exception &e)
+            {
+                logger.warning("[Session.RequestExecutor] request error: " + std::string(e.what()));
+            }
+            catch(...)
+            {
+                // the slot must be released whatever is thrown, or the destructor waits forever
+                logger.warning("[Session.RequestExecutor] request error: unknown exception");
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            schedule();
+            cv.notify_all(); // notify with mutex locked, the destructor may return as soon as it is released
+        });
+    }
+}
+
+//--------------------------HistoryWriter--------------------------//
+Session::HistoryWriter::HistoryWriter(int64_t sessionId)
+{
+    thread = std::make_shared<Utils::WorkerThread>("Session" + std::to_string(sessionId) + " history",
+        [this](std::function<bool()> retFlag, Utils::WorkerThread &) { writeLoop(); },
+        [](const std::exception &e) { logger.warning("[Session.HistoryWriter] history thread error: " + std::string(e.what())); });
+    thread->start();
+}
+
+Session::HistoryWriter::~HistoryWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdownFlag = true;
+    }
+    cv.notify_all();
+    thread = nullptr; // writeLoop returns after pending lines are written
+}
+
+void Session::HistoryWriter::append(const std::filesystem::path &path, const std::string &line)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[path] += line + "\n";
+        appendedCount++;
+    }
+    cv.notify_all();
+}
+
+void Session::HistoryWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto target = appendedCount;
+    if (writtenCount >= target)
+    {
+        return;
+    }
+    flushRequested = true;
+    cv.notify_all();
+    writtenCv.wait(lock, [this, target]() { return writtenCount >= target; });
+}
+
+void Session::HistoryWriter::writeLoop()
+{
+    while (true)
+    {
+        std::map<std::filesystem::path, std::string> files;
+        uint64_t count = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return shutdownFlag || !pending.empty(); });
+            if (pending.empty()) // shutdown and nothing left
+            {
+                return;
+            }
+            // debounce, lines appended in the interval are written together
+            cv.wait_for(lock, debounceInterval, [this]() { return shutdownFlag || flushRequested; });
+            files.swap(pending);
+            count = appendedCount;
+            flushRequested = false;
+        }
+        writeFiles(files);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            writtenCount = count;
+        }
+        writtenCv.notify_all();
+    }
+}
+
+void Session::HistoryWriter::writeFiles(const std::map<std::filesystem::path, std::string> &files)
+{
+    for (const auto &[path, lines] : files)
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::app);
+        if (!file.is_open())
+        {
+            logger.warning("[Session.HistoryWriter] Error opening history file for appending at " + path.string() +
+                           ". History will not be saved.");
+            continue;
+        }
+        file << lines;
+    }
+}
+
 //--------------------------AugmentedConversaion--------------------------//
 Session::AugmentedConversation::AugmentedConversation(std::filesystem::path historyDirPath, Session& session) : historyDirPath(historyDirPath), session(session)
 {
@@ -464,6 +787,9 @@ You are a search query optimizer. Generate the most effective search keywords fo
         tokenUsage = tokenUsage + conversation->getLastResponseUsage();
         auto searchWords = Utils::splitLine(extractSearchword(searchWord));
         int searchCount = 0;
+        // retrieved content of all searches shares one token budget
+        ContextPacker contextPacker(session.repository->getTokenizer());
+        int remainingTokens = maxContextTokens;
         // recursive search
         while(searchCount < 3 && !searchWords.empty())
         {
@@ -473,6 +799,7 @@ You are a search query optimizer. Generate the most effective search keywords fo
                 return;
             std::string toolContent = "```retieved_information\n";
             std::unordered_set<int64_t> chunkIds{}; // to avoid duplicate chunks
+            std::vector<Repository::SearchResult> candidates;
             for (auto &word : searchWords)
             {
                 historyManager.push(Type::search, word);
@@ -481,14 +808,19 @@ You are a search query optimizer. Generate the most effective search keywords fo
                 {
                     if(chunkIds.find(result.chunkId) != chunkIds.end())
                         continue;
-                    toolContent += "[content]\n" + result.content + "\n";
-                    toolContent += "[metadata]\n" + result.metadata + "\n";
                     historyManager.push(Type::result, result);
                     chunkIds.insert(result.chunkId);
+                    candidates.push_back(std::move(result));
                 }
                 if (stopFlag())
                     return;
             }
+            // only the most relevant and diverse content within the budget is sent to the model
+            for (const auto &block : contextPacker.pack(candidates, remainingTokens))
+            {
+                toolContent += ContextPacker::format(block);
+                remainingTokens -= block.tokenCount;
+            }
             toolContent += "```\n";
             historyManager.endRetrieval();
             // 3. evaluate the search results
@@ -556,13 +888,14 @@ std::string Session::AugmentedConversation::extractSearchword(const std::string
     return answer.substr(iterQuery, iterEnd - iterQuery);
 }
 
-void Session::AugmentedConversation::openConversation(std::shared_ptr<LLMConv> conv, std::function<void(std::string, Type)> sendBack, std::string prompt, int64_t conversationId, int historyLength)
+void Session::AugmentedConversation::openConversation(std::shared_ptr<LLMConv> conv, std::function<void(std::string, Type)> sendBack, std::string prompt, int64_t conversationId, int historyLength, int contextTokens)
 {
     conversation = conv;
     this->sendBack = sendBack;
     this->conversationId = conversationId;
     this->query = prompt;
     this->maxHistoryLength = historyLength;
+    this->maxContextTokens = contextTokens;
     if (conversationThread && conversationThread->isActive())
     {
         conversationThread->start();
@@ -592,61 +925,42 @@ void Session::AugmentedConversation::stopConversation()
 Session::AugmentedConversation::HistoryManager::HistoryManager(AugmentedConversation &parent)
     : parent(parent), tempJson(nlohmann::json::object())
 {
-    // load history file
-    historyFilePath = parent.historyDirPath / ("conversation-" + std::to_string(parent.conversationId) + ".json");
-    if (std::filesystem::exists(historyFilePath))
-    {
-        historyJson = Utils::readJsonFile(historyFilePath);
-        logger.info("[Conversation] Loaded history file at " + historyFilePath.string());
-    }
-    else
+    auto filePrefix = "conversation-" + std::to_string(parent.conversationId);
+    historyFilePath = parent.historyDirPath / (filePrefix + ".jsonl");
+    fullHistoryFilePath = parent.historyDirPath / (filePrefix + "_full.jsonl");
+    parent.session.historyWriter->flush(); // the last turn of this conversation may not be written yet
+    migrateLegacyHistory(filePrefix);
+
+    // create history file with header line
+    if (!std::filesystem::exists(historyFilePath))
     {
-        historyJson["history"] = nlohmann::json::array();
-        historyJson["conversationId"] = parent.conversationId;
-        historyJson["topic"] = parent.query;
-        std::ofstream file(historyFilePath);
-        if (!file.is_open())
-        {
-            logger.warning("[Conversation] Error opening history file at " + historyFilePath.string() +
-                           ". Using empty history, and will write above history file.");
-            return;
-        }
-        file << historyJson.dump(4);
+        nlohmann::json headerJson = nlohmann::json::object();
+        headerJson["conversationId"] = parent.conversationId;
+        headerJson["topic"] = parent.query;
+        parent.session.historyWriter->append(historyFilePath, headerJson.dump());
         logger.info("[Conversation] Created history file at " + historyFilePath.string());
     }
-    // load full history file
-    fullHistoryFilePath = parent.historyDirPath / ("conversation-" + std::to_string(parent.conversationId) + "_full.json");
-    if (std::filesystem::exists(fullHistoryFilePath))
-    {
-        historyMessagesJson = Utils::readJsonFile(fullHistoryFilePath);
-        logger.info("[Conversation] Loaded full history file at " + fullHistoryFilePath.string());
-    }
-    else
-    {
-        historyMessagesJson = {};
-    }
-    try
-    {
-        int historyLength = 0;
-        for(auto it = historyMessagesJson.rbegin(); it != historyMessagesJson.rend(); it++)
+
+    // load the tail of full history file
+    int historyLength = 0;
+    readLinesBackward(fullHistoryFilePath, [this, &parent, &historyLength](const std::string &line) {
+        try
         {
-            auto message = *it;
+            auto message = nlohmann::json::parse(line);
             auto role = message["role"].get<std::string>();
             auto content = message["content"].get<std::string>();
             historyMessages.push_back({role, content});
             historyLength += content.size();
-            if (parent.maxHistoryLength != 0 && historyLength > parent.maxHistoryLength)
-            {
-                break;
-            }
         }
-        std::reverse(historyMessages.begin(), historyMessages.end());
-    }
-    catch (nlohmann::json::exception &e)
-    {
-        logger.warning("[Conversation] Error parsing full history file at " + fullHistoryFilePath.string() +
-                       ". Using empty history for conversation and will write above  full history file.");
-    }
+        catch (nlohmann::json::exception &e)
+        {
+            // such as a line partly written when the app crashed
+            logger.warning("[Conversation] Skipped broken line in full history file at " + fullHistoryFilePath.string() + ": " + e.what());
+        }
+        return parent.maxHistoryLength == 0 || historyLength <= parent.maxHistoryLength;
+    });
+    std::reverse(historyMessages.begin(), historyMessages.end());
+    importedMessageCount = historyMessages.size();
     conversationJson = nlohmann::json::object();
     conversationJson["query"] = parent.query;
 
@@ -678,36 +992,18 @@ Session::AugmentedConversation::HistoryManager::~HistoryManager()
                 " thread quitted."); // deconstruct of history manager indicates cconversation thread has quitted
     parent.sendBack("", Type::done);
     conversationJson["time"] = Utils::getTimeStamp();
-    // write history file
-    std::ofstream file(historyFilePath);
-    if (!file.is_open())
-    {
-        logger.warning("[Conversation] Error opening history file for writing at " + historyFilePath.string() +
-                       ". History will not be saved.");
-        return;
-    }
-    historyJson["history"].push_back(conversationJson);
-    file << historyJson.dump(4);
-    logger.info("[Conversation] Saved history file at " + historyFilePath.string());
-    // write full history file
+    // append this turn to history files
+    auto &historyWriter = *parent.session.historyWriter;
+    historyWriter.append(historyFilePath, conversationJson.dump());
     historyMessages = parent.conversation->exportHistory();
-    historyMessagesJson = nlohmann::json::array();
-    for (auto &message : historyMessages)
+    for (size_t i = importedMessageCount; i < historyMessages.size(); i++) // imported messages are already in the file
     {
         nlohmann::json messageJson = nlohmann::json::object();
-        messageJson["role"] = message.role;
-        messageJson["content"] = message.content;
-        historyMessagesJson.push_back(messageJson);
-    }
-    std::ofstream fullFile(fullHistoryFilePath);
-    if (!fullFile.is_open())
-    {
-        logger.warning("[Conversation] Error opening full history file for writing at " + fullHistoryFilePath.string() +
-                       ". Full history will not be saved.");
-        return;
+        messageJson["role"] = historyMessages[i].role;
+        messageJson["content"] = historyMessages[i].content;
+        historyWriter.append(fullHistoryFilePath, messageJson.dump());
     }
-    fullFile << historyMessagesJson.dump(4);
-    logger.info("[Conversation] Saved full history file at " + fullHistoryFilePath.string());
+    logger.info("[Conversation] Saving history of conversation id" + std::to_string(parent.conversationId) + " at " + historyFilePath.string());
 
     // update sqlite
     try
@@ -769,6 +1065,102 @@ std::vector<LLMConv::Message> Session::AugmentedConversation::HistoryManager::ge
     return historyMessages;
 }
 
+// convert history files written by older versions, which rewrote the whole json document on every turn
+void Session::AugmentedConversation::HistoryManager::migrateLegacyHistory(const std::string &filePrefix)
+{
+    auto legacyFilePath = parent.historyDirPath / (filePrefix + ".json");
+    auto legacyFullFilePath = parent.historyDirPath / (filePrefix + "_full.json");
+    if (!std::filesystem::exists(legacyFilePath) || std::filesystem::exists(historyFilePath))
+    {
+        return;
+    }
+    try
+    {
+        {
+            auto legacyJson = Utils::readJsonFile(legacyFilePath);
+            std::ofstream file(historyFilePath, std::ios::binary);
+            if (!file.is_open())
+            {
+                throw Error{"Failed to open " + historyFilePath.string(), Error::Type::FileAccess};
+            }
+            nlohmann::json headerJson = nlohmann::json::object();
+            headerJson["conversationId"] = parent.conversationId;
+            headerJson["topic"] = legacyJson.value("topic", parent.query);
+            file << headerJson.dump() << "\n";
+            for (const auto &turn : legacyJson.value("history", nlohmann::json::array()))
+            {
+                file << turn.dump() << "\n";
+            }
+        }
+        if (std::filesystem::exists(legacyFullFilePath))
+        {
+            auto legacyFullJson = Utils::readJsonFile(legacyFullFilePath);
+            std::ofstream fullFile(fullHistoryFilePath, std::ios::binary);
+            if (!fullFile.is_open())
+            {
+                throw Error{"Failed to open " + fullHistoryFilePath.string(), Error::Type::FileAccess};
+            }
+            for (const auto &message : legacyFullJson)
+            {
+                fullFile << message.dump() << "\n";
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        // keep legacy files, so conversion is tried again next time
+        std::error_code ec;
+        std::filesystem::remove(historyFilePath, ec);
+        std::filesystem::remove(fullHistoryFilePath, ec);
+        logger.warning("[Conversation] Failed to convert legacy history file at " + legacyFilePath.string() + ": " + e.what());
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::remove(legacyFilePath, ec);
+    std::filesystem::remove(legacyFullFilePath, ec);
+    logger.info("[Conversation] Converted legacy history file at " + legacyFilePath.string());
+}
+
+void Session::AugmentedConversation::HistoryManager::readLinesBackward(const std::filesystem::path &path, const std::function<bool(const std::string &)> &callback)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return;
+    }
+    constexpr std::streamoff blockSize = 64 * 1024;
+    file.seekg(0, std::ios::end);
+    std::streamoff position = file.tellg();
+    std::string rest; // beginning of the last line read, which may continue in the previous block
+    while (position > 0)
+    {
+        auto size = std::min(blockSize, position);
+        position -= size;
+        std::string block(size, '\0');
+        file.seekg(position);
+        file.read(block.data(), size);
+        block += rest;
+        size_t lineEnd = block.size();
+        for (size_t i = block.size(); i-- > 0;)
+        {
+            if (block[i] != '\n')
+            {
+                continue;
+            }
+            if (lineEnd > i + 1 && !callback(block.substr(i + 1, lineEnd - i - 1)))
+            {
+                return;
+            }
+            lineEnd = i;
+        }
+        rest = block.substr(0, lineEnd);
+    }
+    if (!rest.empty())
+    {
+        callback(rest);
+    }
+}
+
 void Session::AugmentedConversation::HistoryManager::push(Type type, const std::string &content)
 {
     switch (type)
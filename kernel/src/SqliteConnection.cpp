@@ -42,6 +42,9 @@ void SqliteConnection::openSqlite(LocalData &data)
     jiebaTokenizer::register_jieba_tokenizer(data.sqliteDB);
 
     sqlite3_busy_timeout(data.sqliteDB, 10000); // set busy timeout to 10 seconds
+
+    // truncate the WAL file to this size after it is reset, or it keeps the size of the largest transaction
+    sqlite3_exec(data.sqliteDB, "PRAGMA journal_size_limit = 67108864;", nullptr, nullptr, nullptr);
 }
 
 SqliteConnection::SqliteConnection(const std::string &dbDirPath, const std::string &dbName) : dbDirPath(dbDirPath), dbName(dbName)
@@ -52,6 +55,7 @@ SqliteConnection::SqliteConnection(const std::string &dbDirPath, const std::stri
         std::filesystem::create_directories(dbDirPath);
 
     // activate thread safety mode
+    execute("PRAGMA auto_vacuum=INCREMENTAL;"); // only takes effect for new databases, free pages are returned by SqliteMaintenance
     execute("PRAGMA journal_mode=WAL;");      // set journal mode to WAL for better concurrency
     logger.info("[SQLite] SQLite database opened at " + (this->dbDirPath / (dbName + ".db")).string());
 }
@@ -78,6 +82,12 @@ int64_t SqliteConnection::getLastInsertId()
     return sqlite3_last_insert_rowid(sqliteDB); // get the last insert id from the database handle
 }
 
+int64_t SqliteConnection::getTotalChanges()
+{
+    auto sqliteDB = dataManager.get(this).sqliteDB; 
+    return sqlite3_total_changes64(sqliteDB);
+}
+
 auto SqliteConnection::getStatement(const std::string &sql) -> Statement
 {
     auto sqliteDB = dataManager.get(this).sqliteDB; 
@@ -0,0 +1,108 @@
+#include "SqliteMaintenance.h"
+
+#include "Metrics.h"
+#include "Utils.h"
+
+nlohmann::json SqliteMaintenance::Report::toJson() const
+{
+    return {{"checkpointedBytes", checkpointedBytes}, {"mergeSteps", mergeSteps}, {"freedBytes", freedBytes}, {"finished", finished}};
+}
+
+SqliteMaintenance::SqliteMaintenance(SqliteConnection &sqlite) : sqlite(sqlite)
+{
+}
+
+int64_t SqliteMaintenance::pragmaValue(const std::string &pragma)
+{
+    auto stmt = sqlite.getStatement("PRAGMA " + pragma + ";");
+    if (!stmt.step())
+        return 0;
+    return stmt.get<int64_t>(0);
+}
+
+bool SqliteMaintenance::due() const
+{
+    auto wait = lastFinished ? std::chrono::steady_clock::duration(interval) : std::chrono::steady_clock::duration(retryInterval);
+    return std::chrono::steady_clock::now() - lastRun >= wait;
+}
+
+void SqliteMaintenance::checkpoint(Report &report)
+{
+    // PASSIVE never waits for readers, searches read without the repository lock and may hold the WAL at any time,
+    // the file is truncated to journal_size_limit by the next write that resets the WAL after this checkpoint,
+    // so its size does not change here, the row (busy, log, checkpointed) tells how many frames were copied
+    auto pageSize = pragmaValue("page_size");
+    auto stmt = sqlite.getStatement("PRAGMA wal_checkpoint(PASSIVE);");
+    int64_t frames = 0;
+    if (stmt.step())
+        frames = std::max<int64_t>(stmt.get<int64_t>(2), 0); // -1 if the database is not in WAL mode
+    stmt.reset();
+    report.checkpointedBytes = frames * pageSize;
+}
+
+bool SqliteMaintenance::merge(TextSearchTable &textTable, Report &report, const std::function<bool()> &outOfTime)
+{
+    while (true)
+    {
+        if (outOfTime())
+            return false;
+        if (!textTable.merge(mergePages))
+            return true;
+        report.mergeSteps++;
+    }
+}
+
+bool SqliteMaintenance::vacuum(Report &report, const std::function<bool()> &outOfTime)
+{
+    // databases created by older versions are not INCREMENTAL, converting them needs a full VACUUM,
+    // which has no time budget, so it is never done here, their free pages are reused by later inserts
+    if (pragmaValue("auto_vacuum") != 2)
+        return true;
+
+    auto pageSize = pragmaValue("page_size");
+    auto freePages = pragmaValue("freelist_count");
+
+    while (freePages > 0)
+    {
+        if (outOfTime())
+            return false;
+        sqlite.execute("PRAGMA incremental_vacuum(" + std::to_string(vacuumPages) + ");");
+        auto remaining = pragmaValue("freelist_count");
+        report.freedBytes += (freePages - remaining) * pageSize;
+        if (remaining >= freePages)
+            break; // nothing freed, avoid looping forever
+        freePages = remaining;
+    }
+    return true;
+}
+
+auto SqliteMaintenance::run(TextSearchTable &textTable, std::function<bool()> stopFlag) -> Report
+{
+    static auto &maintenanceLatency = Metrics::histogram("sqlite.maintenance");
+    static auto &checkpointedBytes = Metrics::counter("sqlite.maintenance.checkpointedBytes");
+    static auto &mergeSteps = Metrics::counter("sqlite.maintenance.mergeSteps");
+    static auto &freedBytes = Metrics::counter("sqlite.maintenance.freedBytes");
+    Metrics::ScopedTimer timer(maintenanceLatency);
+
+    Report report;
+    lastRun = std::chrono::steady_clock::now();
+    lastFinished = false;
+    if (sqlite.inTransaction())
+        return report; // checkpoint and vacuum can not run in a transaction
+
+    auto deadline = lastRun + timeBudget;
+    auto outOfTime = [&deadline, &stopFlag]() { return std::chrono::steady_clock::now() >= deadline || (stopFlag && stopFlag()); };
+
+    // merge and vacuum write pages to the WAL, so checkpoint at last
+    report.finished = merge(textTable, report, outOfTime) && vacuum(report, outOfTime);
+    if (!(stopFlag && stopFlag()))
+        checkpoint(report);
+    lastFinished = report.finished;
+
+    checkpointedBytes.add(report.checkpointedBytes);
+    mergeSteps.add(report.mergeSteps);
+    freedBytes.add(report.freedBytes);
+    if (report.checkpointedBytes > 0 || report.mergeSteps > 0 || report.freedBytes > 0)
+        logger.info("[SqliteMaintenance.run] " + report.toJson().dump());
+    return report;
+}
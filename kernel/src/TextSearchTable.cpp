@@ -1,5 +1,6 @@
 #include "TextSearchTable.h"
 #include "Utils.h"
+#include <algorithm>
 #include <string>
 
 //-----------------------TextSearchTable---------------------//
@@ -9,29 +10,85 @@ const std::string TextSearchTable::ResultChunk::HIGHLIGHT_ENDS = "</mark>";
 TextSearchTable::TextSearchTable(SqliteConnection &sqlite, const std::string &tableName): sqlite(sqlite), tableName(tableName)
 {
     // create the FTS5 table if it does not exist
-    sqlite.execute("CREATE VIRTUAL TABLE IF NOT EXISTS " + tableName + " USING fts5("
+    sqlite.execute(createTableSql(tableName));
+    migrateTable();
+
+    // docsize is a small shadow table with one row per chunk, much faster to count than the fts5 table
+    auto countStmt = sqlite.getStatement("SELECT COUNT(*) FROM " + tableName + "_docsize;");
+    countStmt.step();
+    rowCount = countStmt.get<int64_t>(0);
+}
+
+std::string TextSearchTable::createTableSql(const std::string &tableName)
+{
+    return "CREATE VIRTUAL TABLE IF NOT EXISTS " + tableName + " USING fts5("
         "content, "
         "metadata, "
-        "chunkId UNINDEXED,"
-        "tokenize='jieba');"
-    );
+        "tokenize='jieba', "
+        "prefix='2 3');"; // prefix lengths in characters, see class comment for the cost on CJK text
+}
+
+void TextSearchTable::migrateTable()
+{
+    bool hasChunkIdColumn = false;
+    auto columnStmt = sqlite.getStatement("PRAGMA table_info(" + tableName + ");");
+    while(columnStmt.step())
+    {
+        if(columnStmt.get<std::string>(1) == "chunkId")
+        {
+            hasChunkIdColumn = true;
+        }
+    }
+    // options of a FTS5 table can not be altered, they are only kept in the CREATE statement
+    bool hasPrefixIndex = false;
+    auto sqlStmt = sqlite.getStatement("SELECT sql FROM sqlite_master WHERE type = 'table' AND name = ?;");
+    sqlStmt.bind(1, tableName);
+    if(sqlStmt.step())
+    {
+        hasPrefixIndex = sqlStmt.get<std::string>(0).find("prefix=") != std::string::npos;
+    }
+    if(!hasChunkIdColumn && hasPrefixIndex)
+    {
+        return;
+    }
+
+    // looking up a chunk by an UNINDEXED column scans the whole table, and prefix indexes are built only on insert,
+    // so rebuild the table once with chunk id as rowid and prefix indexes
+    Utils::Timer timer("[TextSearchTable] migrate " + tableName);
+    auto trans = sqlite.beginTransaction();
+    auto newTableName = tableName + "_migrate";
+    sqlite.execute("DROP TABLE IF EXISTS " + newTableName + ";");
+    sqlite.execute(createTableSql(newTableName));
+    if(hasChunkIdColumn)
+    {
+        sqlite.execute("INSERT INTO " + newTableName + " (rowid, content, metadata) "
+                       "SELECT chunkId, content, metadata FROM " + tableName + " "
+                       "WHERE rowid IN (SELECT MAX(rowid) FROM " + tableName + " GROUP BY chunkId);"); // the latest row if duplicated
+    }
+    else
+    {
+        sqlite.execute("INSERT INTO " + newTableName + " (rowid, content, metadata) "
+                       "SELECT rowid, content, metadata FROM " + tableName + ";");
+    }
+    sqlite.execute("DROP TABLE " + tableName + ";");
+    sqlite.execute("ALTER TABLE " + newTableName + " RENAME TO " + tableName + ";");
+    trans.commit();
+    timer.stop();
 }
 
-// search in fts5 table before adding a new chunk, may be slow
 void TextSearchTable::addChunk(const Chunk &chunk)
 {
     std::unique_lock writelock(mutex); // lock for writing
-    auto query = sqlite.getStatement("SELECT COUNT(*) FROM " + tableName + " WHERE chunkId = ?");
+    auto query = sqlite.getStatement("SELECT COUNT(*) FROM " + tableName + " WHERE rowid = ?");
     query.bind(1, chunk.chunkId);
     query.step();
     int count = query.get<int>(0);
     auto content = chunk.content;
     auto metadata = chunk.metadata;
 
-    assert(count <= 1); // should not have more than one chunk with the same chunkId 
     if(count == 1) // existint chunk, update it
     {
-        auto update = sqlite.getStatement("UPDATE " + tableName + " SET content = ?, metadata = ? WHERE chunkId = ?");
+        auto update = sqlite.getStatement("UPDATE " + tableName + " SET content = ?, metadata = ? WHERE rowid = ?");
         update.bind(1, content);
         update.bind(2, metadata);
         update.bind(3, chunk.chunkId);
@@ -39,18 +96,19 @@ void TextSearchTable::addChunk(const Chunk &chunk)
     }
     else // new chunk, insert it
     {
-        auto insert = sqlite.getStatement("INSERT INTO " + tableName + " (content, metadata, chunkId) VALUES (?, ?, ?)");
-        insert.bind(1, content);
-        insert.bind(2, metadata);
-        insert.bind(3, chunk.chunkId);
+        auto insert = sqlite.getStatement("INSERT INTO " + tableName + " (rowid, content, metadata) VALUES (?, ?, ?)");
+        insert.bind(1, chunk.chunkId);
+        insert.bind(2, content);
+        insert.bind(3, metadata);
         insert.step();
+        rowCount++;
     }
 }
 
 void TextSearchTable::deleteChunk(int64_t chunkId)
 {
     std::unique_lock writelock(mutex); // lock for writing
-    auto deleteStmt = sqlite.getStatement("DELETE FROM " + tableName + " WHERE chunkId = ?");
+    auto deleteStmt = sqlite.getStatement("DELETE FROM " + tableName + " WHERE rowid = ?");
     deleteStmt.bind(1, chunkId);
     deleteStmt.step();
     
@@ -58,65 +116,126 @@ void TextSearchTable::deleteChunk(int64_t chunkId)
     {
         throw Error{"No chunk found with chunkId: " + std::to_string(chunkId), Error::Type::Internal};
     }
+    rowCount--;
 }
 
-auto TextSearchTable::search(const std::string &query, int limit) -> std::vector<ResultChunk>
+std::string TextSearchTable::buildMatchQuery(const std::string &query, bool prefix)
 {
+    // the word being typed, a trailing run of ASCII letters and digits, lower case as the tokenizer
+    std::string prefixTerm;
+    if (prefix)
+    {
+        auto begin = query.size();
+        while (begin > 0 && std::isalnum(static_cast<unsigned char>(query[begin - 1])))
+        {
+            begin--;
+        }
+        if (query.size() - begin >= MIN_PREFIX_LENGTH)
+        {
+            prefixTerm = Utils::toLower(query.substr(begin));
+        }
+    }
+
     // tokenize the query using jieba
     std::vector<std::string> keywords;
     jiebaTokenizer::cutForSearch(query, keywords); 
 
-    if(keywords.empty())
-    {
-        return {}; // no keywords, return empty result
-    }
-    std::string queryStr;
-    for (size_t i = 0; i < keywords.size(); ++i)
+    std::vector<std::string> terms; // unique keywords, cutForSearch returns overlapping and repeated words
+    for (const auto &keyword : keywords)
     {
         std::string safeKeyword;
-        for (char c : keywords[i]) 
+        for (char c : keyword) 
         {
             if (std::isalnum(static_cast<unsigned char>(c)) || c > 127u) 
             { 
                 safeKeyword += c;
             }
         }
-        
-        if (!safeKeyword.empty()) 
+        if (!safeKeyword.empty() && safeKeyword != prefixTerm && std::find(terms.begin(), terms.end(), safeKeyword) == terms.end()) 
+        {
+            terms.push_back(safeKeyword);
+        }
+    }
+
+    // stop words match most rows but hardly change the order, they only make FTS5 rank more rows
+    std::vector<std::string> contentTerms;
+    for (const auto &term : terms)
+    {
+        if (!jiebaTokenizer::isStopWord(term))
         {
-            if (!queryStr.empty()) queryStr += " OR ";
-            queryStr += safeKeyword;
+            contentTerms.push_back(term);
         }
     }
+    if (!contentTerms.empty() || !prefixTerm.empty())
+    {
+        terms = std::move(contentTerms);
+    }
+
+    // idf of a term in more than half of rows is clamped to almost 0 by bm25, skip it if rarer terms remain
+    auto totalRows = rowCount.load();
+    if (terms.size() > 1 && totalRows > 0)
+    {
+        // fts5vocab is created in temp schema of each connection, so the database schema is not changed
+        sqlite.execute("CREATE VIRTUAL TABLE IF NOT EXISTS temp." + tableName + "_vocab USING fts5vocab(main, " + tableName + ", 'row');");
+        auto vocabStmt = sqlite.getStatement("SELECT doc FROM temp." + tableName + "_vocab WHERE term = ?;");
+        std::vector<std::string> rareTerms;
+        for (const auto &term : terms)
+        {
+            vocabStmt.bind(1, term);
+            int64_t docCount = vocabStmt.step() ? vocabStmt.get<int64_t>(0) : 0;
+            vocabStmt.reset();
+            if (docCount * 2 <= totalRows)
+            {
+                rareTerms.push_back(term);
+            }
+        }
+        if (!rareTerms.empty())
+        {
+            terms = std::move(rareTerms);
+        }
+    }
+
+    std::string queryStr;
+    for (const auto &term : terms)
+    {
+        if (!queryStr.empty()) queryStr += " OR ";
+        queryStr += term;
+    }
+    // the prefix term is always kept, it is what the user is looking for right now
+    if (!prefixTerm.empty())
+    {
+        if (!queryStr.empty()) queryStr += " OR ";
+        queryStr += prefixTerm + "*";
+    }
+    return queryStr;
+}
+
+auto TextSearchTable::search(const std::string &query, int limit, bool prefix) -> std::vector<ResultChunk>
+{
+    std::shared_lock readlock(mutex); // lock for reading
+    auto queryStr = buildMatchQuery(query, prefix);
     if(queryStr.empty())
     {
         return {}; // no keywords, return empty result
     }
 
-    // construct the query stmt
-    auto& begin = ResultChunk::HIGHLIGHT_BEGINS;
-    auto& end = ResultChunk::HIGHLIGHT_ENDS;
-    auto qerySql = 
-    "SELECT highlight(" + tableName + ", 0, '" + begin + "', '" + end + "') AS highlighted_content, "
-            "highlight(" + tableName + ", 1, '" + begin + "', '" + end + "') AS highlighted_metadata, "
-            "chunkId, bm25(" + tableName + ") AS score "
+    // only rowid and rank are selected, FTS5 keeps the best `limit` rows while scanning and never reads content,
+    // highlighting is done later for the final results only
+    auto queryStmt = sqlite.getStatement(
+    "SELECT rowid, rank "
     "FROM " + tableName + " "
     "WHERE " + tableName + " MATCH ? "
-    "ORDER BY score "  
-    "LIMIT ?";
-    auto queryStmt = sqlite.getStatement(qerySql);
+    "ORDER BY rank "  
+    "LIMIT ?");
     queryStmt.bind(1, queryStr);
     queryStmt.bind(2, limit);
 
-    std::shared_lock readlock(mutex); // lock for reading
     std::vector<ResultChunk> resultChunks;
     while(queryStmt.step())
     {
         ResultChunk chunk;
-        chunk.content = queryStmt.get<std::string>(0);
-        chunk.metadata = queryStmt.get<std::string>(1);
-        chunk.chunkId = queryStmt.get<int64_t>(2);
-        auto bm25Score = queryStmt.get<double>(3);
+        chunk.chunkId = queryStmt.get<int64_t>(0);
+        auto bm25Score = queryStmt.get<double>(1);
         chunk.similarity = 1.0 - (1.0 / (1.0 - bm25Score)); // convert bm25 score to similarity score
         
         resultChunks.push_back(chunk);
@@ -125,18 +244,29 @@ auto TextSearchTable::search(const std::string &query, int limit) -> std::vector
     return resultChunks;
 }
 
-std::pair<std::string, std::string> TextSearchTable::getContent(int64_t chunkId)
+std::optional<std::pair<std::string, std::string>> TextSearchTable::getContent(int64_t chunkId)
 {
     std::shared_lock readlock(mutex); // lock for reading
-    auto queryStmt = sqlite.getStatement("SELECT content, metadata FROM " + tableName + " WHERE chunkId = ?");
+    auto queryStmt = sqlite.getStatement("SELECT content, metadata FROM " + tableName + " WHERE rowid = ?");
     queryStmt.bind(1, chunkId);
 
     if(!queryStmt.step())
     {
-        throw Error{"No chunk found with chunkId: " + std::to_string(chunkId), Error::Type::Internal};
+        return std::nullopt;
     }
 
-    return {queryStmt.get<std::string>(0), queryStmt.get<std::string>(1)};
+    return std::make_pair(queryStmt.get<std::string>(0), queryStmt.get<std::string>(1));
+}
+
+bool TextSearchTable::merge(int pages)
+{
+    std::unique_lock writelock(mutex); // lock for writing
+    auto changes = sqlite.getTotalChanges();
+    auto mergeStmt = sqlite.getStatement("INSERT INTO " + tableName + " (" + tableName + ", rank) VALUES ('merge', ?);");
+    mergeStmt.bind(1, pages);
+    mergeStmt.step();
+    // the merge command changes less than 2 rows if there is no work to do, see FTS5 documentation
+    return sqlite.getTotalChanges() - changes >= 2;
 }
 
 void TextSearchTable::dropTable(SqliteConnection &sqlite, const std::string &tableName)
@@ -144,24 +274,34 @@ void TextSearchTable::dropTable(SqliteConnection &sqlite, const std::string &tab
     sqlite.execute("DROP TABLE IF EXISTS " + tableName + ";"); // drop the table if exists
 }
 
-std::string TextSearchTable::reHighlight(const std::string &text, const std::string &query)
+//-----------------------Highlighter---------------------//
+TextSearchTable::Highlighter::Highlighter(const std::string &query)
 {
-    if (text.empty() || query.empty())
+    states.emplace_back();
+    states[0].next.fill(-1);
+    for (const auto &keyword : extractKeywords(query))
     {
-        return text;
+        addKeyword(keyword);
     }
-    std::string result = text;
-    
-    // gernerate kerwords
+    build();
+}
+
+std::vector<std::string> TextSearchTable::Highlighter::extractKeywords(const std::string &query)
+{
+    if (query.empty())
+    {
+        return {};
+    }
+    // gernerate kerwords, lower case
     std::vector<std::string> keywords{};
-    jiebaTokenizer::cut(query, keywords, false);
+    jiebaTokenizer::cut(query, keywords);
 
     // filter kewords
     std::vector<std::string> filteredKeywords{};
-    for (size_t i = 0; i < keywords.size(); ++i)
+    for (const auto &word : keywords)
     {
         std::string keyword;
-        for (char c : keywords[i])
+        for (char c : word)
         {
             if (std::isalnum(static_cast<unsigned char>(c)) || c > 127u)
             {
@@ -173,62 +313,142 @@ std::string TextSearchTable::reHighlight(const std::string &text, const std::str
             filteredKeywords.push_back(keyword);
         }
     }
-    if(keywords.empty())
-    {
-        return result;
-    }
 
-    // remove duplicate and contained keywords
+    // longer keywords first, so a keyword only needs to be checked against kept ones
+    std::sort(filteredKeywords.begin(), filteredKeywords.end(), [](const std::string &a, const std::string &b) { return a.size() > b.size(); });
+    bool shortQuery = Utils::utf8Length(query) < MIN_KEYWORD_LENGTH;
     std::vector<std::string> uniqueKeywords{};
     for (const auto &keyword : filteredKeywords)
     {
-        bool found = false;
-        for (auto it = uniqueKeywords.begin(); it != uniqueKeywords.end();)
+        if (Utils::utf8Length(keyword) < MIN_KEYWORD_LENGTH && !shortQuery)
         {
-            bool isSubstr = (it->find(keyword) != std::string::npos);
-            if (isSubstr)
+            continue; // remove short keywords
+        }
+        bool contained = std::any_of(uniqueKeywords.begin(), uniqueKeywords.end(), [&keyword](const std::string &kept) {
+            return kept.find(keyword) != std::string::npos;
+        });
+        if (!contained) // remove duplicate and contained keywords
+        {
+            uniqueKeywords.push_back(keyword);
+        }
+    }
+    return uniqueKeywords;
+}
+
+void TextSearchTable::Highlighter::addKeyword(const std::string &keyword)
+{
+    int state = 0;
+    for (unsigned char c : keyword)
+    {
+        if (states[state].next[c] == -1)
+        {
+            states[state].next[c] = static_cast<int>(states.size());
+            states.emplace_back();
+            states.back().next.fill(-1);
+        }
+        state = states[state].next[c];
+    }
+    states[state].length = static_cast<int>(keyword.size());
+}
+
+void TextSearchTable::Highlighter::build()
+{
+    // breadth first, failure links of shallower states are ready when a state is visited
+    std::vector<int> queue;
+    for (int c = 0; c < 256; c++)
+    {
+        auto &child = states[0].next[c];
+        if (child == -1)
+        {
+            child = 0;
+        }
+        else
+        {
+            states[child].fail = 0;
+            queue.push_back(child);
+        }
+    }
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        int state = queue[i];
+        states[state].output = states[state].length > 0 ? state : states[states[state].fail].output;
+        for (int c = 0; c < 256; c++)
+        {
+            int child = states[state].next[c];
+            int fallback = states[states[state].fail].next[c];
+            if (child == -1)
             {
-                found = true;
-                break;
+                states[state].next[c] = fallback;
             }
-            bool isSuperstr = (keyword.find(*it) != std::string::npos);
-            if (isSuperstr)
+            else
             {
-                it = uniqueKeywords.erase(it);
-                continue;
+                states[child].fail = fallback;
+                queue.push_back(child);
             }
-            ++it;
         }
-        if (!found)
+    }
+    // keywords are lower case, upper case ASCII letters of text move as their lower case
+    for (auto &state : states)
+    {
+        for (int c = 'A'; c <= 'Z'; c++)
         {
-            uniqueKeywords.push_back(keyword);
+            state.next[c] = state.next[c - 'A' + 'a'];
+        }
+    }
+}
+
+std::string TextSearchTable::Highlighter::highlight(const std::string &text) const
+{
+    if (empty() || text.empty())
+    {
+        return text;
+    }
+    // longestAt[i]: length of the longest keyword beginning at byte i
+    std::vector<int> longestAt(text.size(), 0);
+    int state = 0;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        state = states[state].next[static_cast<unsigned char>(text[i])];
+        for (int out = states[state].output; out != 0; out = states[states[out].fail].output)
+        {
+            auto length = states[out].length;
+            auto &longest = longestAt[i + 1 - length];
+            longest = std::max(longest, length);
         }
     }
 
-    // remove short keywords
-    for(auto it = uniqueKeywords.begin(); it != uniqueKeywords.end();)
+    // leftmost-longest, non-overlapping
+    std::vector<std::pair<size_t, int>> matches;
+    for (size_t i = 0; i < text.size();)
     {
-        if (Utils::utf8Length(*it) < MIN_KEYWORD_LENGTH && Utils::utf8Length(query) >= MIN_KEYWORD_LENGTH)
+        if (longestAt[i] > 0)
         {
-            it = uniqueKeywords.erase(it);
+            matches.emplace_back(i, longestAt[i]);
+            i += longestAt[i];
         }
         else
         {
-            ++it;
+            i++;
         }
     }
+    if (matches.empty())
+    {
+        return text;
+    }
 
-    for (const auto &keyword : uniqueKeywords)
+    const auto &begin = ResultChunk::HIGHLIGHT_BEGINS;
+    const auto &end = ResultChunk::HIGHLIGHT_ENDS;
+    std::string result;
+    result.reserve(text.size() + matches.size() * (begin.size() + end.size()));
+    size_t copied = 0;
+    for (const auto &[position, length] : matches)
     {
-        auto pos = result.find(keyword);
-        while (pos != std::string::npos)
-        {
-            result.insert(pos, ResultChunk::HIGHLIGHT_BEGINS);
-            pos += keyword.length() + ResultChunk::HIGHLIGHT_BEGINS.length();
-            result.insert(pos, ResultChunk::HIGHLIGHT_ENDS);
-            pos += ResultChunk::HIGHLIGHT_ENDS.length();
-            pos = result.find(keyword, pos);
-        }
+        result.append(text, copied, position - copied);
+        result += begin;
+        result.append(text, position, length);
+        result += end;
+        copied = position + length;
     }
+    result.append(text, copied, std::string::npos);
     return result;
 }
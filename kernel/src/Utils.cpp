@@ -13,6 +13,8 @@
 #include <unordered_set>
 #include <codecvt>
 
+#include "Metrics.h"
+
 std::string Utils::calculatedocHash(const std::filesystem::path &path)
 {
     std::ifstream file{path, std::ios::binary};
@@ -156,9 +158,8 @@ nlohmann::json Utils::readJsonFile(const std::filesystem::path &path)
     return json;
 }
 
-std::string Utils::getTimeStr()
+std::string Utils::getTimeStr(std::chrono::system_clock::time_point now)
 {
-    auto now = std::chrono::system_clock::now();
     auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
     auto time = std::chrono::system_clock::to_time_t(now);
     std::tm tm = *std::localtime(&time);
@@ -463,6 +464,12 @@ bool Utils::MessageQueue::empty()
     return queue.empty();
 }
 
+size_t Utils::MessageQueue::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+}
+
 void Utils::MessageQueue::shutdown()
 {
     std::lock_guard<std::mutex> lock(mutex);
@@ -477,14 +484,17 @@ Utils::Timer::Timer(std::string message, std::source_location beginLocation)
     startTime = clock_type::now();
 }
 
-void Utils::Timer::stop(std::source_location endLocation)
+double Utils::Timer::stop(std::source_location endLocation)
 {
     auto endTime = clock_type::now();
     auto duration = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(endTime - startTime).count();
-    logger.info("[PERF] " + message + " Timer stopped in " + std::to_string(duration) + " ms "
-                "\nFrom " + beginLocation.file_name() + ":" + std::to_string(beginLocation.line()) + 
-                "\nTo   " + endLocation.file_name() + ":" + std::to_string(endLocation.line()) + " .");
+    logger.info([&]() {
+        return "[PERF] " + message + " Timer stopped in " + std::to_string(duration) + " ms "
+               "\nFrom " + beginLocation.file_name() + ":" + std::to_string(beginLocation.line()) + 
+               "\nTo   " + endLocation.file_name() + ":" + std::to_string(endLocation.line()) + " .";
+    });
     running = false;
+    return duration;
 }
 
 Utils::Timer::~Timer()
@@ -494,9 +504,11 @@ Utils::Timer::~Timer()
         auto endTime = clock_type::now();
         auto duration =
             std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(endTime - startTime).count();
-        logger.info("[PERF] " + message + " Timer stopped in " + std::to_string(duration) + " ms "
-            "\nFrom " + beginLocation.file_name() + ":" + std::to_string(beginLocation.line()) + 
-            "\nTo   destructor.");
+        logger.info([&]() {
+            return "[PERF] " + message + " Timer stopped in " + std::to_string(duration) + " ms "
+                   "\nFrom " + beginLocation.file_name() + ":" + std::to_string(beginLocation.line()) + 
+                   "\nTo   destructor.";
+        });
         running = false;
         logger.warning("Timer stopped at destructor, result may be inaccurate.");
     }
@@ -573,23 +585,175 @@ Logger::Logger(const std::filesystem::path &logFileDir, bool toConsole, Level lo
     {
         std::cerr << "Failed to open log file: " << logFilePath << ", may not record logs." << std::endl;
     }
+    slots = std::make_unique<Slot[]>(bufferCapacity);
+    for (size_t i = 0; i < bufferCapacity; i++)
+    {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    running = true;
+    flusherThread = std::thread(&Logger::flusherLoop, this);
     log("[Logger] Logger initialized with log level: " + levelToString(logLevel), Level::INFO);
     log("Kernel version: " + std::string(KERNEL_VERSION), Level::INFO);
     cleanOldLogFiles(logFileDir);
 }
 
-void Logger::log(const std::string &message, Level level)
+Logger::~Logger()
+{
+    running = false; // logs from other static destructors are written synchronously
+    {
+        std::lock_guard<std::mutex> lock(flushMutex);
+        stopping = true;
+    }
+    flushCv.notify_all();
+    if (flusherThread.joinable())
+    {
+        flusherThread.join(); // flusher drains pending records before exit
+    }
+}
+
+bool Logger::tryPush(Record &record)
+{
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true)
+    {
+        slot = &slots[pos & (bufferCapacity - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return false; // full, the slot has not been consumed by flusher yet
+        }
+        else
+        {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    slot->record = std::move(record);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool Logger::tryPop(Record &record)
+{
+    auto &slot = slots[dequeuePos & (bufferCapacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+    {
+        return false; // empty, or the producer has not finished writing
+    }
+    record = std::move(slot.record);
+    slot.sequence.store(dequeuePos + bufferCapacity, std::memory_order_release);
+    dequeuePos++;
+    return true;
+}
+
+void Logger::flusherLoop()
+{
+    Utils::setThreadName("Logger flusher");
+    while (true)
+    {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(flushMutex);
+            flushCv.wait_for(lock, flushInterval, [this]() { return flushRequested || stopping; });
+            flushRequested = false;
+            stop = stopping;
+        }
+        drain();
+        if (stop)
+        {
+            break;
+        }
+    }
+}
+
+void Logger::drain()
+{
+    std::string batch;
+    Record record;
+    while (tryPop(record))
+    {
+        batch += Utils::getTimeStr(record.time) + " [" + levelToString(record.level) + "] " + record.message + "\n";
+    }
+    auto dropped = droppedCount.exchange(0);
+    if (dropped > 0)
+    {
+        batch += Utils::getTimeStr() + " [WARNING] [Logger] " + std::to_string(dropped) + " log records dropped, log buffer is full.\n";
+    }
+    if (!batch.empty())
+    {
+        write(batch);
+    }
+    {
+        std::lock_guard<std::mutex> lock(flushMutex);
+        writtenPos = dequeuePos;
+    }
+    writtenCv.notify_all();
+}
+
+void Logger::write(const std::string &text)
 {
-    if (level < logLevel)
-        return;
     std::lock_guard<std::mutex> lock(mutex);
-    auto timeStr = Utils::getTimeStr();
-    std::string logMessage = timeStr + " [" + levelToString(level) + "] " + message + "\n";
     if (toConsole)
-        std::cerr << logMessage << std::flush;
+        std::cerr << text << std::flush;
     if (!logFile.is_open())
         return;
-    logFile << logMessage << std::flush;
+    logFile << text << std::flush;
+}
+
+void Logger::log(const std::string &message, Level level)
+{
+    if (!isEnabled(level))
+        return;
+    Record record{level, std::chrono::system_clock::now(), message};
+    if (!running)
+    {
+        // flusher is not available, write synchronously
+        write(Utils::getTimeStr(record.time) + " [" + levelToString(level) + "] " + message + "\n");
+        return;
+    }
+    while (!tryPush(record))
+    {
+        if (level < Level::WARNING)
+        {
+            droppedCount++;
+            return;
+        }
+        // warnings and errors must not be lost, wait for flusher to free space
+        {
+            std::lock_guard<std::mutex> lock(flushMutex);
+            flushRequested = true;
+        }
+        flushCv.notify_one();
+        std::this_thread::yield();
+    }
+    if (level == Level::FATAL)
+    {
+        flush(); // fatal errors are followed by a crash, make sure they are on disk
+    }
+    else if (enqueuePos.load(std::memory_order_relaxed) - writtenPos.load(std::memory_order_relaxed) > bufferCapacity / 2)
+    {
+        // wake flusher early to avoid dropping, a lost wakeup only delays until next flush interval
+        flushRequested = true;
+        flushCv.notify_one();
+    }
+}
+
+void Logger::flush()
+{
+    if (!running || std::this_thread::get_id() == flusherThread.get_id())
+        return;
+    auto target = enqueuePos.load();
+    std::unique_lock<std::mutex> lock(flushMutex);
+    flushRequested = true;
+    flushCv.notify_one();
+    // wait with timeout, a producer may be preempted between claiming and publishing a slot
+    writtenCv.wait_for(lock, std::chrono::seconds(1), [this, target]() { return writtenPos >= target || stopping; });
 }
 
 void Logger::debug(const std::string &message)
@@ -798,6 +962,9 @@ bool Utils::PriorityMutex::isLocked() const
 Utils::LockGuard::LockGuard(PriorityMutex &mutex, bool priority, bool write)
     : mutex(mutex), priority(priority), write(write)
 {
+    static auto &priorityWait = Metrics::histogram("lock.wait.priority");
+    static auto &backgroundWait = Metrics::histogram("lock.wait.background");
+    Metrics::ScopedTimer waitTimer(priority ? priorityWait : backgroundWait);
     mutex.lock(priority, write);
 }
 
@@ -959,14 +1126,25 @@ void Utils::WorkerThread::workFuncWrapper()
 //---------------------------- Jieba Tokenizer -----------------------------//
 namespace jiebaTokenizer
 {
-cppjieba::Jieba *jieba = nullptr; // Global Jieba tokenizer instance
-std::mutex jiebaMutex;            // to protect jieba pointer
+// Global Jieba tokenizer instance, published with release order after it is fully constructed,
+// so a thread which loads a non-null pointer with acquire order sees the loaded dictionaries
+std::atomic<cppjieba::Jieba *> jieba = nullptr;
+std::mutex jiebaMutex; // serialize initialization
+
+// segmenter shares dict trie and hmm model with jieba, used by fts5 tokenizer to get word ranges directly
+std::atomic<cppjieba::MixSegment *> mixSegment = nullptr;
+
+// same separators as cppjieba::SegmentBase, each of them is emitted as a single token
+inline bool isSeparator(cppjieba::Rune rune)
+{
+    return rune == U' ' || rune == U'\t' || rune == U'\n' || rune == U'\uFF0C' || rune == U'\u3002';
+}
 }; // namespace jiebaTokenizer
 
 // FTS5 tokenizer interface functions
 int jiebaTokenizer::jieba_tokenizer_create(void *sqlite3_api, const char **azArg, int nArg, Fts5Tokenizer **ppOut)
 {
-    *ppOut = (Fts5Tokenizer *)jieba;
+    *ppOut = (Fts5Tokenizer *)jieba.load(std::memory_order_acquire);
     return SQLITE_OK;
 }
 void jiebaTokenizer::jieba_tokenizer_delete(Fts5Tokenizer *pTokenizer)
@@ -977,26 +1155,54 @@ int jiebaTokenizer::jieba_tokenizer_tokenize(Fts5Tokenizer *pTokenizer, void *pC
                                              int nText, int (*xToken)(void *, int, const char *, int, int, int))
 {
     get_jieba_ptr();
+    auto segment = mixSegment.load(std::memory_order_acquire); // stored before jieba, so it is set here
 
-    cppjieba::Jieba *jieba = (cppjieba::Jieba *)pTokenizer;
-    std::string text(pText, nText);
-    std::vector<std::string> words;
+    // buffers are reused between calls, every insert, delete and query goes through here
+    thread_local std::string text;
+    thread_local std::vector<cppjieba::RuneStr> runes;
+    thread_local std::vector<cppjieba::WordRange> ranges;
 
-    // tokenize
-    cut(text, words);
+    // lower case only changes ascii bytes, so offsets in text are the same as in pText
+    text.assign(pText, nText);
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) -> unsigned char {
+        return (c < 128) ? tolower(c) : c;
+    });
+
+    // decode utf8, the offset of each rune points into text
+    runes.clear();
+    for (uint32_t i = 0, j = 0; i < text.size(); j++)
+    {
+        auto rune = cppjieba::DecodeUTF8ToRune(text.data() + i, text.size() - i);
+        if (rune.len == 0)
+            return SQLITE_OK; // invalid utf8, same as jieba->Cut, no token output
+        runes.emplace_back(rune.rune, i, rune.len, j, 1);
+        i += rune.len;
+    }
+
+    // split by separators and cut each part, the same as jieba->Cut
+    ranges.clear();
+    auto begin = runes.data();
+    auto end = runes.data() + runes.size();
+    for (auto it = begin; it != end; it++)
+    {
+        if (!isSeparator(it->rune))
+            continue;
+        if (begin != it)
+            segment->Cut(begin, it, ranges, true);
+        ranges.emplace_back(it, it);
+        begin = it + 1;
+    }
+    if (begin != end)
+        segment->Cut(begin, end, ranges, true);
 
     // output each token result
-    int offset = 0;
-    for (const auto &word : words)
+    for (const auto &range : ranges)
     {
-        size_t pos = text.find(word, offset);
-        if (pos != std::string::npos)
-        {
-            offset = pos + word.length();
-            int rc = xToken(pCtx, 0, word.c_str(), word.length(), pos, pos + word.length());
-            if (rc != SQLITE_OK)
-                return rc;
-        }
+        int start = range.left->offset;
+        int length = range.right->offset + range.right->len - start;
+        int rc = xToken(pCtx, 0, text.data() + start, length, start, start + length);
+        if (rc != SQLITE_OK)
+            return rc;
     }
 
     return SQLITE_OK;
@@ -1024,7 +1230,7 @@ void jiebaTokenizer::register_jieba_tokenizer(sqlite3 *db)
         sqlite3_finalize(stmt);        // finalize the statement
 
         // register the tokenizer to the SQLite database
-        auto rc = fts5api->xCreateTokenizer(fts5api, "jieba", (void *)jieba, &tokenizer, nullptr);
+        auto rc = fts5api->xCreateTokenizer(fts5api, "jieba", (void *)jieba.load(std::memory_order_acquire), &tokenizer, nullptr);
         if (rc != SQLITE_OK)
         {
             throw Error{"Failed to register jieba tokenizer, sql error" + std::string(sqlite3_errmsg(db)),
@@ -1039,24 +1245,27 @@ void jiebaTokenizer::register_jieba_tokenizer(sqlite3 *db)
 
 cppjieba::Jieba *jiebaTokenizer::get_jieba_ptr()
 {
-    if (jieba != nullptr)
-        return jieba;
+    auto instance = jieba.load(std::memory_order_acquire);
+    if (instance != nullptr)
+        return instance;
+
+    std::lock_guard<std::mutex> lock(jiebaMutex);
+    instance = jieba.load(std::memory_order_relaxed); // the mutex orders it with the store below
+    if (instance == nullptr) // initialize jieba object
     {
-        std::lock_guard<std::mutex> lock(jiebaMutex);
         Utils::Timer timer("[Jieba] jieba initialization");
-        if (jieba == nullptr) // initialize jieba object
-        {
-            jieba = new cppjieba::Jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH,
-                                        STOP_WORD_PATH); // PATH has been defined in the cmakefile
-        }
+        instance = new cppjieba::Jieba(DICT_PATH, HMM_PATH, USER_DICT_PATH, IDF_PATH,
+                                       STOP_WORD_PATH); // PATH has been defined in the cmakefile
+        mixSegment.store(new cppjieba::MixSegment(instance->GetDictTrie(), instance->GetHMMModel()), std::memory_order_release);
+        jieba.store(instance, std::memory_order_release); // set jieba at last, other threads only check this pointer
         timer.stop();
     }
-    return jieba;
+    return instance;
 }
 
 void jiebaTokenizer::cut(const std::string &text, std::vector<std::string> &words, bool needLower)
 {
-    get_jieba_ptr();
+    auto jieba = get_jieba_ptr();
 
     auto ltext = text;
     if (needLower)
@@ -1066,7 +1275,7 @@ void jiebaTokenizer::cut(const std::string &text, std::vector<std::string> &word
 
 void jiebaTokenizer::cutForSearch(const std::string &text, std::vector<std::string> &words, bool needLower)
 {
-    get_jieba_ptr();
+    auto jieba = get_jieba_ptr();
 
     auto ltext = text;
     if (needLower)
@@ -1076,7 +1285,7 @@ void jiebaTokenizer::cutForSearch(const std::string &text, std::vector<std::stri
 
 void jiebaTokenizer::extractKeyword(const std::string &text, std::vector<std::string> &keywords, int topK)
 {
-    get_jieba_ptr();
+    auto jieba = get_jieba_ptr();
 
     std::vector<std::pair<std::string, double>> keywordWeights{};
     jieba->extractor.Extract(text, keywordWeights, topK);
@@ -1092,3 +1301,21 @@ void jiebaTokenizer::extractKeyword(const std::string &text, std::vector<std::st
         }
     }
 }
+
+bool jiebaTokenizer::isStopWord(const std::string &word)
+{
+    static const std::unordered_set<std::string> stopWords = []() {
+        std::unordered_set<std::string> words;
+        std::ifstream file(STOP_WORD_PATH); // PATH has been defined in the cmakefile
+        std::string line;
+        while (std::getline(file, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                words.insert(line);
+        }
+        return words;
+    }();
+    return stopWords.find(word) != stopWords.end();
+}
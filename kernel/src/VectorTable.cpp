@@ -1,5 +1,6 @@
 #include "VectorTable.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <filesystem>
@@ -174,6 +175,8 @@ int VectorTable::writeToDisk(bool alreadyLocked)
 {
     if(addCount == 0)
         return 0; // no need to write to disk
+    if(sqlite.inTransaction())
+        return 0; // vectors of rows which may be rolled back must never reach the disk, write after commit
 
     if(!alreadyLocked)
         std::unique_lock<std::shared_mutex> writelock(mutex); 
@@ -490,6 +493,24 @@ std::vector<VectorTable::idx_t> VectorTable::getInvalidIds() const
     return invalidIdList;
 }
 
+std::vector<VectorTable::idx_t> VectorTable::getMissingIds(const std::vector<idx_t> &ids) const
+{
+    std::shared_lock<std::shared_mutex> readlock(mutex); // lock the mutex for reading
+    auto querySQL = "SELECT 1 FROM " + tableName + " WHERE id = ? AND valid = 1 AND deleted = 0;";
+    auto queryStmt = sqlite.getStatement(querySQL);
+
+    std::vector<idx_t> missingIdList;
+    for (const auto &id : ids)
+    {
+        queryStmt.bind(1, id);
+        if (!queryStmt.step())
+            missingIdList.push_back(id);
+        queryStmt.reset(); // reset the statement for the next bind
+    }
+
+    return missingIdList;
+}
+
 void VectorTable::write()
 {
     std::unique_lock<std::shared_mutex> writelock(mutex); // lock the mutex for writing
@@ -497,6 +518,22 @@ void VectorTable::write()
     writeToDisk(true); 
 }
 
+void VectorTable::discardChanges()
+{
+    std::unique_lock<std::shared_mutex> writelock(mutex); // lock the mutex for writing
+    addCount = 0;
+    deleteCount = 0;
+}
+
+void VectorTable::dropUncommittedVectors()
+{
+    if(sqlite.inTransaction())
+        throw Error{"Cannot drop uncommitted vectors in a transaction.", Error::Type::Internal};
+    std::unique_lock<std::shared_mutex> writelock(mutex); // lock the mutex for writing
+    deleteCount = std::max(deleteCount, 1); // reconstruct keeps only valid rows in sqlite
+    reconstructFaissIndex(true);
+}
+
 void VectorTable::dropTable(SqliteConnection &sqlite, const std::filesystem::path &path, const std::string &tableName)
 {
     // drop sql table
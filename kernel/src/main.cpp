@@ -6,9 +6,9 @@
 // std::filesystem::path dataPath = std::filesystem::path (".") / "userData";
 std::filesystem::path dataPath = std::filesystem::path(std::getenv("POCKETRAG_USERDATA_PATH"));
 #ifdef NDEBUG
-Logger logger(dataPath / "logs", false, Logger::Level::INFO, 20);
+Logger logger(dataPath / KernelServer::logDirName, false, Logger::Level::INFO, 20);
 #else
-Logger logger(dataPath / "logs", false, Logger::Level::DEBUG, 20);
+Logger logger(dataPath / KernelServer::logDirName, false, Logger::Level::DEBUG, 20);
 #endif
 
 void crash_handler();
@@ -70,7 +70,10 @@ void crash_handler()
         errorJson["isReply"] = false;
         errorJson["message"]["type"] = "kernelServerCrashed";
         errorJson["message"]["error"] = error_message;
-        std::cout << errorJson.dump() << std::endl << std::flush;
+        std::string frame;
+        KernelServer::encodeMessage(errorJson, frame);
+        std::cout.write(frame.data(), frame.size());
+        std::cout.flush();
     }
     catch (...)
     {
@@ -0,0 +1,129 @@
+"""
+Generate a tiny random embedding model for `kernel_bench`, so benchmarks can run without downloading real models.
+
+usage:
+    python scripts/makeBenchModel.py /path/to/output_dir [--dim 384] [--hidden 384] [--layers 2] [--vocab 2000]
+
+The output directory has the same layout as a local embedding model used by the kernel:
+    model.onnx                 inputs: input_ids, attention_mask; outputs: token_embeddings, sentence_embedding
+    sentencepiece.bpe.model    tokenizer trained on generated text
+    config.json                max_position_embeddings
+The weights are random, so embeddings are meaningless, but the cost grows with batch size and sequence length
+like a real encoder (`--layers` dense layers over every token), which is what the benchmarks measure.
+
+requires: onnx, sentencepiece, numpy
+"""
+import argparse
+import io
+import json
+import os
+import random
+
+import numpy as np
+import onnx
+import sentencepiece as spm
+from onnx import TensorProto, helper, numpy_helper
+
+OPSET = 17
+MAX_LENGTH = 512
+
+WORDS = (
+    "kernel search index chunk vector query embedding document markdown repository session model token "
+    "latency thread queue cache table score result rerank batch memory storage update insert delete "
+    "知识 检索 文档 向量 模型 分词 索引 查询 结果 仓库 对话 内容 标题 段落 性能 测试"
+).split()
+
+
+def generateSentences(count, seed):
+    rng = random.Random(seed)
+    for _ in range(count):
+        yield " ".join(rng.choice(WORDS) for _ in range(rng.randint(5, 30)))
+
+
+def trainTokenizer(outputDir, vocabSize):
+    model = io.BytesIO()
+    spm.SentencePieceTrainer.train(
+        sentence_iterator=generateSentences(20000, 0),
+        model_writer=model,
+        vocab_size=vocabSize,
+        model_type="bpe",
+        character_coverage=1.0,
+        pad_id=3,  # the kernel pads batches with pad_id, which is disabled by default
+        hard_vocab_limit=False,  # generated text may not have enough pieces for a large vocabulary
+    )
+    with open(os.path.join(outputDir, "sentencepiece.bpe.model"), "wb") as f:
+        f.write(model.getvalue())
+    return spm.SentencePieceProcessor(model_proto=model.getvalue()).get_piece_size()
+
+
+def buildModel(vocabSize, hidden, dim, layers):
+    rng = np.random.default_rng(0)
+
+    def weight(name, *shape):
+        scale = 1.0 / np.sqrt(shape[0])
+        return numpy_helper.from_array((rng.standard_normal(shape) * scale).astype(np.float32), name)
+
+    initializers = [weight("token_table", vocabSize, hidden), weight("projection", hidden, dim)]
+    initializers.append(numpy_helper.from_array(np.array([1], dtype=np.int64), "axis_seq"))
+    initializers.append(numpy_helper.from_array(np.array([-1], dtype=np.int64), "axis_last"))
+    initializers.append(numpy_helper.from_array(np.array([1e-6], dtype=np.float32), "epsilon"))
+
+    nodes = [helper.make_node("Gather", ["token_table", "input_ids"], ["hidden_0"], axis=0)]
+    # dense layers over every token, the cost is proportional to the number of tokens like a real encoder
+    for i in range(layers):
+        initializers.append(weight(f"layer_{i}", hidden, hidden))
+        nodes.append(helper.make_node("MatMul", [f"hidden_{i}", f"layer_{i}"], [f"dense_{i}"]))
+        nodes.append(helper.make_node("Tanh", [f"dense_{i}"], [f"hidden_{i + 1}"]))
+    last = f"hidden_{layers}"
+    nodes.append(helper.make_node("MatMul", [last, "projection"], ["token_embeddings"]))
+
+    # mean pooling with attention mask
+    nodes += [
+        helper.make_node("Cast", ["attention_mask"], ["mask_float"], to=TensorProto.FLOAT),
+        helper.make_node("Unsqueeze", ["mask_float", "axis_last"], ["mask_expanded"]),
+        helper.make_node("Mul", ["token_embeddings", "mask_expanded"], ["masked"]),
+        helper.make_node("ReduceSum", ["masked", "axis_seq"], ["summed"], keepdims=0),
+        helper.make_node("ReduceSum", ["mask_expanded", "axis_seq"], ["count"], keepdims=0),
+        helper.make_node("Add", ["count", "epsilon"], ["count_safe"]),
+        helper.make_node("Div", ["summed", "count_safe"], ["sentence_embedding"]),
+    ]
+
+    graph = helper.make_graph(
+        nodes,
+        "pocketrag_bench_embedding",
+        inputs=[
+            helper.make_tensor_value_info("input_ids", TensorProto.INT64, ["batch", "sequence"]),
+            helper.make_tensor_value_info("attention_mask", TensorProto.INT64, ["batch", "sequence"]),
+        ],
+        # the kernel reads the embedding dimension from the last dimension of the second output
+        outputs=[
+            helper.make_tensor_value_info("token_embeddings", TensorProto.FLOAT, ["batch", "sequence", dim]),
+            helper.make_tensor_value_info("sentence_embedding", TensorProto.FLOAT, ["batch", dim]),
+        ],
+        initializer=initializers,
+    )
+    model = helper.make_model(graph, opset_imports=[helper.make_opsetid("", OPSET)], producer_name="makeBenchModel")
+    onnx.checker.check_model(model)
+    return model
+
+
+def main():
+    parser = argparse.ArgumentParser(description="tiny random embedding model for kernel_bench")
+    parser.add_argument("outputDir")
+    parser.add_argument("--dim", type=int, default=384)
+    parser.add_argument("--hidden", type=int, default=384)
+    parser.add_argument("--layers", type=int, default=2)
+    parser.add_argument("--vocab", type=int, default=2000)
+    args = parser.parse_args()
+
+    os.makedirs(args.outputDir, exist_ok=True)
+    vocabSize = trainTokenizer(args.outputDir, args.vocab)
+    model = buildModel(vocabSize, args.hidden, args.dim, args.layers)
+    onnx.save(model, os.path.join(args.outputDir, "model.onnx"))
+    with open(os.path.join(args.outputDir, "config.json"), "w", encoding="utf-8") as f:
+        json.dump({"max_position_embeddings": MAX_LENGTH}, f, indent=4)
+    print(f"bench model saved to {args.outputDir}, vocab {vocabSize}, dim {args.dim}, layers {args.layers}")
+
+
+if __name__ == "__main__":
+    main()
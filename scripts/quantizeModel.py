@@ -0,0 +1,169 @@
+"""
+Generate and check the int8 model used by the `quantized` option in localModelManagement.
+
+usage:
+    python scripts/quantizeModel.py quantize /path/to/model_dir
+    python scripts/quantizeModel.py check /path/to/model_dir /path/to/repo [--type embedding|rerank] [--samples 200]
+
+`quantize` writes `model_int8.onnx` next to `model.onnx` with dynamic int8 quantization (weights are quantized
+offline, activations at run time), which is the mode supported by the kernel on CPU.
+`check` runs both models on text chunks sampled from a repository, and reports speed and accuracy loss, so we
+can decide whether the quantized model is good enough before switching a model to it.
+
+requires: onnxruntime, sentencepiece, numpy
+"""
+import argparse
+import os
+import random
+import sys
+import time
+
+import numpy as np
+import onnxruntime as ort
+import sentencepiece as spm
+from onnxruntime.quantization import QuantType, quantize_dynamic
+
+MODEL_FILE = "model.onnx"
+QUANTIZED_MODEL_FILE = "model_int8.onnx"  # must be same as ONNXModel::quantizedModelFileName
+TEXT_SUFFIXES = {".md", ".txt"}
+
+
+def quantize(modelDir):
+    src = os.path.join(modelDir, MODEL_FILE)
+    dst = os.path.join(modelDir, QUANTIZED_MODEL_FILE)
+    if not os.path.exists(src):
+        sys.exit(f"model not found: {src}")
+    # large models (such as bge-m3) keep weights in model.onnx_data, so external data format is required
+    quantize_dynamic(src, dst, weight_type=QuantType.QInt8, per_channel=True, use_external_data_format=True)
+    print(f"quantized model saved to {dst}")
+
+
+def sampleChunks(repoDir, count, maxChars):
+    # split documents into paragraphs, similar to what Chunker produces for markdown and plain text
+    chunks = []
+    for root, _, files in os.walk(repoDir):
+        for name in files:
+            if os.path.splitext(name)[1].lower() not in TEXT_SUFFIXES:
+                continue
+            try:
+                with open(os.path.join(root, name), encoding="utf-8") as f:
+                    text = f.read()
+            except (UnicodeDecodeError, OSError):
+                continue
+            for paragraph in text.split("\n\n"):
+                paragraph = paragraph.strip()
+                if len(paragraph) >= 20:
+                    chunks.append(paragraph[:maxChars])
+    random.seed(0)
+    random.shuffle(chunks)
+    return chunks[:count]
+
+
+class Model:
+    # mirror the tokenization of EmbeddingModel and RerankerModel: <BOS>content<EOS> and <BOS>query<EOS>content<EOS>
+    def __init__(self, modelDir, modelFile, maxLength):
+        self.tokenizer = spm.SentencePieceProcessor(model_file=os.path.join(modelDir, "sentencepiece.bpe.model"))
+        options = ort.SessionOptions()
+        options.graph_optimization_level = ort.GraphOptimizationLevel.ORT_ENABLE_ALL
+        self.session = ort.InferenceSession(os.path.join(modelDir, modelFile), options, providers=["CPUExecutionProvider"])
+        self.inputNames = [i.name for i in self.session.get_inputs()]
+        self.outputNames = [o.name for o in self.session.get_outputs()]
+        self.maxLength = maxLength
+
+    def _run(self, ids, outputIndex):
+        ids = ids[: self.maxLength - 1] + [self.tokenizer.eos_id()] if len(ids) > self.maxLength else ids
+        inputIds = np.array([ids], dtype=np.int64)
+        mask = np.ones_like(inputIds)
+        feeds = {self.inputNames[0]: inputIds, self.inputNames[1]: mask}
+        return self.session.run([self.outputNames[outputIndex]], feeds)[0]
+
+    def embed(self, text):
+        ids = [self.tokenizer.bos_id()] + self.tokenizer.encode(text) + [self.tokenizer.eos_id()]
+        return self._run(ids, 1)[0]  # the second output is the embedding output
+
+    def rank(self, query, content):
+        ids = [self.tokenizer.bos_id()] + self.tokenizer.encode(query) + [self.tokenizer.eos_id()]
+        ids += self.tokenizer.encode(content) + [self.tokenizer.eos_id()]
+        logit = float(np.ravel(self._run(ids, 0))[0])  # the first output is the score output
+        return 1.0 / (1.0 + np.exp(-logit))
+
+
+def timed(func, items):
+    begin = time.perf_counter()
+    results = [func(*item) for item in items]
+    return results, time.perf_counter() - begin
+
+
+def checkEmbedding(fp32, int8, chunks, topK):
+    a, t32 = timed(fp32.embed, [(c,) for c in chunks])
+    b, t8 = timed(int8.embed, [(c,) for c in chunks])
+    a = np.array(a)
+    b = np.array(b)
+    a /= np.linalg.norm(a, axis=1, keepdims=True)
+    b /= np.linalg.norm(b, axis=1, keepdims=True)
+
+    cosine = np.sum(a * b, axis=1)
+    # use the first line of each chunk as a query, compare top-k neighbours in both embedding spaces
+    queries = [(c.splitlines()[0],) for c in chunks]
+    qa = np.array([fp32.embed(*q) for q in queries])
+    qb = np.array([int8.embed(*q) for q in queries])
+    topA = np.argsort(-(qa @ a.T), axis=1)[:, :topK]
+    topB = np.argsort(-(qb @ b.T), axis=1)[:, :topK]
+    recall = np.mean([len(set(x) & set(y)) / topK for x, y in zip(topA, topB)])
+
+    print(f"fp32: {len(chunks) / t32:.2f} chunks/s, int8: {len(chunks) / t8:.2f} chunks/s, speedup: {t32 / t8:.2f}x")
+    print(f"cosine(fp32, int8): mean {cosine.mean():.4f}, min {cosine.min():.4f}")
+    print(f"recall@{topK} of int8 against fp32: {recall:.4f}")
+
+
+def checkRerank(fp32, int8, chunks):
+    pairs = [(c.splitlines()[0], random.choice(chunks)) for c in chunks]
+    a, t32 = timed(fp32.rank, pairs)
+    b, t8 = timed(int8.rank, pairs)
+    a = np.array(a)
+    b = np.array(b)
+    # rank correlation is what matters for reranking
+    corr = np.corrcoef(np.argsort(np.argsort(a)), np.argsort(np.argsort(b)))[0, 1]
+
+    print(f"fp32: {len(pairs) / t32:.2f} pairs/s, int8: {len(pairs) / t8:.2f} pairs/s, speedup: {t32 / t8:.2f}x")
+    print(f"score diff: mean {np.mean(np.abs(a - b)):.4f}, max {np.max(np.abs(a - b)):.4f}")
+    print(f"spearman(fp32, int8): {corr:.4f}")
+
+
+def check(modelDir, repoDir, modelType, samples, maxLength, topK):
+    if not os.path.exists(os.path.join(modelDir, QUANTIZED_MODEL_FILE)):
+        sys.exit(f"{QUANTIZED_MODEL_FILE} not found in {modelDir}, run `quantize` first")
+    chunks = sampleChunks(repoDir, samples, maxChars=maxLength * 2)
+    if len(chunks) < topK:
+        sys.exit(f"not enough text in {repoDir}, only {len(chunks)} chunks found")
+    fp32 = Model(modelDir, MODEL_FILE, maxLength)
+    int8 = Model(modelDir, QUANTIZED_MODEL_FILE, maxLength)
+    print(f"{len(chunks)} chunks sampled from {repoDir}")
+    if modelType == "embedding":
+        checkEmbedding(fp32, int8, chunks, topK)
+    else:
+        checkRerank(fp32, int8, chunks)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="int8 quantization for PocketRAG local models")
+    sub = parser.add_subparsers(dest="command", required=True)
+    q = sub.add_parser("quantize")
+    q.add_argument("modelDir")
+    c = sub.add_parser("check")
+    c.add_argument("modelDir")
+    c.add_argument("repoDir")
+    c.add_argument("--type", choices=["embedding", "rerank"], default="embedding")
+    c.add_argument("--samples", type=int, default=200)
+    c.add_argument("--maxLength", type=int, default=512)
+    c.add_argument("--topK", type=int, default=10)
+    args = parser.parse_args()
+
+    if args.command == "quantize":
+        quantize(args.modelDir)
+    else:
+        check(args.modelDir, args.repoDir, args.type, args.samples, args.maxLength, args.topK)
+
+
+if __name__ == "__main__":
+    main()